@@ -0,0 +1,371 @@
+#include <dsp56kEmu/dsp.h>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <sstream>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "../dsp56720/peripherals.h"
+#include "../dsp56720/debugger.h"
+#include "../dsp56720/queue.h"
+#include "../dsp56720/shi.h"
+#include "../dsp56720/esai.h"
+#include "../dsp56720/cgm.h"
+#include "../dsp56720/ccm.h"
+#include "../dsp56720/chipid.h"
+#include "../vfs/filesystem.h"
+#include "../vfs/traits.h"
+
+using Clock = std::chrono::steady_clock;
+using BenchQueue = dsp56720::Queue<uint32_t, dsp56720::CircularBuffer<uint32_t, 8192>>;
+
+template <>
+struct vfs::SequentialAccess<BenchQueue> {
+	static constexpr bool readable = true;
+	static constexpr bool writable = true;
+
+	void readBlock(BenchQueue& queue, uint32_t* words, size_t count) {
+		try {
+			queue.pop(words, count);
+		} catch(dsp56720::QueueShutdown&) {
+			throw vfs::Abort{};
+		}
+	}
+
+	void writeBlock(BenchQueue& queue, const uint32_t* words, size_t count) {
+		try {
+			queue.push(words, count);
+		} catch(dsp56720::QueueShutdown&) {
+			throw vfs::Abort{};
+		}
+	}
+};
+
+struct Result {
+	std::string name;
+	std::string unit;
+	double value;
+};
+
+// Median of several runs of fn, which returns the measured value
+double median(size_t runs, std::function<double()> fn) {
+	std::vector<double> values;
+
+	fn(); // warm up
+	for (size_t i = 0; i < runs; i++) {
+		values.push_back(fn());
+	}
+
+	std::sort(values.begin(), values.end());
+	return values[values.size() / 2];
+}
+
+double seconds(Clock::time_point start) {
+	return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+double queueThroughput(size_t words, size_t block) {
+	BenchQueue queue;
+	std::vector<uint32_t> buffer(block);
+
+	auto start = Clock::now();
+	std::thread producer([&]() {
+		std::vector<uint32_t> data(block, 0x123456);
+		for (size_t i = 0; i < words; i += block) {
+			if (block == 1) {
+				queue.push(data[0]);
+			} else {
+				queue.push(data.data(), block);
+			}
+		}
+	});
+
+	for (size_t i = 0; i < words; i += block) {
+		if (block == 1) {
+			buffer[0] = queue.pop();
+		} else {
+			queue.pop(buffer.data(), block);
+		}
+	}
+
+	producer.join();
+	return words / seconds(start) / 1e6;
+}
+
+double dispatchLatency(dsp56720::Peripherals& peripherals, dsp56k::EMemArea area,
+		dsp56k::TWord address, bool write, size_t iterations) {
+	volatile dsp56k::TWord sink = 0;
+
+	auto start = Clock::now();
+	for (size_t i = 0; i < iterations; i++) {
+		if (write) {
+			peripherals.write(area, address, i & 0xffffff);
+		} else {
+			sink = sink + peripherals.read(area, address, dsp56k::Nop);
+		}
+	}
+
+	return seconds(start) / iterations * 1e9;
+}
+
+// Throughput through a loopback FUSE mount: a writer pushes into a queue
+// through one file while a reader drains it through another. The VFS opens
+// files with direct I/O, so the kernel neither caches reads nor clamps them
+// to the reported size, and only bytes the reader got back are counted.
+double fuseThroughput(size_t bytes) {
+	char mountPoint[] = "/tmp/dsp56720-bench-XXXXXX";
+	if (!mkdtemp(mountPoint)) {
+		return 0;
+	}
+
+	BenchQueue queue;
+	double result = 0;
+
+	{
+		vfs::Filesystem fs(mountPoint);
+		fs.tree().put("/loopback", vfs::SequentialFile<uint32_t, BenchQueue>{queue});
+		std::thread server([&]() { fs.run(); });
+
+		auto path = std::string(mountPoint) + "/loopback";
+		int in = open(path.c_str(), O_WRONLY);
+		int out = open(path.c_str(), O_RDONLY);
+
+		if (in >= 0 && out >= 0) {
+			std::vector<char> block(64 * 1024, 0x55);
+			size_t received = 0;
+			auto start = Clock::now();
+
+			std::thread reader([&]() {
+				std::vector<char> buffer(block.size());
+				while (received < bytes) {
+					auto n = read(out, buffer.data(), buffer.size());
+					if (n <= 0) {
+						break;
+					}
+
+					received += n;
+				}
+
+				// A reader that gave up must not leave the writer blocked on
+				// a full queue
+				if (received < bytes) {
+					queue.shutdown();
+				}
+			});
+
+			size_t sent = 0;
+			while (sent < bytes) {
+				auto n = write(in, block.data(), block.size());
+				if (n <= 0) {
+					break;
+				}
+
+				sent += n;
+			}
+
+			// Likewise for a reader waiting on data that won't come
+			if (sent < bytes) {
+				queue.shutdown();
+			}
+
+			reader.join();
+			result = received / seconds(start) / 1e6;
+		}
+
+		if (in >= 0) {
+			close(in);
+		}
+
+		if (out >= 0) {
+			close(out);
+		}
+
+		queue.shutdown();
+		fs.shutdown();
+		server.join();
+	}
+
+	rmdir(mountPoint);
+	return result;
+}
+
+struct System {
+	dsp56720::ClockGenerationModule cgm;
+	dsp56720::ChipConfigurationModule ccm;
+	dsp56720::SerialHostPort<0> shi;
+	dsp56720::EnhancedSerialAudioPort<0> esai{cgm};
+	dsp56720::ChipIdentification chidr{0};
+	dsp56720::Peripherals peripherals{cgm, ccm, shi, esai, chidr};
+
+	dsp56k::DefaultMemoryValidator memoryMap;
+	dsp56k::Memory memory{memoryMap, 0xf80000};
+	dsp56k::DSP dsp{memory, peripherals};
+
+	// Connects the peripherals to the core, without it every benchmark
+	// would run peripherals that can't raise interrupts or see the clock
+	System() {
+		peripherals.reset();
+	}
+};
+
+// Cost per instruction of running through Debugger::exec, executing the NOPs
+// of zeroed program memory
+double debuggerOverhead(size_t instructions, bool useDebugger) {
+	System system;
+	dsp56720::Debugger debugger{false};
+	system.dsp.setPC(0x100);
+
+	auto start = Clock::now();
+	for (size_t i = 0; i < instructions; i++) {
+		if (useDebugger) {
+			debugger.exec(system.dsp);
+		} else {
+			system.dsp.exec();
+		}
+
+		if ((i & 0xfff) == 0xfff) {
+			system.dsp.setPC(0x100);
+		}
+	}
+
+	return seconds(start) / instructions * 1e9;
+}
+
+// Boot a firmware image in the SHI boot stream format (count, address,
+// words as 32-bit little endian) and measure ESAI frames per second
+double esaiFramesPerSecond(const std::string& firmware, double duration) {
+	std::ifstream in(firmware, std::ios::binary);
+	std::vector<uint32_t> image;
+	uint32_t word;
+
+	while (in.read(reinterpret_cast<char*>(&word), sizeof(word))) {
+		image.push_back(word);
+	}
+
+	if (image.size() < 2 || image.size() < image[0] + 2) {
+		return 0;
+	}
+
+	System system;
+	for (uint32_t i = 0; i < image[0]; i++) {
+		system.memory.set(dsp56k::MemArea_P, image[1] + i, image[i + 2] & 0xffffff);
+	}
+
+	system.dsp.setPC(image[1]);
+
+	std::atomic<bool> running{true};
+	std::vector<std::thread> drains;
+
+	for (size_t i = 0; i < system.esai.outputs(); i++) {
+		drains.emplace_back([&, i]() {
+			try {
+				while (running) {
+					system.esai.output(i).readSample();
+				}
+			} catch (dsp56720::QueueShutdown&) {
+			}
+		});
+	}
+
+	for (size_t i = 0; i < system.esai.inputs(); i++) {
+		drains.emplace_back([&, i]() {
+			try {
+				while (running) {
+					system.esai.input(i).writeSample(0);
+				}
+			} catch (dsp56720::QueueShutdown&) {
+			}
+		});
+	}
+
+	auto start = Clock::now();
+	auto frames = system.esai.frames();
+	while (seconds(start) < duration) {
+		for (size_t i = 0; i < 4096; i++) {
+			system.dsp.exec();
+		}
+	}
+
+	auto result = (system.esai.frames() - frames) / seconds(start);
+
+	running = false;
+	system.peripherals.terminate();
+	for (auto& thread : drains) {
+		thread.join();
+	}
+
+	return result;
+}
+
+int main(int argc, char *argv[]) {
+	std::string firmware;
+	size_t runs = 5;
+
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+
+		if (arg == "--firmware" && i + 1 < argc) {
+			firmware = argv[++i];
+		} else if (arg == "--runs" && i + 1 < argc) {
+			try {
+				runs = std::stoul(argv[++i]);
+				if (!runs) {
+					throw std::out_of_range(argv[i]);
+				}
+			} catch (std::exception&) {
+				std::cerr << "Invalid runs " << argv[i] << std::endl;
+				return 1;
+			}
+		} else {
+			std::cerr << "Usage: " << argv[0] << " [--firmware IMAGE] [--runs N]" << std::endl;
+			return 1;
+		}
+	}
+
+	std::vector<Result> results;
+
+	results.push_back({"queue_throughput_single", "Mwords/s",
+		median(runs, [] { return queueThroughput(1 << 22, 1); })});
+	results.push_back({"queue_throughput_block256", "Mwords/s",
+		median(runs, [] { return queueThroughput(1 << 24, 256); })});
+
+	{
+		System system;
+
+		results.push_back({"peripherals_read_chidr", "ns/op", median(runs, [&] {
+			return dispatchLatency(system.peripherals, dsp56k::MemArea_X, 0xFFFFF5, false, 1 << 22);
+		})});
+		results.push_back({"peripherals_write_hsar", "ns/op", median(runs, [&] {
+			return dispatchLatency(system.peripherals, dsp56k::MemArea_X, 0xFFFF92, true, 1 << 22);
+		})});
+	}
+
+	results.push_back({"debugger_exec", "ns/instruction",
+		median(runs, [] { return debuggerOverhead(1 << 22, true); })});
+	results.push_back({"dsp_exec", "ns/instruction",
+		median(runs, [] { return debuggerOverhead(1 << 22, false); })});
+
+	results.push_back({"fuse_loopback_throughput", "MB/s",
+		median(runs, [] { return fuseThroughput(64 << 20); })});
+
+	if (!firmware.empty()) {
+		results.push_back({"esai_frames", "frames/s",
+			median(runs, [&] { return esaiFramesPerSecond(firmware, 2.0); })});
+	}
+
+	std::cout << "{\n  \"benchmarks\": [\n";
+	for (size_t i = 0; i < results.size(); i++) {
+		std::cout << "    {\"name\": \"" << results[i].name << "\", \"unit\": \""
+			<< results[i].unit << "\", \"value\": " << results[i].value << "}"
+			<< (i + 1 < results.size() ? "," : "") << "\n";
+	}
+	std::cout << "  ]\n}" << std::endl;
+
+	return 0;
+}
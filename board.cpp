@@ -0,0 +1,89 @@
+#include "board.h"
+
+#include <iostream>
+
+Board::Board(std::vector<std::unique_ptr<Chip>>& chips) : m_chips(chips) {
+	for (size_t i = 0; i < chips.size(); i++) {
+		m_parent.push_back(i);
+	}
+}
+
+bool Board::parse(const std::string& text, Endpoint& endpoint) {
+	auto colon = text.find(':');
+	if (colon == std::string::npos) {
+		return false;
+	}
+
+	auto name = text.substr(colon + 1);
+	auto digits = name.find_first_of("0123456789");
+	if (digits == std::string::npos) {
+		return false;
+	}
+
+	try {
+		endpoint.chip = std::stoul(text.substr(0, colon));
+		endpoint.index = std::stoul(name.substr(digits));
+	} catch (std::exception&) {
+		return false;
+	}
+
+	endpoint.name = name.substr(0, digits);
+	return endpoint.chip < m_chips.size();
+}
+
+bool Board::connect(const std::string& spec) {
+	auto split = spec.find('=');
+	Endpoint from, to;
+	if (split == std::string::npos || !parse(spec.substr(0, split), from)
+			|| !parse(spec.substr(split + 1), to) || from.chip == to.chip) {
+		return false;
+	}
+
+	auto& source = *m_chips[from.chip];
+	auto& sink = *m_chips[to.chip];
+
+	if (from.name == "output" && to.name == "input") {
+		if (from.index >= source.esai().outputs() || to.index >= sink.esai().inputs()) {
+			return false;
+		}
+
+		auto& output = source.esai().output(from.index);
+		auto& input = sink.esai().input(to.index);
+
+		if (!input.connect(output)) {
+			std::cerr << "Connected ESAI endpoints can't block: " << spec << std::endl;
+			return false;
+		}
+	} else if (from.name == "shi" && to.name == "shi" && from.index < 2 && to.index < 2) {
+		dsp56720::SerialHostInterace::connect(source.shi(from.index), sink.shi(to.index));
+	} else {
+		return false;
+	}
+
+	m_parent[find(from.chip)] = find(to.chip);
+	return true;
+}
+
+size_t Board::find(size_t chip) {
+	while (m_parent[chip] != chip) {
+		chip = m_parent[chip] = m_parent[m_parent[chip]];
+	}
+
+	return chip;
+}
+
+std::vector<std::vector<Chip*>> Board::groups() {
+	std::vector<std::vector<Chip*>> groups(m_chips.size());
+	for (size_t i = 0; i < m_chips.size(); i++) {
+		groups[find(i)].push_back(m_chips[i].get());
+	}
+
+	std::vector<std::vector<Chip*>> result;
+	for (auto& group : groups) {
+		if (!group.empty()) {
+			result.push_back(std::move(group));
+		}
+	}
+
+	return result;
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "chip.h"
+
+// In-process wiring between chip instances. Connected ESAI endpoints share
+// one queue and linked SHIs deliver straight into each other's FIFO, so
+// samples never pass through the VFS.
+class Board {
+public:
+	Board(std::vector<std::unique_ptr<Chip>>& chips);
+
+	// "A:outputN=B:inputM" feeds ESAI output N of chip A into input M of
+	// chip B, "A:shi1=B:shi0" links the SHIs of A (master) and B (slave)
+	bool connect(const std::string& spec);
+
+	// Sets of chips wired together directly or indirectly. Each set is
+	// scheduled as one task so its chips advance in lockstep quanta.
+	std::vector<std::vector<Chip*>> groups();
+
+private:
+	struct Endpoint {
+		size_t chip;
+		std::string name;
+		size_t index;
+	};
+
+	bool parse(const std::string& text, Endpoint& endpoint);
+	size_t find(size_t chip);
+
+	std::vector<std::unique_ptr<Chip>>& m_chips;
+	std::vector<size_t> m_parent;
+};
@@ -0,0 +1,425 @@
+#include "chip.h"
+#include "interfaces.h"
+
+#include <iostream>
+
+Chip::Chip(vfs::Filesystem& fs, const ChipConfig& config, const dsp56720::SymbolMap& symbols)
+	: m_config(config) {
+	m_memory.setExternalMemory(m_config.externalBase, true);
+
+	m_peripherals.setInterruptController(m_intc);
+	for (auto& [clock, rate] : config.clocks) {
+		m_cgm.setClockRate(clock, rate);
+	}
+
+	m_peripherals.setSymbols(m_disasm);
+	symbols.addTo(m_disasm);
+	m_debugger.attach(m_dsp, m_peripherals, m_guard);
+
+	auto configure = [&](dsp56720::EnhancedSerialAudioInterface& esai) {
+		for (size_t i = 0; i < esai.outputs(); i++) {
+			esai.output(i).setPolicy(config.outputPolicy);
+			if (config.esaiDepth) {
+				esai.output(i).setCapacity(config.esaiDepth);
+			}
+		}
+
+		for (size_t i = 0; i < esai.inputs(); i++) {
+			esai.input(i).setPolicy(config.inputPolicy);
+			esai.input(i).setDoorbell(&m_doorbell);
+			if (config.esaiDepth) {
+				esai.input(i).setCapacity(config.esaiDepth);
+			}
+		}
+	};
+
+	configure(m_esai);
+	configure(m_esai1);
+
+	// Files stream to and from the first ESAI
+	for (size_t i = 0; i < m_esai.outputs(); i++) {
+		m_sinks.push_back(std::make_unique<dsp56720::AudioFileSink>(
+					m_esai.output(i), m_cgm.sampleRate()));
+	}
+
+	for (size_t i = 0; i < m_esai.inputs(); i++) {
+		m_sources.push_back(std::make_unique<dsp56720::AudioFileSource>(m_esai.input(i)));
+	}
+
+	// Everything the host writes to can end a park
+	m_spdif.receiver().setDoorbell(&m_doorbell);
+	m_spdif.receiverPcm().setDoorbell(&m_doorbell);
+	m_shi0.setDoorbell(&m_doorbell);
+	m_shi1.setDoorbell(&m_doorbell);
+
+	if (config.shiDepth) {
+		m_shi0.setCapacity(config.shiDepth);
+		m_shi1.setCapacity(config.shiDepth);
+	}
+
+	// Only the first ESAI is paced, the one files stream through. A second
+	// pacer on ESAI_1 would wait on its own timeline and stall the first.
+	if (!config.pace.empty()) {
+		m_pacer = std::make_unique<dsp56720::Pacer>(config.pace == "host"
+					? dsp56720::Pacer::Mode::HostClock : dsp56720::Pacer::Mode::Consumer,
+				m_cgm.sampleRate(), config.paceTarget);
+		m_esai.setPacer(m_pacer.get());
+	}
+
+	if (config.profileInterval) {
+		m_profiler = std::make_unique<dsp56720::Profiler>(config.profileInterval,
+				config.profileStacks, symbols, m_disasm, m_disasmMutex);
+	}
+
+	if (!config.debugSocket.empty()) {
+		m_debugServer = std::make_unique<dsp56720::DebugServer>(config.debugSocket,
+				m_debugger, m_dsp, m_image, m_config.externalBase, m_disasm, m_disasmMutex);
+		m_debugThread = std::thread([this]() { m_debugServer->run(); });
+	}
+
+	publish(fs, symbols);
+}
+
+void Chip::start() {
+	for (auto& [index, path] : m_config.sinks) {
+		if (index >= m_sinks.size() || !m_sinks[index]->open(path)) {
+			std::cerr << label() << "Can't record output" << index << " to " << path << std::endl;
+		}
+	}
+
+	for (auto& [index, path] : m_config.sources) {
+		if (index >= m_sources.size() || !m_sources[index]->open(path)) {
+			std::cerr << label() << "Can't play " << path << " into input" << index << std::endl;
+		}
+	}
+
+	if (m_config.cuse) {
+		publishDevices();
+	}
+}
+
+Chip::~Chip() {
+	for (auto& sink : m_sinks) {
+		sink->close();
+	}
+
+	for (auto& source : m_sources) {
+		source->close();
+	}
+
+	if (m_debugThread.joinable()) {
+		m_debugThread.join();
+	}
+}
+
+void Chip::publish(vfs::Filesystem& fs, const dsp56720::SymbolMap& symbols) {
+	auto& prefix = m_config.prefix;
+
+	// TODO: Use a EnumInterface mapping '0' -> 0 and '1' -> 1
+	fs.tree().put(prefix + "/pins/reset", PinInterface{m_reset, &m_doorbell});
+	fs.tree().put(prefix + "/pins/moda0", PinInterface{m_moda0, &m_doorbell});
+
+	publishEsai(fs, m_esai, prefix + "/peripherals/esai", true);
+	publishEsai(fs, m_esai1, prefix + "/peripherals/esai1", false);
+	publishSpdif(fs, prefix + "/peripherals/spdif");
+	publishShi(fs, m_shi0, m_shi0bytes, prefix + "/peripherals/shi0");
+	publishShi(fs, m_shi1, m_shi1bytes, prefix + "/peripherals/shi1");
+
+	// Register files show the last value the core read or wrote, not the
+	// peripheral's current state: read handlers have side effects and only
+	// run on the emulation thread. A flag a peripheral set since, like TDE,
+	// appears once the firmware reads the register.
+	for (auto& peripheral : m_peripherals.peripherals()) {
+		for (auto& reg : peripheral.get().registers()) {
+			auto address = reg.address;
+			fs.tree().put(prefix + format("/registers/%s/%s", peripheral.get().name(), reg.name),
+				TextInterface{[this, address]() {
+					return format("%06x\n", m_peripherals.snapshot(address));
+				}});
+		}
+	}
+
+	auto core = [&](std::string name, auto field) {
+		fs.tree().put(prefix + "/registers/core/" + name, TextInterface{[this, field]() {
+			auto regs = m_snapshot.read();
+			return format("%06llx\n", (unsigned long long)field(regs));
+		}});
+	};
+
+	core("pc", [](auto& regs) { return regs.pc; });
+	core("sr", [](auto& regs) { return regs.sr; });
+	core("omr", [](auto& regs) { return regs.omr; });
+	core("sp", [](auto& regs) { return regs.sp; });
+	core("la", [](auto& regs) { return regs.la; });
+	core("lc", [](auto& regs) { return regs.lc; });
+	core("vba", [](auto& regs) { return regs.vba; });
+	core("a", [](auto& regs) { return regs.a; });
+	core("b", [](auto& regs) { return regs.b; });
+	core("x", [](auto& regs) { return regs.x; });
+	core("y", [](auto& regs) { return regs.y; });
+
+	for (size_t i = 0; i < 8; i++) {
+		core("r" + std::to_string(i), [i](auto& regs) { return regs.r[i]; });
+		core("n" + std::to_string(i), [i](auto& regs) { return regs.n[i]; });
+		core("m" + std::to_string(i), [i](auto& regs) { return regs.m[i]; });
+	}
+
+	fs.tree().put(prefix + "/perf", TextInterface{[this]() {
+		return m_perf.report() + "dma_words " + std::to_string(m_dma.words()) + "\n"
+			+ "asrc_frames " + std::to_string(m_asrc.frames())
+			+ " kernel " + dsp56720::resamplerKernel() + "\n"
+			+ "spdif_blocks " + std::to_string(m_spdif.blocks()) + "\n"
+			+ format("idle_skipped_cycles %llu skips %llu\n",
+				(unsigned long long)m_idle.skippedCycles(), (unsigned long long)m_idle.skips())
+			+ "doorbell_rings " + std::to_string(m_doorbell.rings()) + "\n"
+			+ "external_resident_kb " + std::to_string(m_image.resident() / 1024) + "\n"
+			+ (m_emc.timing() ? format("burst_buffer hits %llu misses %llu wait_states %llu\n",
+				(unsigned long long)m_emc.hits(), (unsigned long long)m_emc.misses(),
+				(unsigned long long)m_emc.totalWaitStates()) : "")
+			+ (m_pacer ? m_pacer->report() : "");
+	}});
+
+	if (m_profiler) {
+		fs.tree().put(prefix + "/profile/flat", TextInterface{[this]() {
+			return m_profiler->flatReport(m_dsp);
+		}});
+		fs.tree().put(prefix + "/profile/folded", TextInterface{[this]() {
+			return m_profiler->foldedStacks();
+		}});
+	}
+
+	fs.tree().put(prefix + "/memory/p", MemoryInterface{m_memory, m_image,
+		m_config.externalBase, dsp56k::MemArea_P, m_config.memorySize()});
+	fs.tree().put(prefix + "/memory/x", MemoryInterface{m_memory, m_image,
+		m_config.externalBase, dsp56k::MemArea_X, m_config.memorySize()});
+	fs.tree().put(prefix + "/memory/y", MemoryInterface{m_memory, m_image,
+		m_config.externalBase, dsp56k::MemArea_Y, m_config.memorySize()});
+}
+
+void Chip::publishEsai(vfs::Filesystem& fs, dsp56720::EnhancedSerialAudioInterface& esai,
+		const std::string& directory, bool files) {
+	for (size_t i = 0; i < esai.outputs(); i++) {
+		auto path = directory + format("/output%d", i);
+		fs.tree().put(path,
+				vfs::SequentialFile<uint32_t,
+					dsp56720::EnhancedSerialAudioInterface::Output>{
+						esai.output(i)});
+		fs.tree().put(path + ".policy",
+				PolicyInterface<dsp56720::EnhancedSerialAudioInterface::Output>{
+					esai.output(i)});
+		fs.tree().put(path + ".depth",
+				DepthInterface<dsp56720::EnhancedSerialAudioInterface::Output>{
+					esai.output(i)});
+		if (files) {
+			fs.tree().put(path + ".file",
+					AudioFileInterface<dsp56720::AudioFileSink>{*m_sinks[i]});
+		}
+	}
+
+	for (size_t i = 0; i < esai.inputs(); i++) {
+		auto path = directory + "/input" + std::to_string(i);
+		fs.tree().put(path,
+				vfs::SequentialFile<uint32_t,
+					dsp56720::EnhancedSerialAudioInterface::Input>{
+						esai.input(i)});
+		fs.tree().put(path + ".policy",
+				PolicyInterface<dsp56720::EnhancedSerialAudioInterface::Input>{
+					esai.input(i)});
+		fs.tree().put(path + ".depth",
+				DepthInterface<dsp56720::EnhancedSerialAudioInterface::Input>{
+					esai.input(i)});
+		if (files) {
+			fs.tree().put(path + ".file",
+					AudioFileInterface<dsp56720::AudioFileSource>{*m_sources[i]});
+		}
+	}
+}
+
+void Chip::publishSpdif(vfs::Filesystem& fs, const std::string& directory) {
+	using Output = dsp56720::EnhancedSerialAudioInterface::Output;
+	using Input = dsp56720::EnhancedSerialAudioInterface::Input;
+	using Bits = dsp56720::SpdifTransceiver::Bits;
+
+	auto output = [&](const std::string& path, Output& endpoint) {
+		fs.tree().put(path, vfs::SequentialFile<uint32_t, Output>{endpoint});
+		fs.tree().put(path + ".policy", PolicyInterface<Output>{endpoint});
+		fs.tree().put(path + ".depth", DepthInterface<Output>{endpoint});
+	};
+
+	auto input = [&](const std::string& path, Input& endpoint) {
+		fs.tree().put(path, vfs::SequentialFile<uint32_t, Input>{endpoint});
+		fs.tree().put(path + ".policy", PolicyInterface<Input>{endpoint});
+		fs.tree().put(path + ".depth", DepthInterface<Input>{endpoint});
+	};
+
+	// Channel status and user bits as hex, first byte first
+	auto bits = [&](const std::string& path, std::function<Bits()> read) {
+		fs.tree().put(path, TextInterface{[read]() {
+			std::string text;
+			for (auto byte : read()) {
+				text += format("%02x", byte);
+			}
+
+			return text + "\n";
+		}});
+	};
+
+	output(directory + "/tx", m_spdif.transmitter());
+	output(directory + "/tx.pcm", m_spdif.transmitterPcm());
+	input(directory + "/rx", m_spdif.receiver());
+	input(directory + "/rx.pcm", m_spdif.receiverPcm());
+
+	bits(directory + "/tx.status", [this]() { return m_spdif.transmitStatus(); });
+	bits(directory + "/rx.status", [this]() { return m_spdif.receiveStatus(); });
+	bits(directory + "/rx.user", [this]() { return m_spdif.receiveUser(); });
+}
+
+void Chip::publishShi(vfs::Filesystem& fs, dsp56720::SerialHostInterace& shi,
+		dsp56720::SerialHostInterace::ByteStream& bytes, const std::string& path) {
+	fs.tree().put(path,
+			vfs::SequentialFile<uint32_t, dsp56720::SerialHostInterace>{shi});
+
+	fs.tree().put(path + ".bytes",
+			vfs::SequentialFile<uint8_t,
+				dsp56720::SerialHostInterace::ByteStream>{bytes});
+
+	fs.tree().put(path + ".depth",
+			DepthInterface<dsp56720::SerialHostInterace>{shi});
+}
+
+void Chip::publishDevices() {
+	using Output = dsp56720::EnhancedSerialAudioInterface::Output;
+	using Input = dsp56720::EnhancedSerialAudioInterface::Input;
+
+	auto name = std::string("dsp56720-") + (m_config.prefix.empty() ? "" : m_config.prefix.substr(1) + "-");
+	auto rate = [this]() { return m_cgm.sampleRate(); };
+
+	try {
+		for (size_t i = 0; i < m_esai.outputs(); i++) {
+			m_devices.push_back(std::make_unique<vfs::CharacterDevice>(name + format("esai-out%d", i),
+					std::make_shared<vfs::StreamFile<uint32_t, Output>>(m_esai.output(i), rate)));
+		}
+
+		for (size_t i = 0; i < m_esai.inputs(); i++) {
+			m_devices.push_back(std::make_unique<vfs::CharacterDevice>(name + format("esai-in%d", i),
+					std::make_shared<vfs::StreamFile<uint32_t, Input>>(m_esai.input(i), rate)));
+		}
+
+		m_devices.push_back(std::make_unique<vfs::CharacterDevice>(name + "shi0",
+				std::make_shared<vfs::StreamFile<uint32_t, dsp56720::SerialHostInterace>>(m_shi0)));
+	} catch (std::exception& e) {
+		std::cerr << label() << e.what() << std::endl;
+	}
+}
+
+bool Chip::boot() {
+	if (!m_bootHeader) {
+		if (m_shi0.received() < 2) {
+			return false;
+		}
+
+		m_bootCount = m_shi0.readRX();
+		m_bootAddress = m_shi0.readRX();
+		m_bootHeader = true;
+
+		std::cout << label() << "Booting count=" << m_bootCount
+			<< " words to address=" << m_bootAddress << std::endl;
+	}
+
+	// Only the emulation side pops RX, so this never blocks
+	while (m_bootLoaded < m_bootCount && m_shi0.received()) {
+		auto word = m_shi0.readRX();
+		m_dsp.memory().set(dsp56k::MemArea_P, m_bootAddress + m_bootLoaded++, word);
+	}
+
+	if (m_bootLoaded < m_bootCount) {
+		return false;
+	}
+
+	m_dsp.setPC(m_bootAddress);
+	m_booted = true;
+
+	std::cout << label() << "Booted" << std::endl;
+	return true;
+}
+
+dsp56720::Scheduler::Result Chip::slice() {
+	using Result = dsp56720::Scheduler::Result;
+
+	if (!m_running) {
+		return Result::Done;
+	}
+
+	try {
+		// The boot loader waits for SHI words, which ring the doorbell
+		if (!m_booted && !boot()) {
+			return m_config.park ? Result::Parked : Result::Idle;
+		}
+
+		// A stopped core would block the worker, leave it to the debugger
+		if (m_debugger.active() && m_debugger.stopped()) {
+			return Result::Idle;
+		}
+
+		if (m_pacer && !m_pacer->resume(dsp56720::Scheduler::Clock::now())) {
+			return Result::Paced;
+		}
+
+		for (uint32_t i = 0; i < m_config.quantum && m_running; i++) {
+			m_debugger.exec(m_dsp);
+			m_snapshot.poll(m_dsp);
+			m_perf.tick();
+
+			if (m_profiler) {
+				m_profiler->tick(m_dsp);
+			}
+
+			if (m_debugger.active() && m_debugger.stopped()) {
+				break;
+			}
+
+			// Ahead of the host clock, the scheduler holds the chip back
+			// instead of the pacer sleeping on the worker
+			if (m_pacer && m_pacer->waiting()) {
+				return Result::Paced;
+			}
+
+			// Breakpoints and watchpoints need every instruction executed
+			if (m_config.fastForward && !m_debugger.active() && m_idle.step(m_dsp, m_peripherals)) {
+				// Skipped cycles count towards the quantum, so chips of a
+				// group stay in step. With nothing timed left to wait for
+				// only the host can end the wait, so park until it rings.
+				auto idle = m_peripherals.idleCycles();
+				auto cycles = std::min(idle, m_config.quantum - i - 1);
+				m_peripherals.advance(cycles);
+				m_idle.skipped(cycles);
+				i += cycles;
+
+				if (idle == dsp56720::Peripheral::unbounded) {
+					return m_config.park ? Result::Parked : Result::Idle;
+				}
+			}
+		}
+	} catch(dsp56720::QueueShutdown&) {
+		return Result::Done;
+	}
+
+	return Result::Ran;
+}
+
+void Chip::shutdown() {
+	m_running = false;
+	m_dsp.terminate();
+
+	// Wake debugger threads to allow everything to terminate
+	if (m_debugServer) {
+		m_debugServer->shutdown();
+	}
+
+	m_debugger.continueExecution();
+	m_doorbell.ring();
+
+	for (auto& device : m_devices) {
+		device->shutdown();
+	}
+}
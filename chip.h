@@ -0,0 +1,187 @@
+#pragma once
+
+#include <dsp56kEmu/dsp.h>
+#include <dsp56kEmu/disasm.h>
+#include <dsp56kEmu/opcodes.h>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "dsp56720/peripherals.h"
+#include "dsp56720/debugger.h"
+#include "dsp56720/debugserver.h"
+#include "dsp56720/shi.h"
+#include "dsp56720/esai.h"
+#include "dsp56720/cgm.h"
+#include "dsp56720/ccm.h"
+#include "dsp56720/chipid.h"
+#include "dsp56720/dma.h"
+#include "dsp56720/intc.h"
+#include "dsp56720/tec.h"
+#include "dsp56720/asrc.h"
+#include "dsp56720/spdif.h"
+#include "dsp56720/emc.h"
+#include "dsp56720/guard.h"
+#include "dsp56720/idle.h"
+#include "dsp56720/doorbell.h"
+#include "dsp56720/audiofile.h"
+#include "dsp56720/inspector.h"
+#include "dsp56720/pacer.h"
+#include "dsp56720/perf.h"
+#include "dsp56720/profiler.h"
+#include "dsp56720/scheduler.h"
+#include "vfs/filesystem.h"
+#include "vfs/cuse.h"
+
+struct ChipConfig {
+	// VFS directory of the instance, empty for the root
+	std::string prefix;
+
+	std::string debugSocket;
+	uint32_t profileInterval = 0;
+	bool profileStacks = false;
+	dsp56720::Policy outputPolicy = dsp56720::Policy::DropOldest;
+	dsp56720::Policy inputPolicy = dsp56720::Policy::ZeroFill;
+	std::string pace;
+	size_t paceTarget = 256;
+	size_t esaiDepth = 0;
+	size_t shiDepth = 0;
+
+	// ESAI endpoints streamed to or from files, by index
+	std::vector<std::pair<size_t, std::string>> sinks;
+	std::vector<std::pair<size_t, std::string>> sources;
+
+	// Audio clock rates by ClockGenerationModule::Clock
+	std::vector<std::pair<uint32_t, uint32_t>> clocks;
+
+	// External memory from externalBase to the end of memory, optionally
+	// backed by a file, and whether its accesses cost wait states
+	dsp56k::TWord externalBase = 0x020000;
+	dsp56k::TWord externalSize = 0xf60000;
+	std::string externalFile;
+	bool externalTiming = false;
+
+	dsp56k::TWord memorySize() const { return externalBase + externalSize; }
+
+	// Let time pass to the next peripheral event instead of executing
+	// idle polling loops
+	bool fastForward = true;
+
+	// Take the chip off the workers while it waits for the host, instead
+	// of retrying every Scheduler::idleDelay
+	bool park = true;
+
+	// Also expose the streams as /dev/dsp56720-* character devices
+	bool cuse = false;
+
+	// Instructions per scheduler slice and share of a core
+	uint32_t quantum = 16384;
+	double budget = 1.0;
+};
+
+// One emulated DSP56720 with its peripherals and VFS subtree
+class Chip {
+public:
+	Chip(vfs::Filesystem& fs, const ChipConfig& config, const dsp56720::SymbolMap& symbols);
+	~Chip();
+
+	// Start the file streams and character devices, whose threads use the
+	// queues. Call once the board is wired, connecting replaces queues.
+	void start();
+
+	// Run up to one quantum of instructions, called by the scheduler
+	dsp56720::Scheduler::Result slice();
+
+	// When a slice that returned Paced may run again
+	dsp56720::Scheduler::Clock::time_point resumeTime() const { return m_pacer->resumeTime(); }
+
+	// Wake everything blocked on this chip, safe to call from any thread
+	void shutdown();
+
+	// Called whenever the host hands a parked chip something to do. Only
+	// set before the chip runs.
+	void setWakeHandler(std::function<void()> handler) { m_doorbell.setHandler(std::move(handler)); }
+
+	std::string summary() { return m_perf.summary(); }
+
+	dsp56720::EnhancedSerialAudioInterface& esai() { return m_esai; }
+	dsp56720::EnhancedSerialAudioInterface& esai1() { return m_esai1; }
+	dsp56720::SerialHostInterace& shi0() { return m_shi0; }
+	dsp56720::SerialHostInterace& shi(size_t n) { return n ? static_cast<dsp56720::SerialHostInterace&>(m_shi1) : m_shi0; }
+	const ChipConfig& config() const { return m_config; }
+
+private:
+	bool boot();
+	std::string label() const { return m_config.prefix.empty() ? "" : m_config.prefix.substr(1) + ": "; }
+	void publish(vfs::Filesystem& fs, const dsp56720::SymbolMap& symbols);
+	void publishDevices();
+	void publishEsai(vfs::Filesystem& fs, dsp56720::EnhancedSerialAudioInterface& esai,
+			const std::string& directory, bool files);
+	void publishSpdif(vfs::Filesystem& fs, const std::string& directory);
+	void publishShi(vfs::Filesystem& fs, dsp56720::SerialHostInterace& shi,
+			dsp56720::SerialHostInterace::ByteStream& bytes, const std::string& path);
+
+	ChipConfig m_config;
+	std::atomic<bool> m_running{true};
+	std::atomic<bool> m_reset{false}, m_moda0{false};
+	dsp56720::Doorbell m_doorbell;
+
+	dsp56720::ClockGenerationModule m_cgm;
+	dsp56720::ChipConfigurationModule m_ccm;
+	dsp56720::SerialHostPort<0> m_shi0;
+	dsp56720::SerialHostInterace::ByteStream m_shi0bytes{m_shi0};
+	dsp56720::SerialHostPort<1> m_shi1;
+	dsp56720::SerialHostInterace::ByteStream m_shi1bytes{m_shi1};
+	dsp56720::EnhancedSerialAudioPort<0> m_esai{m_cgm};
+	dsp56720::EnhancedSerialAudioPort<1> m_esai1{m_cgm};
+	dsp56720::ChipIdentification m_chidr{0};
+	dsp56720::DmaController m_dma;
+	dsp56720::Debugger m_debugger{false};
+	dsp56720::TripleTimer m_tec;
+	dsp56720::AsyncSampleRateConverter m_asrc{m_cgm};
+	dsp56720::SpdifTransceiver m_spdif{m_cgm};
+	dsp56720::InterruptController m_intc;
+
+	// The interrupt controller runs last to see everything raised in the
+	// same cycle
+	dsp56720::Peripherals m_peripherals{m_cgm, m_ccm, m_shi0, m_shi1, m_esai, m_esai1,
+		m_chidr, m_dma, m_tec, m_asrc, m_spdif, m_intc};
+
+	dsp56720::MemoryImage m_image{m_config.memorySize(), m_config.externalFile};
+	dsp56720::MemoryGuard m_guard;
+	dsp56720::ExternalMemoryController m_emc{m_ccm, m_peripherals, m_guard,
+		m_config.externalBase, m_config.memorySize(), m_config.externalTiming};
+	dsp56k::Memory m_memory{m_emc, m_config.memorySize(), m_image.data()};
+	dsp56k::DSP m_dsp{m_memory, m_peripherals};
+	dsp56720::CoreSnapshot m_snapshot;
+	dsp56720::IdleDetector m_idle;
+
+	dsp56k::Opcodes m_opcodes;
+	dsp56k::Disassembler m_disasm{m_opcodes};
+	// Symbols are only added before other threads run, disassembling from
+	// the VFS and the debug server takes this
+	std::mutex m_disasmMutex;
+
+	std::unique_ptr<dsp56720::Pacer> m_pacer;
+	dsp56720::PerformanceCounters m_perf{m_dsp, m_peripherals, m_esai, m_cgm};
+	std::unique_ptr<dsp56720::Profiler> m_profiler;
+
+	std::vector<std::unique_ptr<dsp56720::AudioFileSink>> m_sinks;
+	std::vector<std::unique_ptr<dsp56720::AudioFileSource>> m_sources;
+
+	std::vector<std::unique_ptr<vfs::CharacterDevice>> m_devices;
+
+	std::unique_ptr<dsp56720::DebugServer> m_debugServer;
+	std::thread m_debugThread;
+
+	// The boot loader streams the word count, the load address and then
+	// the program over SHI. It is resumed on every slice until complete.
+	bool m_booted = false;
+	bool m_bootHeader = false;
+	dsp56k::TWord m_bootCount = 0;
+	dsp56k::TWord m_bootAddress = 0;
+	dsp56k::TWord m_bootLoaded = 0;
+};
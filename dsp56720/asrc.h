@@ -0,0 +1,427 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <vector>
+#include <dsp56kEmu/dsp.h>
+#include "peripherals.h"
+#include "bitfield.h"
+#include "queue.h"
+#include "cgm.h"
+#include "dma.h"
+#include "resampler.h"
+
+namespace dsp56720 {
+// Asynchronous sample rate converter with three pairs A-C of interleaved
+// channels. The DSP writes samples into a pair's input FIFO and reads the
+// converted ones from its output FIFO. Conversion runs in blocks inside
+// exec() whenever a pair's FIFOs changed, not per sample. The ratio is the
+// ideal ratio register when selected, otherwise the ratio of the input and
+// output clock rates from the clock generation module.
+class AsyncSampleRateConverter : public Peripheral {
+public:
+	static constexpr size_t pairs = 3;
+	static constexpr size_t maxChannels = 10;
+
+	// FIFO depth per channel
+	static constexpr size_t fifoDepth = 64;
+
+	// Convert once this many frames are queued, or the output runs low
+	static constexpr size_t blockFrames = 16;
+
+	static constexpr dsp56k::TWord Vba_ASRC_Input = 0x60;
+	static constexpr dsp56k::TWord Vba_ASRC_Output = 0x62;
+	static constexpr dsp56k::TWord Vba_ASRC_Overload = 0x64;
+
+	struct ASRCTR : BitField<dsp56k::TWord> {
+		using BitField<dsp56k::TWord>::operator=;
+
+		using ASRCEN = Bit<0>;    // ASRC Enable
+		using ASRE = Set<1, 3>;   // Pair A-C Enable
+		using IDR = Set<13, 3>;   // Pair A-C Use Ideal Ratio
+	};
+
+	struct ASRIER : BitField<dsp56k::TWord> {
+		using BitField<dsp56k::TWord>::operator=;
+
+		using ADIE = Set<0, 3>;   // Pair A-C Input Data Interrupt Enable
+		using ADOE = Set<3, 3>;   // Pair A-C Output Data Interrupt Enable
+		using AOLIE = Bit<6>;     // Overload Interrupt Enable
+	};
+
+	struct ASRSTR : BitField<dsp56k::TWord> {
+		using BitField<dsp56k::TWord>::operator=;
+
+		using AIDE = Set<0, 3>;   // Pair A-C Input FIFO Needs Data
+		using AODF = Set<3, 3>;   // Pair A-C Output FIFO Has Data
+		using AIOL = Set<6, 3>;   // Pair A-C Input FIFO Overflow
+		using AOUL = Set<9, 3>;   // Pair A-C Output FIFO Underflow
+	};
+
+	struct ASRMCR : BitField<dsp56k::TWord> {
+		using BitField<dsp56k::TWord>::operator=;
+
+		using INFIFO_THRESHOLD = Packed<0, 6>;
+		using OUTFIFO_THRESHOLD = Packed<12, 6>;
+	};
+
+	AsyncSampleRateConverter(ClockGenerationModule& cgm) : m_cgm(cgm) {}
+
+	virtual const char* name() const override { return "asrc"; }
+
+	virtual void exec() override {
+		if (!ASRCTR::ASRCEN(m_asrctr)) {
+			return;
+		}
+
+		for (size_t p = 0; p < pairs; p++) {
+			if (!ASRCTR::ASRE(m_asrctr).test(p)) {
+				continue;
+			}
+
+			auto& pair = m_pairs[p];
+			if (pair.dirty) {
+				pair.dirty = false;
+				convert(p);
+				update(p);
+			}
+
+			// Requests are levels, like the other FIFO peripherals
+			if (ASRSTR::AIDE(m_asrstr).test(p)) {
+				dmaRequest(DmaRequest_ASRC_InputA + p);
+			}
+
+			if (ASRSTR::AODF(m_asrstr).test(p)) {
+				dmaRequest(DmaRequest_ASRC_OutputA + p);
+			}
+		}
+	}
+
+	virtual uint32_t idleCycles() override {
+		if (ASRCTR::ASRCEN(m_asrctr)) {
+			for (size_t p = 0; p < pairs; p++) {
+				if (ASRCTR::ASRE(m_asrctr).test(p) && m_pairs[p].dirty) {
+					return 0;
+				}
+			}
+		}
+
+		return unbounded;
+	}
+
+	virtual void reset() override {
+		m_asrctr = 0;
+		m_asrier = 0;
+		m_asrstr = 0;
+		m_asrcncr = 0;
+		m_asrcsr = 0;
+
+		for (size_t p = 0; p < pairs; p++) {
+			m_pairs[p].ideal = 0;
+			m_pairs[p].asrmcr = 0;
+			configure(p);
+		}
+	}
+
+	virtual void terminate() override {}
+	virtual RegisterTable registers() override { return Registers; }
+
+	// Output frames produced since startup, safe to call from any thread
+	uint64_t frames() const { return m_frames.load(std::memory_order_relaxed); }
+
+	// Input samples per output sample of a pair
+	double ratio(size_t p) const {
+		if (ASRCTR::IDR(m_asrctr).test(p)) {
+			// Ideal ratio, 6.26 fixed point split over two words
+			return double(m_pairs[p].ideal) / (1 << 26);
+		}
+
+		auto in = m_cgm.clockRate(m_asrcsr >> (4 * p) & 0xf);
+		auto out = m_cgm.clockRate(m_asrcsr >> (12 + 4 * p) & 0xf);
+		return in && out ? double(in) / out : 0;
+	}
+
+	dsp56k::TWord readASRCTR() { return m_asrctr; }
+
+	void writeASRCTR(dsp56k::TWord value) {
+		auto enabled = ASRCTR::ASRE(m_asrctr);
+		m_asrctr = value;
+
+		for (size_t p = 0; p < pairs; p++) {
+			// Enabling a pair starts from empty FIFOs and filter state
+			if (!enabled.test(p) && ASRCTR::ASRE(m_asrctr).test(p)) {
+				configure(p);
+			}
+
+			m_pairs[p].dirty = true;
+		}
+	}
+
+	dsp56k::TWord readASRIER() { return m_asrier; }
+	void writeASRIER(dsp56k::TWord value) {
+		m_asrier = value;
+		rearm();
+	}
+
+	dsp56k::TWord readASRCNCR() { return m_asrcncr; }
+
+	// Channel counts only take effect when a pair is enabled
+	void writeASRCNCR(dsp56k::TWord value) { m_asrcncr = value; }
+
+	dsp56k::TWord readASRCFG() { return m_asrcfg; }
+	void writeASRCFG(dsp56k::TWord value) { m_asrcfg = value; }
+
+	dsp56k::TWord readASRCSR() { return m_asrcsr; }
+	void writeASRCSR(dsp56k::TWord value) {
+		m_asrcsr = value;
+		rearm();
+	}
+
+	template <int N> dsp56k::TWord readASRCDR() { return m_asrcdr[N]; }
+	template <int N> void writeASRCDR(dsp56k::TWord value) { m_asrcdr[N] = value; }
+
+	dsp56k::TWord readASRSTR() { return m_asrstr; }
+
+	// The overflow and underflow flags are cleared by writing 1
+	void writeASRSTR(dsp56k::TWord value) {
+		auto sticky = ASRSTR::AIOL::Mask | ASRSTR::AOUL::Mask;
+		m_asrstr = m_asrstr & ~(value & sticky);
+	}
+
+	template <int P> dsp56k::TWord readASRIDH() { return m_pairs[P].ideal >> 24; }
+	template <int P> void writeASRIDH(dsp56k::TWord value) {
+		m_pairs[P].ideal = (m_pairs[P].ideal & 0xffffff) | (value & 0xff) << 24;
+		m_pairs[P].dirty = true;
+	}
+
+	template <int P> dsp56k::TWord readASRIDL() { return m_pairs[P].ideal & 0xffffff; }
+	template <int P> void writeASRIDL(dsp56k::TWord value) {
+		m_pairs[P].ideal = (m_pairs[P].ideal & ~0xffffffu) | (value & 0xffffff);
+		m_pairs[P].dirty = true;
+	}
+
+	template <int P> dsp56k::TWord readASRMCR() { return m_pairs[P].asrmcr; }
+	template <int P> void writeASRMCR(dsp56k::TWord value) {
+		m_pairs[P].asrmcr = value;
+		m_pairs[P].dirty = true;
+	}
+
+	template <int P> void writeASRDI(dsp56k::TWord value) {
+		auto& pair = m_pairs[P];
+		if (pair.input.full()) {
+			m_asrstr = m_asrstr | (ASRSTR::AIOL::Mask & (1 << (6 + P)));
+			overload();
+			return;
+		}
+
+		pair.input.pushBack(value & 0xffffff);
+		pair.inputArmed = true;
+		pair.dirty = true;
+	}
+
+	template <int P> dsp56k::TWord readASRDO() {
+		auto& pair = m_pairs[P];
+		if (pair.output.empty()) {
+			m_asrstr = m_asrstr | (ASRSTR::AOUL::Mask & (1 << (9 + P)));
+			overload();
+			return 0;
+		}
+
+		pair.outputArmed = true;
+		pair.dirty = true;
+		return pair.output.popFront();
+	}
+
+	// Fill levels of a pair, input in bits 6:0 and output in bits 18:12
+	template <int P> dsp56k::TWord readASRFST() {
+		auto& pair = m_pairs[P];
+		return std::min<size_t>(pair.input.size(), 0x7f)
+			| std::min<size_t>(pair.output.size(), 0x7f) << 12;
+	}
+
+private:
+	using Fifo = CircularBuffer<dsp56k::TWord, fifoDepth>;
+
+	struct Pair {
+		Fifo input;
+		Fifo output;
+		std::vector<Resampler> channels;
+
+		uint32_t ideal = 0;
+		ASRMCR asrmcr{};
+
+		bool dirty = false;
+		bool inputArmed = true;
+		bool outputArmed = true;
+	};
+
+	size_t channels(size_t p) const {
+		size_t value = m_asrcncr >> (4 * p) & 0xf;
+		return std::clamp<size_t>(value, 1, maxChannels);
+	}
+
+	void configure(size_t p) {
+		auto& pair = m_pairs[p];
+		auto width = channels(p);
+
+		pair.channels.assign(width, Resampler{});
+		pair.input.clear();
+		pair.output.clear();
+		pair.input.setCapacity(fifoDepth * width);
+		pair.output.setCapacity(fifoDepth * width);
+
+		pair.inputArmed = pair.outputArmed = true;
+		pair.dirty = true;
+	}
+
+	void rearm() {
+		for (auto& pair : m_pairs) {
+			pair.inputArmed = pair.outputArmed = true;
+			pair.dirty = true;
+		}
+	}
+
+	void convert(size_t p) {
+		auto& pair = m_pairs[p];
+		auto width = pair.channels.size();
+		auto ratio = this->ratio(p);
+		if (!ratio) {
+			return;
+		}
+
+		auto frames = pair.input.size() / width;
+		auto room = (pair.output.capacity() - pair.output.size()) / width;
+		auto low = pair.output.size() / width < ASRMCR::OUTFIFO_THRESHOLD(pair.asrmcr);
+		if (!frames || !room || (frames < blockFrames && !low)) {
+			return;
+		}
+
+		// Feed no more than the free output space needs, the rest stays
+		// queued in the input FIFO
+		frames = std::min<size_t>(frames, room * ratio + 1);
+
+		m_in.resize(frames);
+		m_out.resize(room);
+
+		size_t produced = 0;
+		for (size_t c = 0; c < width; c++) {
+			pair.channels[c].setRatio(ratio);
+		}
+
+		// Deinterleave one channel at a time, the FIFO is drained at the end
+		for (size_t c = 0; c < width; c++) {
+			for (size_t f = 0; f < frames; f++) {
+				m_in[f] = toFloat(pair.input.at(f * width + c));
+			}
+
+			produced = pair.channels[c].process(m_in.data(), frames, m_out.data(), room);
+			m_converted[c].assign(m_out.begin(), m_out.begin() + produced);
+		}
+
+		for (size_t i = 0; i < frames * width; i++) {
+			pair.input.popFront();
+		}
+
+		for (size_t f = 0; f < produced; f++) {
+			for (size_t c = 0; c < width; c++) {
+				pair.output.pushBack(toWord(m_converted[c][f]));
+			}
+		}
+
+		count(m_frames, produced);
+	}
+
+	void update(size_t p) {
+		auto& pair = m_pairs[p];
+		auto width = pair.channels.size();
+
+		bool needsData = pair.input.size() / width <= ASRMCR::INFIFO_THRESHOLD(pair.asrmcr);
+		bool hasData = pair.output.size() / width > ASRMCR::OUTFIFO_THRESHOLD(pair.asrmcr);
+
+		auto aide = ASRSTR::AIDE::Mask & (1 << p);
+		auto aodf = ASRSTR::AODF::Mask & (1 << (3 + p));
+		m_asrstr = (m_asrstr & ~(aide | aodf)) | (needsData ? aide : 0) | (hasData ? aodf : 0);
+
+		// Raised once and re-armed by the next FIFO access, like SHI
+		if (needsData && pair.inputArmed && ASRIER::ADIE(m_asrier).test(p)) {
+			pair.inputArmed = false;
+			interrupt(Vba_ASRC_Input);
+		}
+
+		if (hasData && pair.outputArmed && ASRIER::ADOE(m_asrier).test(p)) {
+			pair.outputArmed = false;
+			interrupt(Vba_ASRC_Output);
+		}
+	}
+
+	void overload() {
+		if (ASRIER::AOLIE(m_asrier)) {
+			interrupt(Vba_ASRC_Overload);
+		}
+	}
+
+	static float toFloat(dsp56k::TWord word) {
+		return float(int32_t(word << 8) >> 8) * (1.0f / (1 << 23));
+	}
+
+	static dsp56k::TWord toWord(float sample) {
+		auto scaled = std::clamp(sample * (1 << 23), -8388608.0f, 8388607.0f);
+		return dsp56k::TWord(int32_t(scaled)) & 0xffffff;
+	}
+
+	ClockGenerationModule& m_cgm;
+
+	ASRCTR m_asrctr{};
+	ASRIER m_asrier{};
+	ASRSTR m_asrstr{};
+	dsp56k::TWord m_asrcncr = 0;
+	dsp56k::TWord m_asrcfg = 0;
+	dsp56k::TWord m_asrcsr = 0;
+	std::array<dsp56k::TWord, 2> m_asrcdr{};
+	std::array<Pair, pairs> m_pairs{};
+
+	// Scratch buffers for one block
+	std::vector<float> m_in, m_out;
+	std::array<std::vector<float>, maxChannels> m_converted;
+
+	std::atomic<uint64_t> m_frames{0};
+
+	using ASRC = AsyncSampleRateConverter;
+
+	static constexpr Address Base = 0xFFFF50_ymem;
+
+	static constexpr Register Registers[] = {
+		reg<&ASRC::readASRCTR, &ASRC::writeASRCTR>("ASRCTR", Base + 0x00),
+		reg<&ASRC::readASRIER, &ASRC::writeASRIER>("ASRIER", Base + 0x01),
+		reg<&ASRC::readASRCNCR, &ASRC::writeASRCNCR>("ASRCNCR", Base + 0x02),
+		reg<&ASRC::readASRCFG, &ASRC::writeASRCFG>("ASRCFG", Base + 0x03),
+		reg<&ASRC::readASRCSR, &ASRC::writeASRCSR>("ASRCSR", Base + 0x04),
+		reg<&ASRC::readASRCDR<0>, &ASRC::writeASRCDR<0>>("ASRCDR1", Base + 0x05),
+		reg<&ASRC::readASRCDR<1>, &ASRC::writeASRCDR<1>>("ASRCDR2", Base + 0x06),
+		reg<&ASRC::readASRSTR, &ASRC::writeASRSTR>("ASRSTR", Base + 0x07),
+
+		reg<&ASRC::readASRIDH<0>, &ASRC::writeASRIDH<0>>("ASRIDHA", Base + 0x08),
+		reg<&ASRC::readASRIDL<0>, &ASRC::writeASRIDL<0>>("ASRIDLA", Base + 0x09),
+		reg<&ASRC::readASRIDH<1>, &ASRC::writeASRIDH<1>>("ASRIDHB", Base + 0x0A),
+		reg<&ASRC::readASRIDL<1>, &ASRC::writeASRIDL<1>>("ASRIDLB", Base + 0x0B),
+		reg<&ASRC::readASRIDH<2>, &ASRC::writeASRIDH<2>>("ASRIDHC", Base + 0x0C),
+		reg<&ASRC::readASRIDL<2>, &ASRC::writeASRIDL<2>>("ASRIDLC", Base + 0x0D),
+
+		reg<&ASRC::readASRMCR<0>, &ASRC::writeASRMCR<0>>("ASRMCRA", Base + 0x0E),
+		reg<&ASRC::readASRMCR<1>, &ASRC::writeASRMCR<1>>("ASRMCRB", Base + 0x0F),
+		reg<&ASRC::readASRMCR<2>, &ASRC::writeASRMCR<2>>("ASRMCRC", Base + 0x10),
+
+		reg<nullptr, &ASRC::writeASRDI<0>>("ASRDIA", Base + 0x11),
+		reg<&ASRC::readASRDO<0>, nullptr>("ASRDOA", Base + 0x12),
+		reg<nullptr, &ASRC::writeASRDI<1>>("ASRDIB", Base + 0x13),
+		reg<&ASRC::readASRDO<1>, nullptr>("ASRDOB", Base + 0x14),
+		reg<nullptr, &ASRC::writeASRDI<2>>("ASRDIC", Base + 0x15),
+		reg<&ASRC::readASRDO<2>, nullptr>("ASRDOC", Base + 0x16),
+
+		reg<&ASRC::readASRFST<0>, nullptr>("ASRFSTA", Base + 0x17),
+		reg<&ASRC::readASRFST<1>, nullptr>("ASRFSTB", Base + 0x18),
+		reg<&ASRC::readASRFST<2>, nullptr>("ASRFSTC", Base + 0x19),
+	};
+};
+}
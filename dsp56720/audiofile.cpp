@@ -0,0 +1,364 @@
+#include "audiofile.h"
+
+#include <chrono>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace dsp56720 {
+namespace {
+// Samples per file write or read
+constexpr size_t blockSamples = 16384;
+constexpr auto pollInterval = std::chrono::milliseconds(50);
+
+// RIFF header, a JUNK chunk reserving room for ds64, fmt and the data chunk
+// header
+constexpr size_t wavHeaderBytes = 12 + 8 + 28 + 8 + 16 + 8;
+constexpr uint32_t wavBytesPerSample = 3;
+
+void put16(uint8_t* p, uint16_t v) {
+	p[0] = v;
+	p[1] = v >> 8;
+}
+
+void put32(uint8_t* p, uint32_t v) {
+	put16(p, v);
+	put16(p + 2, v >> 16);
+}
+
+void put64(uint8_t* p, uint64_t v) {
+	put32(p, v);
+	put32(p + 4, v >> 32);
+}
+
+uint16_t get16(const uint8_t* p) {
+	return p[0] | p[1] << 8;
+}
+
+uint32_t get32(const uint8_t* p) {
+	return get16(p) | uint32_t(get16(p + 2)) << 16;
+}
+
+uint64_t get64(const uint8_t* p) {
+	return get32(p) | uint64_t(get32(p + 4)) << 32;
+}
+
+bool writeAll(int fd, const uint8_t* data, size_t bytes, off_t offset) {
+	while (bytes) {
+		auto written = pwrite(fd, data, bytes, offset);
+		if (written <= 0) {
+			return false;
+		}
+
+		data += written;
+		bytes -= written;
+		offset += written;
+	}
+
+	return true;
+}
+
+bool readAll(int fd, uint8_t* data, size_t bytes, off_t offset) {
+	while (bytes) {
+		auto n = pread(fd, data, bytes, offset);
+		if (n <= 0) {
+			return false;
+		}
+
+		data += n;
+		bytes -= n;
+		offset += n;
+	}
+
+	return true;
+}
+
+// Header for a file holding the given number of samples. Sizes are only
+// known when recording ends, so this is written twice.
+std::vector<uint8_t> wavHeader(uint32_t sampleRate, uint64_t samples) {
+	std::vector<uint8_t> header(wavHeaderBytes, 0);
+	auto data = samples * wavBytesPerSample;
+	auto riff = wavHeaderBytes - 8 + data + (data & 1);
+	bool rf64 = riff > UINT32_MAX;
+	auto p = header.data();
+
+	memcpy(p, rf64 ? "RF64" : "RIFF", 4);
+	put32(p + 4, rf64 ? UINT32_MAX : riff);
+	memcpy(p + 8, "WAVE", 4);
+
+	memcpy(p + 12, rf64 ? "ds64" : "JUNK", 4);
+	put32(p + 16, 28);
+	if (rf64) {
+		put64(p + 20, riff);
+		put64(p + 28, data);
+		put64(p + 36, samples);
+	}
+
+	memcpy(p + 48, "fmt ", 4);
+	put32(p + 52, 16);
+	put16(p + 56, 1); // PCM
+	put16(p + 58, 1); // Mono
+	put32(p + 60, sampleRate);
+	put32(p + 64, sampleRate * wavBytesPerSample);
+	put16(p + 68, wavBytesPerSample);
+	put16(p + 70, wavBytesPerSample * 8);
+
+	memcpy(p + 72, "data", 4);
+	put32(p + 76, rf64 ? UINT32_MAX : data);
+	return header;
+}
+}
+
+AudioFormat audioFormat(const std::string& path) {
+	auto dot = path.rfind('.');
+	auto extension = dot == std::string::npos ? "" : path.substr(dot);
+	return extension == ".wav" || extension == ".rf64" ? AudioFormat::Wav : AudioFormat::Raw;
+}
+
+bool AudioFileSink::open(const std::string& path) {
+	// Concurrent opens from the VFS must not both find the thread joined
+	// and then start one each
+	std::unique_lock<std::mutex> lock(m_mutex);
+	stop();
+
+	int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		return false;
+	}
+
+	m_path = path;
+	m_stop = false;
+	m_thread = std::thread([this, fd, format = audioFormat(path)]() { run(fd, format); });
+	return true;
+}
+
+void AudioFileSink::close() {
+	std::unique_lock<std::mutex> lock(m_mutex);
+	stop();
+}
+
+void AudioFileSink::stop() {
+	if (m_thread.joinable()) {
+		m_stop = true;
+		m_thread.join();
+	}
+
+	m_path.clear();
+}
+
+std::string AudioFileSink::path() {
+	std::unique_lock<std::mutex> lock(m_mutex);
+	return m_path;
+}
+
+void AudioFileSink::run(int fd, AudioFormat format) {
+	std::vector<uint32_t> samples(blockSamples);
+	std::vector<uint8_t> bytes(blockSamples * sizeof(uint32_t));
+	uint64_t total = 0;
+	off_t offset = 0;
+
+	if (format == AudioFormat::Wav) {
+		auto header = wavHeader(m_sampleRate, 0);
+		writeAll(fd, header.data(), header.size(), 0);
+		offset = header.size();
+	}
+
+	try {
+		while (!m_stop) {
+			auto count = m_output.readSamples(samples.data(), samples.size(), pollInterval);
+
+			size_t size = 0;
+			for (size_t i = 0; i < count; i++) {
+				auto sample = samples[i];
+				if (format == AudioFormat::Wav) {
+					bytes[size++] = sample;
+					bytes[size++] = sample >> 8;
+					bytes[size++] = sample >> 16;
+				} else {
+					put32(&bytes[size], sample);
+					size += 4;
+				}
+			}
+
+			if (!writeAll(fd, bytes.data(), size, offset)) {
+				LOG("Audio file sink: write failed: " << strerror(errno));
+				break;
+			}
+
+			offset += size;
+			total += count;
+		}
+	} catch (QueueShutdown&) {
+	}
+
+	finish(fd, format, total);
+}
+
+void AudioFileSink::finish(int fd, AudioFormat format, uint64_t samples) {
+	if (format == AudioFormat::Wav) {
+		auto data = samples * wavBytesPerSample;
+		if (data & 1) {
+			uint8_t pad = 0;
+			writeAll(fd, &pad, 1, wavHeaderBytes + data);
+		}
+
+		auto header = wavHeader(m_sampleRate, samples);
+		writeAll(fd, header.data(), header.size(), 0);
+	}
+
+	::close(fd);
+}
+
+bool AudioFileSource::open(const std::string& path) {
+	// Concurrent opens from the VFS must not both find the thread joined
+	// and then start one each
+	std::unique_lock<std::mutex> lock(m_mutex);
+	stop();
+
+	int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return false;
+	}
+
+	Layout layout{0, UINT64_MAX, 4, 4, true};
+	if (audioFormat(path) == AudioFormat::Wav && !parseWav(fd, layout)) {
+		::close(fd);
+		return false;
+	}
+
+	m_path = path;
+	m_stop = false;
+	m_thread = std::thread([this, fd, layout]() { run(fd, layout); });
+	return true;
+}
+
+void AudioFileSource::close() {
+	std::unique_lock<std::mutex> lock(m_mutex);
+	stop();
+}
+
+void AudioFileSource::stop() {
+	if (m_thread.joinable()) {
+		m_stop = true;
+		m_thread.join();
+	}
+
+	m_path.clear();
+}
+
+std::string AudioFileSource::path() {
+	std::unique_lock<std::mutex> lock(m_mutex);
+	return m_path;
+}
+
+bool AudioFileSource::parseWav(int fd, Layout& layout) {
+	uint8_t riff[12];
+	if (!readAll(fd, riff, sizeof(riff), 0) || memcmp(riff + 8, "WAVE", 4)) {
+		return false;
+	}
+
+	bool rf64 = !memcmp(riff, "RF64", 4);
+	if (!rf64 && memcmp(riff, "RIFF", 4)) {
+		return false;
+	}
+
+	uint64_t dataSize64 = 0;
+	bool haveFormat = false;
+	off_t offset = sizeof(riff);
+
+	for (;;) {
+		uint8_t chunk[8];
+		if (!readAll(fd, chunk, sizeof(chunk), offset)) {
+			return false;
+		}
+
+		uint64_t size = get32(chunk + 4);
+		offset += sizeof(chunk);
+
+		if (!memcmp(chunk, "ds64", 4)) {
+			uint8_t ds64[16];
+			if (size < sizeof(ds64) || !readAll(fd, ds64, sizeof(ds64), offset)) {
+				return false;
+			}
+
+			dataSize64 = get64(ds64 + 8);
+		} else if (!memcmp(chunk, "fmt ", 4)) {
+			uint8_t fmt[16];
+			if (size < sizeof(fmt) || !readAll(fd, fmt, sizeof(fmt), offset)) {
+				return false;
+			}
+
+			auto tag = get16(fmt);
+			auto channels = get16(fmt + 2);
+			auto bits = get16(fmt + 14);
+			if ((tag != 1 && tag != 0xfffe) || !channels
+					|| (bits != 16 && bits != 24 && bits != 32)) {
+				return false;
+			}
+
+			layout.raw = false;
+			layout.sampleBytes = bits / 8;
+			layout.frameBytes = layout.sampleBytes * channels;
+			haveFormat = true;
+		} else if (!memcmp(chunk, "data", 4)) {
+			if (!haveFormat) {
+				return false;
+			}
+
+			layout.offset = offset;
+			layout.bytes = rf64 && size == UINT32_MAX ? dataSize64 : size;
+			return true;
+		}
+
+		offset += size + (size & 1);
+	}
+}
+
+void AudioFileSource::run(int fd, Layout layout) {
+	std::vector<uint8_t> bytes(blockSamples * layout.frameBytes);
+	std::vector<uint32_t> samples(blockSamples);
+	uint64_t position = 0;
+
+	try {
+		while (!m_stop && position < layout.bytes) {
+			auto want = std::min<uint64_t>(bytes.size(), layout.bytes - position);
+			auto n = pread(fd, bytes.data(), want, layout.offset + position);
+			if (n <= 0) {
+				break;
+			}
+
+			size_t count = n / layout.frameBytes;
+			position += count * layout.frameBytes;
+			if (!count) {
+				break;
+			}
+
+			for (size_t i = 0; i < count; i++) {
+				auto p = &bytes[i * layout.frameBytes];
+				switch (layout.sampleBytes) {
+					case 2:
+						samples[i] = uint32_t(get16(p)) << 8;
+						break;
+					case 3:
+						samples[i] = p[0] | p[1] << 8 | p[2] << 16;
+						break;
+					default:
+						samples[i] = get32(p) >> (layout.raw ? 0 : 8);
+						break;
+				}
+
+				samples[i] &= 0xffffff;
+			}
+
+			size_t pushed = 0;
+			while (pushed < count && !m_stop) {
+				pushed += m_input.writeSamples(samples.data() + pushed, count - pushed,
+						pollInterval);
+			}
+		}
+	} catch (QueueShutdown&) {
+	}
+
+	::close(fd);
+}
+}
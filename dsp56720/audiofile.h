@@ -0,0 +1,89 @@
+#pragma once
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "esai.h"
+
+namespace dsp56720 {
+// Raw files hold one little-endian 32-bit word per sample, like the VFS
+// endpoints. WAV files are mono 24-bit PCM and turn into RF64 once they
+// outgrow the 4 GiB RIFF limit.
+enum class AudioFormat {
+	Raw,
+	Wav,
+};
+
+// Format by file extension, .wav and .rf64 are WAV, anything else is raw
+AudioFormat audioFormat(const std::string& path);
+
+// Records an ESAI output to a file. A worker thread drains the output queue
+// in blocks and writes them with pwrite(), so the emulation thread only
+// ever touches the queue.
+class AudioFileSink {
+public:
+	AudioFileSink(EnhancedSerialAudioInterface::Output& output, uint32_t sampleRate)
+		: m_output(output), m_sampleRate(sampleRate) {}
+	~AudioFileSink() { close(); }
+
+	// Start recording, ending any previous recording. Returns false if the
+	// file can't be created.
+	bool open(const std::string& path);
+	void close();
+
+	std::string path();
+
+private:
+	// Ends the recording, called with m_mutex held
+	void stop();
+	void run(int fd, AudioFormat format);
+	void finish(int fd, AudioFormat format, uint64_t samples);
+
+	EnhancedSerialAudioInterface::Output& m_output;
+	uint32_t m_sampleRate;
+
+	std::mutex m_mutex;
+	std::string m_path;
+	std::thread m_thread;
+	std::atomic<bool> m_stop{false};
+};
+
+// Plays a file into an ESAI input. A worker thread reads blocks with pread()
+// and pushes them to the input queue. WAV files may be 16, 24 or 32-bit PCM;
+// only the first channel is used.
+class AudioFileSource {
+public:
+	AudioFileSource(EnhancedSerialAudioInterface::Input& input) : m_input(input) {}
+	~AudioFileSource() { close(); }
+
+	// Start playing, ending any previous file. Returns false if the file
+	// can't be opened or isn't a supported WAV file.
+	bool open(const std::string& path);
+	void close();
+
+	std::string path();
+
+private:
+	struct Layout {
+		uint64_t offset;
+		uint64_t bytes;
+		uint32_t frameBytes;
+		uint32_t sampleBytes;
+		bool raw;
+	};
+
+	static bool parseWav(int fd, Layout& layout);
+	// Ends playback, called with m_mutex held
+	void stop();
+	void run(int fd, Layout layout);
+
+	EnhancedSerialAudioInterface::Input& m_input;
+
+	std::mutex m_mutex;
+	std::string m_path;
+	std::thread m_thread;
+	std::atomic<bool> m_stop{false};
+};
+}
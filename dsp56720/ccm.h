@@ -6,27 +6,42 @@
 
 namespace dsp56720 {
 class ChipConfigurationModule : public Peripheral {
+public:
+	// Modelled layout of the EMC burst buffer control
+	struct EMBC : BitField<dsp56k::TWord> {
+		using BitField<dsp56k::TWord>::operator=;
+
+		using BBE = Bit<0>;       // Burst Buffer Enable
+		using BL = Packed<1, 2>;  // Burst Length, 4 << BL words per line
+		using BN = Packed<3, 2>;  // Burst buffer lines, 1 << BN
+		using PWE = Bit<5>;       // Posted Write Enable
+	};
+
+	virtual const char* name() const override { return "ccm"; }
 	virtual void exec() override {}
 	virtual void reset() override {}
 	virtual void terminate() override {}
-	virtual std::vector<Register> registers() override { return m_registers; }
+	virtual RegisterTable registers() override { return Registers; }
+
+	// Burst buffer configuration, see ExternalMemoryController
+	EMBC embc() const { return m_embc; }
 
 	dsp56k::TWord readExternalMemoryBurstControl() { return m_embc; }
 	void writeExternalMemoryBurstControl(dsp56k::TWord value) { m_embc = value; }
-	dsp56k::TWord readDebugAndBurstControl() { return 0; }
-	void writeDebugAndBurstControl(dsp56k::TWord value) { }
+	dsp56k::TWord readDebugAndBurstControl() { return m_odbc; }
+	void writeDebugAndBurstControl(dsp56k::TWord value) { m_odbc = value; }
 
 private:
-	dsp56k::TWord m_embc;
-
-	std::vector<Register> m_registers = {
-		// TODO: See Chapter 18 - EMC Burst Buffer in the DSP56720 reference manual
-		{"EMBC", 0xFFFFE6_ymem,
-			[&](auto inst) { return readExternalMemoryBurstControl(); },
-			[&](auto value) { writeExternalMemoryBurstControl(value); }},
-		{"ODBC", 0xFFFFE2_ymem,
-			[&](auto inst) { return readDebugAndBurstControl(); },
-			[&](auto value) { writeDebugAndBurstControl(value); }}
+	EMBC m_embc{};
+	dsp56k::TWord m_odbc = 0;
+
+	using CCM = ChipConfigurationModule;
+
+	static constexpr Register Registers[] = {
+		reg<&CCM::readExternalMemoryBurstControl, &CCM::writeExternalMemoryBurstControl>(
+			"EMBC", 0xFFFFE6_ymem),
+		reg<&CCM::readDebugAndBurstControl, &CCM::writeDebugAndBurstControl>(
+			"ODBC", 0xFFFFE2_ymem),
 	};
 };
 }
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <array>
+#include <atomic>
 #include <dsp56kEmu/dsp.h>
 #include "peripherals.h"
 #include "bitfield.h"
@@ -7,12 +9,40 @@
 namespace dsp56720 {
 class ClockGenerationModule : public Peripheral {
 public:
+	virtual const char* name() const override { return "cgm"; }
 	virtual void exec() override { }
 	virtual void reset() override {}
 	virtual void terminate() override {}
-	virtual std::vector<Register> registers() override { return m_registers; }
+	virtual RegisterTable registers() override { return Registers; }
 
 	uint32_t cyclesPerSample() { return m_cyclesPerSample; }
+	uint32_t sampleRate() { return m_sampleRate; }
+
+	// Audio clocks the ASRC can select as input or output clock
+	enum Clock : uint32_t {
+		Clock_ESAI = 0,
+		Clock_ESAI1 = 1,
+		Clock_SPDIF_Receive = 2,
+		Clock_SPDIF_Transmit = 3,
+		Clock_External = 4,
+		Clock_Count,
+	};
+
+	static const char* clockName(uint32_t clock) {
+		static constexpr const char* names[] = {"esai", "esai1", "spdif-rx", "spdif-tx", "ext"};
+		return clock < Clock_Count ? names[clock] : "none";
+	}
+
+	// Frame rate of a clock, 0 for clocks that don't exist
+	uint32_t clockRate(uint32_t clock) const {
+		return clock < Clock_Count ? m_clockRates[clock].load(std::memory_order_relaxed) : 0;
+	}
+
+	void setClockRate(uint32_t clock, uint32_t rate) {
+		if (clock < Clock_Count) {
+			m_clockRates[clock].store(rate, std::memory_order_relaxed);
+		}
+	}
 
 	struct PCTL : BitField<dsp56k::TWord> {
 		using BitField<dsp56k::TWord>::operator=;
@@ -29,12 +59,13 @@ public:
 private:
 	// estimate cycles per sample.
 	uint32_t m_cyclesPerSample = 2133;
+	uint32_t m_sampleRate = 48000;
+	std::array<std::atomic<uint32_t>, Clock_Count> m_clockRates{48000, 48000, 48000, 48000, 44100};
+
+	using CGM = ClockGenerationModule;
 
-	std::vector<Register> m_registers = {
-		{"PCTL",
-		0xFFFF7D_xmem,
-		[&](auto inst) { return 0; },
-		[&](auto value) { updatePCTL(value); }}
+	static constexpr Register Registers[] = {
+		reg<nullptr, &CGM::updatePCTL>("PCTL", 0xFFFF7D_xmem),
 	};
 };
 }
@@ -11,8 +11,8 @@ public:
 
 	ChipIdentification(size_t core) : m_core(core) {}
 
-	virtual dsp56k::TWord read() override { return 0x720 | (m_core << 16); }
-	virtual void write(dsp56k::TWord write) override {}
+	dsp56k::TWord read() { return 0x720 | (m_core << 16); }
+	void write(dsp56k::TWord write) {}
 
 private:
 	size_t m_core;
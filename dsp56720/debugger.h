@@ -1,47 +1,253 @@
 #pragma once
 
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
 #include <unordered_set>
+#include <vector>
+#include "peripherals.h"
+#include "guard.h"
 
 namespace dsp56720 {
 class Debugger {
 public:
-	Debugger(bool stopped) : m_stopped(stopped) {}
+	enum class StopReason {
+		None,
+		Breakpoint,
+		Step,
+		Interrupt,
+		Watchpoint,
+	};
 
-	void setBreakpoint(dsp56k::TWord address) { m_breakpoints.emplace(address); }
-	void removeBreakpoint(dsp56k::TWord address) { m_breakpoints.erase(address); }
+	enum class WatchKind {
+		Write,
+		Read,
+		Access,
+	};
+
+	struct Watchpoint {
+		dsp56k::EMemArea area;
+		dsp56k::TWord address;
+		dsp56k::TWord length;
+		WatchKind kind;
+		// Only trigger when this value is written
+		bool matchValue;
+		dsp56k::TWord value;
+	};
+
+	struct WatchHit {
+		Watchpoint watchpoint;
+		dsp56k::TWord address;
+		dsp56k::TWord value;
+	};
+
+	// Called on the emulation thread whenever the core stops
+	using StopHandler = std::function<void(StopReason)>;
+
+	Debugger(bool stopped) : m_stopped(stopped), m_active(stopped) {}
+
+	// Breakpoints may only be changed while the core is stopped or before it
+	// runs; the emulation thread reads them without locking.
+	void setBreakpoint(dsp56k::TWord address) {
+		m_breakpoints.emplace(address);
+		updateActive();
+	}
+
+	void removeBreakpoint(dsp56k::TWord address) {
+		m_breakpoints.erase(address);
+		updateActive();
+	}
+
+	void clearBreakpoints() {
+		m_breakpoints.clear();
+		updateActive();
+	}
+
+	// Required for watchpoints: I/O space accesses are reported by the
+	// peripherals, memory accesses by the guard on the watched pages
+	void attach(dsp56k::DSP& core, Peripherals& peripherals, MemoryGuard& guard) {
+		m_memory = &core.memory();
+		m_peripherals = &peripherals;
+		m_guard = &guard;
+		m_peripherals->setWatchHandler([this](Address address, dsp56k::TWord value, bool write) {
+			ioAccess(address, value, write);
+		});
+		m_guard->setHandler([this](dsp56k::EMemArea area, dsp56k::TWord address, bool write) {
+			memoryAccess(area, address, write);
+		});
+	}
+
+	// Like breakpoints, watchpoints may only be changed while stopped
+	bool addWatchpoint(const Watchpoint& watchpoint) {
+		if (!m_memory || !watchpoint.length) {
+			return false;
+		}
+
+		if (isIO(watchpoint)) {
+			for (dsp56k::TWord i = 0; i < watchpoint.length; i++) {
+				m_peripherals->watch({watchpoint.area, watchpoint.address + i}, true);
+			}
+
+			m_ioWatches.push_back(watchpoint);
+		} else {
+			m_memoryWatches.push_back(watchpoint);
+			updateGuards();
+		}
+
+		updateActive();
+		return true;
+	}
+
+	bool removeWatchpoint(dsp56k::EMemArea area, dsp56k::TWord address, WatchKind kind) {
+		auto matches = [&](const Watchpoint& watchpoint) {
+			return watchpoint.area == area && watchpoint.address == address
+				&& watchpoint.kind == kind;
+		};
+
+		for (auto it = m_ioWatches.begin(); it != m_ioWatches.end(); ++it) {
+			if (matches(*it)) {
+				auto watchpoint = *it;
+				m_ioWatches.erase(it);
+				unwatch(watchpoint);
+				updateActive();
+				return true;
+			}
+		}
+
+		for (auto it = m_memoryWatches.begin(); it != m_memoryWatches.end(); ++it) {
+			if (matches(*it)) {
+				m_memoryWatches.erase(it);
+				updateGuards();
+				updateActive();
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	void clearWatchpoints() {
+		for (auto& watchpoint : m_ioWatches) {
+			unwatch(watchpoint);
+		}
+
+		m_ioWatches.clear();
+		m_memoryWatches.clear();
+		updateGuards();
+		updateActive();
+	}
+
+	const WatchHit& watchHit() const { return m_watchHit; }
+
+	void setStopHandler(StopHandler handler) {
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_stopHandler = handler;
+	}
 
 	void continueExecution(size_t n = 0) {
-		m_instruction_counter = n;
-		m_stopped = false;
-		m_state_changed.notify_one();
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_instruction_counter = n;
+			m_stopped = false;
+			m_reason = StopReason::None;
+			// Don't stop at the breakpoint we're currently sitting on
+			m_skipBreakpoint = true;
+		}
+
+		updateActive();
+		m_state_changed.notify_all();
+	}
+
+	// Ask the core to stop before the next instruction, from any thread
+	void interrupt() {
+		m_interruptRequested = true;
+		m_active = true;
+	}
+
+	bool stopped() {
+		std::unique_lock<std::mutex> lock(m_mutex);
+		return m_stopped;
+	}
+
+	// Cheap check whether exec() may stop or block, without locking
+	bool active() const {
+		return m_active.load(std::memory_order_relaxed);
+	}
+
+	StopReason reason() {
+		std::unique_lock<std::mutex> lock(m_mutex);
+		return m_reason;
 	}
 
 	void exec(dsp56k::DSP& core) {
+		// Without breakpoints, pending stops or stepping the only cost is a
+		// relaxed load
+		if (!m_active.load(std::memory_order_relaxed)) {
+			core.exec();
+			return;
+		}
+
+		execSlow(core);
+	}
+
+private:
+	void execSlow(dsp56k::DSP& core) {
 		if (m_stopped) {
 			waitUntilContinue();
 		}
 
+		if (m_interruptRequested.exchange(false)) {
+			stop(StopReason::Interrupt);
+			return;
+		}
+
 		auto pc = core.getPC().toWord();
-		if (m_breakpoints.find(pc) != m_breakpoints.end()) {
-			stop();
+		if (!m_skipBreakpoint && m_breakpoints.find(pc) != m_breakpoints.end()) {
+			stop(StopReason::Breakpoint);
 			return;
 		}
 
+		m_skipBreakpoint = false;
+
+		s_executing = true;
 		core.exec();
+		s_executing = false;
+
+		if (!m_memoryAccesses.empty()) {
+			checkMemoryAccesses();
+		}
+
+		if (m_watchTriggered) {
+			m_watchTriggered = false;
+			stop(StopReason::Watchpoint);
+			return;
+		}
 
 		if (m_instruction_counter) {
 			m_instruction_counter--;
 
 			if (!m_instruction_counter) {
-				stop();
+				stop(StopReason::Step);
 			}
 		}
 	}
 
-private:
-	void stop()  {
-		m_stopped = true;
-		m_state_changed.notify_one();
+	void stop(StopReason reason)  {
+		StopHandler handler;
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_stopped = true;
+			m_reason = reason;
+			handler = m_stopHandler;
+		}
+
+		m_active = true;
+		m_state_changed.notify_all();
+
+		if (handler) {
+			handler(reason);
+		}
 	}
 
 	void waitUntilContinue() {
@@ -52,11 +258,146 @@ private:
 		}
 	}
 
+	void updateActive() {
+		m_active = m_stopped || m_interruptRequested || m_instruction_counter
+			|| !m_breakpoints.empty() || !m_ioWatches.empty() || !m_memoryWatches.empty();
+	}
+
+	static bool isIO(const Watchpoint& watchpoint) {
+		return watchpoint.area != dsp56k::MemArea_P
+			&& Peripherals::isIO(watchpoint.address)
+			&& Peripherals::isIO(watchpoint.address + watchpoint.length - 1);
+	}
+
+	static bool contains(const Watchpoint& watchpoint, dsp56k::TWord address) {
+		return address - watchpoint.address < watchpoint.length;
+	}
+
+	static bool triggers(const Watchpoint& watchpoint, bool write) {
+		switch (watchpoint.kind) {
+			case WatchKind::Write:
+				return write;
+			case WatchKind::Read:
+				return !write;
+			default:
+				return true;
+		}
+	}
+
+	void updateGuards() {
+		if (!m_guard) {
+			return;
+		}
+
+		m_guard->clear();
+		for (auto& watchpoint : m_memoryWatches) {
+			m_guard->guard(watchpoint.area, watchpoint.address,
+					watchpoint.address + watchpoint.length - 1);
+		}
+	}
+
+	void unwatch(const Watchpoint& watchpoint) {
+		for (dsp56k::TWord i = 0; i < watchpoint.length; i++) {
+			dsp56k::TWord address = watchpoint.address + i;
+
+			// Another watchpoint may cover the same address
+			bool shared = false;
+			for (auto& other : m_ioWatches) {
+				shared |= other.area == watchpoint.area && contains(other, address);
+			}
+
+			if (!shared) {
+				m_peripherals->watch({watchpoint.area, address}, false);
+			}
+		}
+	}
+
+	// Called from inside core.exec() for watched I/O addresses
+	void ioAccess(Address address, dsp56k::TWord value, bool write) {
+		for (auto& watchpoint : m_ioWatches) {
+			if (watchpoint.area != address.area || !contains(watchpoint, address.value)) {
+				continue;
+			}
+
+			if (!triggers(watchpoint, write)) {
+				continue;
+			}
+
+			if (watchpoint.matchValue && (!write || value != watchpoint.value)) {
+				continue;
+			}
+
+			m_watchHit = WatchHit{watchpoint, address.value, value};
+			m_watchTriggered = true;
+			return;
+		}
+	}
+
+	// Called from inside core.exec() for accesses to guarded pages. Reads
+	// from other threads, like the VFS memory files, also reach the guard
+	// and are ignored. The value is only looked at once the instruction
+	// completed, since reading memory here would reenter the guard.
+	void memoryAccess(dsp56k::EMemArea area, dsp56k::TWord address, bool write) {
+		if (!s_executing) {
+			return;
+		}
+
+		for (auto& watchpoint : m_memoryWatches) {
+			if (watchpoint.area == area && contains(watchpoint, address)
+					&& triggers(watchpoint, write)) {
+				m_memoryAccesses.push_back({watchpoint, address, write});
+			}
+		}
+	}
+
+	void checkMemoryAccesses() {
+		for (auto& access : m_memoryAccesses) {
+			auto& watchpoint = access.watchpoint;
+			auto value = m_memory->get(watchpoint.area, access.address);
+
+			if (watchpoint.matchValue && (!access.write || value != watchpoint.value)) {
+				continue;
+			}
+
+			if (!m_watchTriggered) {
+				m_watchHit = WatchHit{watchpoint, access.address, value};
+				m_watchTriggered = true;
+			}
+		}
+
+		m_memoryAccesses.clear();
+	}
+
+	struct MemoryAccess {
+		Watchpoint watchpoint;
+		dsp56k::TWord address;
+		bool write;
+	};
+
+	// Set while the core executes an instruction on this thread
+	static inline thread_local bool s_executing = false;
+
 	std::mutex m_mutex;
-	std::condition_variable m_not_full, m_state_changed;
+	std::condition_variable m_state_changed;
+	StopHandler m_stopHandler;
 
 	std::unordered_set<dsp56k::TWord> m_breakpoints;
-	size_t m_instruction_counter;
-	bool m_stopped;
+
+	dsp56k::Memory* m_memory = nullptr;
+	Peripherals* m_peripherals = nullptr;
+	MemoryGuard* m_guard = nullptr;
+	std::vector<Watchpoint> m_ioWatches;
+	std::vector<Watchpoint> m_memoryWatches;
+	std::vector<MemoryAccess> m_memoryAccesses;
+	WatchHit m_watchHit{};
+	bool m_watchTriggered = false;
+
+	size_t m_instruction_counter = 0;
+	std::atomic<bool> m_stopped;
+	bool m_skipBreakpoint = false;
+	StopReason m_reason = StopReason::None;
+
+	std::atomic<bool> m_interruptRequested{false};
+	std::atomic<bool> m_active;
 };
 }
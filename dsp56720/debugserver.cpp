@@ -0,0 +1,656 @@
+#include "debugserver.h"
+
+#include <cstring>
+#include <iostream>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace dsp56720 {
+namespace {
+const char hexDigits[] = "0123456789abcdef";
+
+std::string hex(uint64_t value, size_t digits) {
+	std::string out(digits, '0');
+	for (size_t i = 0; i < digits; i++) {
+		out[digits - i - 1] = hexDigits[value & 0xf];
+		value >>= 4;
+	}
+
+	return out;
+}
+
+std::string hexEncode(const std::string& text) {
+	std::string out;
+	for (unsigned char c : text) {
+		out += hexDigits[c >> 4];
+		out += hexDigits[c & 0xf];
+	}
+
+	return out;
+}
+
+bool parseHex(const std::string& text, uint64_t& value) {
+	if (text.empty()) {
+		return false;
+	}
+
+	char* end;
+	value = strtoull(text.c_str(), &end, 16);
+	return *end == '\0';
+}
+
+// Split "a,b" or "a,b:c" style arguments
+std::vector<std::string> split(const std::string& text, const char* separators) {
+	std::vector<std::string> parts;
+	size_t start = 0;
+
+	for (;;) {
+		auto end = text.find_first_of(separators, start);
+		parts.push_back(text.substr(start, end - start));
+		if (end == std::string::npos) {
+			return parts;
+		}
+
+		start = end + 1;
+	}
+}
+
+struct RegisterInfo {
+	const char* name;
+	size_t digits;
+};
+
+// Register numbers used by g/p/P
+const RegisterInfo registerInfo[] = {
+	{"pc", 6}, {"sr", 6}, {"omr", 6}, {"sp", 6}, {"la", 6}, {"lc", 6}, {"vba", 6},
+	{"a", 14}, {"b", 14}, {"x", 12}, {"y", 12},
+	{"r0", 6}, {"r1", 6}, {"r2", 6}, {"r3", 6}, {"r4", 6}, {"r5", 6}, {"r6", 6}, {"r7", 6},
+	{"n0", 6}, {"n1", 6}, {"n2", 6}, {"n3", 6}, {"n4", 6}, {"n5", 6}, {"n6", 6}, {"n7", 6},
+	{"m0", 6}, {"m1", 6}, {"m2", 6}, {"m3", 6}, {"m4", 6}, {"m5", 6}, {"m6", 6}, {"m7", 6},
+};
+
+const size_t registerCount = sizeof(registerInfo) / sizeof(registerInfo[0]);
+
+uint64_t registerValue(const CoreRegisters& regs, size_t n) {
+	switch (n) {
+		case 0: return regs.pc;
+		case 1: return regs.sr;
+		case 2: return regs.omr;
+		case 3: return regs.sp;
+		case 4: return regs.la;
+		case 5: return regs.lc;
+		case 6: return regs.vba;
+		case 7: return regs.a;
+		case 8: return regs.b;
+		case 9: return regs.x;
+		case 10: return regs.y;
+	}
+
+	n -= 11;
+	if (n < 8) {
+		return regs.r[n];
+	} else if (n < 16) {
+		return regs.n[n - 8];
+	}
+
+	return regs.m[n - 16];
+}
+
+size_t areaIndex(dsp56k::EMemArea area) {
+	switch (area) {
+		case dsp56k::MemArea_X:
+			return 1;
+		case dsp56k::MemArea_Y:
+			return 2;
+		default:
+			return 0;
+	}
+}
+
+bool memoryArea(uint64_t address, dsp56k::EMemArea& area) {
+	switch (address >> 24) {
+		case 0:
+			area = dsp56k::MemArea_P;
+			return true;
+		case 1:
+			area = dsp56k::MemArea_X;
+			return true;
+		case 2:
+			area = dsp56k::MemArea_Y;
+			return true;
+		default:
+			return false;
+	}
+}
+}
+
+DebugServer::DebugServer(std::string path, Debugger& debugger, dsp56k::DSP& dsp,
+		const MemoryImage& image, dsp56k::TWord bridge,
+		dsp56k::Disassembler& disasm, std::mutex& disasmMutex)
+	: m_path(path), m_debugger(debugger), m_dsp(dsp), m_image(image), m_bridge(bridge),
+	m_disasm(disasm), m_disasmMutex(disasmMutex) {
+	m_wake = eventfd(0, EFD_CLOEXEC);
+	m_listen = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (m_wake < 0 || m_listen < 0) {
+		throw std::runtime_error("Failed to create debug server socket");
+	}
+
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+
+	unlink(path.c_str());
+	if (bind(m_listen, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) < 0
+			|| listen(m_listen, 1) < 0) {
+		throw std::runtime_error("Failed to listen on " + path);
+	}
+}
+
+DebugServer::~DebugServer() {
+	if (m_listen >= 0) {
+		close(m_listen);
+		unlink(m_path.c_str());
+	}
+
+	if (m_wake >= 0) {
+		close(m_wake);
+	}
+}
+
+void DebugServer::shutdown() {
+	m_shutdown = true;
+
+	uint64_t one = 1;
+	::write(m_wake, &one, sizeof(one));
+}
+
+void DebugServer::run() {
+	while (!m_shutdown) {
+		struct pollfd fds[2] = {{m_listen, POLLIN, 0}, {m_wake, POLLIN, 0}};
+		if (poll(fds, 2, -1) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			return;
+		}
+
+		if (fds[1].revents & POLLIN) {
+			uint64_t count;
+			::read(m_wake, &count, sizeof(count));
+			continue;
+		}
+
+		int fd = accept4(m_listen, nullptr, nullptr, SOCK_CLOEXEC);
+		if (fd < 0) {
+			continue;
+		}
+
+		std::cerr << "Debugger attached" << std::endl;
+		session(fd);
+		close(fd);
+		std::cerr << "Debugger detached" << std::endl;
+	}
+}
+
+void DebugServer::session(int fd) {
+	m_client = fd;
+	m_debugger.setStopHandler([this](auto reason) {
+		uint64_t one = 1;
+		::write(m_wake, &one, sizeof(one));
+	});
+
+	// Stop the core on attach, like gdb does
+	m_running = true;
+	m_debugger.interrupt();
+
+	std::string buffer;
+	bool attached = true;
+
+	while (attached && !m_shutdown) {
+		struct pollfd fds[2] = {{fd, POLLIN, 0}, {m_wake, POLLIN, 0}};
+		if (poll(fds, 2, -1) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			break;
+		}
+
+		if (fds[1].revents & POLLIN) {
+			uint64_t count;
+			::read(m_wake, &count, sizeof(count));
+
+			if (m_running && m_debugger.stopped()) {
+				m_running = false;
+				if (!send(stopReply())) {
+					break;
+				}
+			}
+		}
+
+		if (!(fds[0].revents & (POLLIN | POLLHUP | POLLERR))) {
+			continue;
+		}
+
+		char chunk[4096];
+		auto n = recv(fd, chunk, sizeof(chunk), 0);
+		if (n <= 0) {
+			break;
+		}
+
+		buffer.append(chunk, n);
+
+		for (;;) {
+			// Interrupts and acknowledgements arrive outside of packets
+			auto start = buffer.find('$');
+			for (size_t i = 0; i < std::min(start, buffer.size()); i++) {
+				if (buffer[i] == 0x03) {
+					m_debugger.interrupt();
+				}
+			}
+
+			if (start == std::string::npos) {
+				buffer.clear();
+				break;
+			}
+
+			auto end = buffer.find('#', start);
+			if (end == std::string::npos || end + 2 >= buffer.size()) {
+				buffer.erase(0, start);
+				break;
+			}
+
+			auto data = buffer.substr(start + 1, end - start - 1);
+			uint64_t checksum;
+			bool valid = parseHex(buffer.substr(end + 1, 2), checksum);
+			buffer.erase(0, end + 3);
+
+			uint8_t sum = 0;
+			for (unsigned char c : data) {
+				sum += c;
+			}
+
+			if (!valid || sum != checksum) {
+				::send(fd, "-", 1, MSG_NOSIGNAL);
+				continue;
+			}
+
+			::send(fd, "+", 1, MSG_NOSIGNAL);
+
+			if (data == "D") {
+				send("OK");
+				attached = false;
+				break;
+			}
+
+			std::string reply;
+			if (handle(data, reply) && !send(reply)) {
+				attached = false;
+				break;
+			}
+		}
+	}
+
+	// Leave the core running without any of this client's breakpoints
+	if (!m_shutdown) {
+		if (!m_debugger.stopped()) {
+			m_debugger.interrupt();
+
+			uint64_t count;
+			while (!m_debugger.stopped()) {
+				::read(m_wake, &count, sizeof(count));
+			}
+		}
+
+		m_debugger.clearBreakpoints();
+		m_debugger.setStopHandler(nullptr);
+		m_debugger.continueExecution();
+	} else {
+		m_debugger.setStopHandler(nullptr);
+	}
+
+	m_running = false;
+	m_client = -1;
+}
+
+bool DebugServer::send(const std::string& reply) {
+	uint8_t sum = 0;
+	for (unsigned char c : reply) {
+		sum += c;
+	}
+
+	auto packet = "$" + reply + "#" + hex(sum, 2);
+	size_t sent = 0;
+
+	while (sent < packet.size()) {
+		auto n = ::send(m_client, packet.data() + sent, packet.size() - sent, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			return false;
+		}
+
+		sent += n;
+	}
+
+	return true;
+}
+
+std::string DebugServer::stopReply() {
+	switch (m_debugger.reason()) {
+		case Debugger::StopReason::Interrupt:
+			return "S02";
+		case Debugger::StopReason::Watchpoint: {
+			auto& hit = m_debugger.watchHit();
+			uint64_t address = uint64_t(areaIndex(hit.watchpoint.area)) << 24 | hit.address;
+
+			switch (hit.watchpoint.kind) {
+				case Debugger::WatchKind::Read:
+					return "T05rwatch:" + hex(address, 7) + ";";
+				case Debugger::WatchKind::Access:
+					return "T05awatch:" + hex(address, 7) + ";";
+				default:
+					return "T05watch:" + hex(address, 7) + ";";
+			}
+		}
+		default:
+			return "S05";
+	}
+}
+
+// Returns false when the reply is deferred until the core stops
+bool DebugServer::handle(const std::string& packet, std::string& reply) {
+	if (packet.empty()) {
+		reply = "";
+		return true;
+	}
+
+	auto command = packet[0];
+	auto args = packet.substr(1);
+
+	if (command == '?') {
+		if (m_running) {
+			return false;
+		}
+
+		reply = stopReply();
+		return true;
+	}
+
+	// Everything else inspects or changes state, which the core must not be
+	// touching at the same time
+	if (m_running) {
+		reply = "E01";
+		return true;
+	}
+
+	switch (command) {
+		case 'g':
+			reply = readRegisters();
+			return true;
+
+		case 'p': {
+			uint64_t n;
+			if (!parseHex(args, n) || !readRegister(n, reply)) {
+				reply = "E02";
+			}
+
+			return true;
+		}
+
+		case 'P': {
+			auto parts = split(args, "=");
+			uint64_t n, value;
+			if (parts.size() != 2 || !parseHex(parts[0], n) || !parseHex(parts[1], value)
+					|| !writeRegister(n, value)) {
+				reply = "E02";
+			} else {
+				reply = "OK";
+			}
+
+			return true;
+		}
+
+		case 'm': {
+			auto parts = split(args, ",");
+			uint64_t address, count;
+			if (parts.size() != 2 || !parseHex(parts[0], address) || !parseHex(parts[1], count)) {
+				reply = "E02";
+			} else if (!inRange(address, count)) {
+				reply = "E01";
+			} else if (!readMemory(address, count, reply)) {
+				reply = "E02";
+			}
+
+			return true;
+		}
+
+		case 'M': {
+			auto parts = split(args, ",:");
+			uint64_t address, count;
+			if (parts.size() != 3 || !parseHex(parts[0], address) || !parseHex(parts[1], count)) {
+				reply = "E02";
+			} else if (!inRange(address, count)) {
+				reply = "E01";
+			} else if (!writeMemory(address, count, parts[2])) {
+				reply = "E02";
+			} else {
+				reply = "OK";
+			}
+
+			return true;
+		}
+
+		case 'Z':
+		case 'z': {
+			auto parts = split(args, ",");
+			uint64_t address;
+			if (parts.size() < 2 || !parseHex(parts[1], address)) {
+				reply = "E02";
+				return true;
+			}
+
+			if (parts[0] == "2" || parts[0] == "3" || parts[0] == "4") {
+				reply = watchpoint(command == 'Z', parts) ? "OK" : "E03";
+				return true;
+			}
+
+			if (parts[0] != "0" && parts[0] != "1") {
+				// Unsupported breakpoint type
+				reply = "";
+				return true;
+			}
+
+			if (command == 'Z') {
+				m_debugger.setBreakpoint(address);
+			} else {
+				m_debugger.removeBreakpoint(address);
+			}
+
+			reply = "OK";
+			return true;
+		}
+
+		case 's':
+			m_running = true;
+			m_debugger.continueExecution(1);
+			return false;
+
+		case 'c':
+			m_running = true;
+			m_debugger.continueExecution();
+			return false;
+
+		case 'q': {
+			const std::string disasm = "Disasm:";
+			if (args.rfind(disasm, 0) != 0) {
+				reply = "";
+				return true;
+			}
+
+			auto parts = split(args.substr(disasm.size()), ",");
+			uint64_t address, count;
+			if (parts.size() != 2 || !parseHex(parts[0], address) || !parseHex(parts[1], count)) {
+				reply = "E02";
+			} else if (count > maxWords) {
+				reply = "E01";
+			} else {
+				reply = hexEncode(disassemble(address, count));
+			}
+
+			return true;
+		}
+
+		default:
+			reply = "";
+			return true;
+	}
+}
+
+bool DebugServer::watchpoint(bool insert, const std::vector<std::string>& args) {
+	uint64_t address, length = 1, value = 0;
+	dsp56k::EMemArea area;
+
+	if (!parseHex(args[1], address) || !memoryArea(address, area)
+			|| (args.size() > 2 && !parseHex(args[2], length))
+			|| (args.size() > 3 && !parseHex(args[3], value))
+			|| !length || !inRange(address, length)) {
+		return false;
+	}
+
+	auto kind = args[0] == "2" ? Debugger::WatchKind::Write
+		: args[0] == "3" ? Debugger::WatchKind::Read
+		: Debugger::WatchKind::Access;
+
+	if (!insert) {
+		return m_debugger.removeWatchpoint(area, address & 0xffffff, kind);
+	}
+
+	return m_debugger.addWatchpoint(Debugger::Watchpoint{
+		area, dsp56k::TWord(address & 0xffffff), dsp56k::TWord(length), kind,
+		args.size() > 3, dsp56k::TWord(value)});
+}
+
+std::string DebugServer::readRegisters() {
+	m_snapshot.capture(m_dsp);
+	auto regs = m_snapshot.last();
+
+	std::string reply;
+	for (size_t i = 0; i < registerCount; i++) {
+		reply += hex(registerValue(regs, i), registerInfo[i].digits);
+	}
+
+	return reply;
+}
+
+bool DebugServer::readRegister(size_t n, std::string& reply) {
+	if (n >= registerCount) {
+		return false;
+	}
+
+	m_snapshot.capture(m_dsp);
+	reply = hex(registerValue(m_snapshot.last(), n), registerInfo[n].digits);
+	return true;
+}
+
+bool DebugServer::writeRegister(size_t n, uint64_t value) {
+	auto& regs = m_dsp.regs();
+	auto word = dsp56k::TWord(value & 0xffffff);
+
+	switch (n) {
+		case 0: m_dsp.setPC(word); return true;
+		case 1: regs.sr.var = word; return true;
+		case 2: regs.omr.var = word; return true;
+		case 3: regs.sp.var = word; return true;
+		case 4: regs.la.var = word; return true;
+		case 5: regs.lc.var = word; return true;
+		case 6: regs.vba.var = word; return true;
+		case 7: regs.a.var = value & 0xffffffffffffff; return true;
+		case 8: regs.b.var = value & 0xffffffffffffff; return true;
+		case 9: regs.x.var = value & 0xffffffffffff; return true;
+		case 10: regs.y.var = value & 0xffffffffffff; return true;
+	}
+
+	if (n >= registerCount) {
+		return false;
+	}
+
+	n -= 11;
+	if (n < 8) {
+		regs.r[n].var = word;
+	} else if (n < 16) {
+		regs.n[n - 8].var = word;
+	} else {
+		regs.m[n - 16].var = word;
+	}
+
+	return true;
+}
+
+bool DebugServer::inRange(uint64_t address, uint64_t count) {
+	return count <= maxWords && (address & 0xffffff) + count <= m_dsp.memory().size();
+}
+
+bool DebugServer::readMemory(uint64_t address, size_t count, std::string& reply) {
+	dsp56k::EMemArea area;
+	if (!memoryArea(address, area)) {
+		return false;
+	}
+
+	std::vector<uint32_t> words(count);
+	dsp56720::readMemory(m_dsp.memory(), m_image, m_bridge, area, address & 0xffffff,
+			words.data(), count);
+
+	reply.clear();
+	for (auto word : words) {
+		reply += hex(word, 6);
+	}
+
+	return true;
+}
+
+bool DebugServer::writeMemory(uint64_t address, size_t count, const std::string& data) {
+	dsp56k::EMemArea area;
+	if (!memoryArea(address, area) || data.size() != count * 6) {
+		return false;
+	}
+
+	for (size_t i = 0; i < count; i++) {
+		uint64_t word;
+		if (!parseHex(data.substr(i * 6, 6), word)) {
+			return false;
+		}
+
+		m_dsp.memory().set(area, (address + i) & 0xffffff, word);
+	}
+
+	return true;
+}
+
+std::string DebugServer::disassemble(dsp56k::TWord address, size_t count) {
+	auto& memory = m_dsp.memory();
+	auto& regs = m_dsp.regs();
+	std::string text;
+
+	std::lock_guard<std::mutex> lock(m_disasmMutex);
+
+	for (size_t i = 0; i < count; i++) {
+		std::string line;
+		auto op = memory.get(dsp56k::MemArea_P, address);
+		auto opB = memory.get(dsp56k::MemArea_P, address + 1);
+		auto words = m_disasm.disassemble(line, op, opB, regs.sr.var, regs.omr.var, address);
+
+		text += hex(address, 6) + ": " + line + "\n";
+		address += words ? words : 1;
+	}
+
+	return text;
+}
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <dsp56kEmu/dsp.h>
+#include <dsp56kEmu/disasm.h>
+#include "debugger.h"
+#include "inspector.h"
+
+namespace dsp56720 {
+// Debug server speaking a subset of the gdb remote serial protocol on a
+// Unix domain socket. Packets are framed as $<data>#<checksum>, a raw 0x03
+// interrupts the running core.
+//
+// Differences from gdb: memory addresses are word addresses with the area
+// in bits 24-25 (0 = P, 1 = X, 2 = Y) and lengths count words, transferred
+// as six hex digits each. Registers are sent most significant digit first.
+//
+//   ?                    stop reason
+//   g, p<n>, P<n>=<v>    read all, read one, write one register
+//   m<addr>,<len>        read memory, at most maxWords
+//   M<addr>,<len>:<data> write memory
+//   Z0,<addr>,<kind>     set breakpoint, z0 removes it
+//   Z2,<addr>,<len>[,<v>] set write watchpoint, optionally only when <v> is
+//                        written; Z3 read, Z4 access, z2-z4 remove them
+//   s, c                 single step, continue
+//   qDisasm:<addr>,<n>   disassemble up to maxWords instructions, hex
+//                        encoded text
+//   D                    detach and resume
+//
+// While no client is connected the server only sits in accept(), and the
+// debugger stays on its fast path.
+class DebugServer {
+public:
+	// Longest transfer a single packet may ask for. Longer ones and ranges
+	// past the end of memory are answered with E01.
+	static constexpr size_t maxWords = 0x1000;
+
+	// disasm is shared with other threads, which lock disasmMutex too
+	DebugServer(std::string path, Debugger& debugger, dsp56k::DSP& dsp,
+			const MemoryImage& image, dsp56k::TWord bridge,
+			dsp56k::Disassembler& disasm, std::mutex& disasmMutex);
+	~DebugServer();
+
+	void run();
+	void shutdown();
+
+private:
+	void session(int fd);
+	bool handle(const std::string& packet, std::string& reply);
+	bool send(const std::string& reply);
+	std::string stopReply();
+	bool watchpoint(bool insert, const std::vector<std::string>& args);
+
+	std::string readRegisters();
+	bool readRegister(size_t n, std::string& reply);
+	bool writeRegister(size_t n, uint64_t value);
+	bool inRange(uint64_t address, uint64_t count);
+	bool readMemory(uint64_t address, size_t count, std::string& reply);
+	bool writeMemory(uint64_t address, size_t count, const std::string& data);
+	std::string disassemble(dsp56k::TWord address, size_t count);
+
+	std::string m_path;
+	Debugger& m_debugger;
+	dsp56k::DSP& m_dsp;
+	const MemoryImage& m_image;
+	const dsp56k::TWord m_bridge;
+	dsp56k::Disassembler& m_disasm;
+	std::mutex& m_disasmMutex;
+	CoreSnapshot m_snapshot;
+
+	int m_listen = -1;
+	int m_client = -1;
+	int m_wake = -1;
+	std::atomic<bool> m_shutdown{false};
+	bool m_running = false;
+};
+}
@@ -0,0 +1,321 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <dsp56kEmu/dsp.h>
+#include "peripherals.h"
+#include "bitfield.h"
+
+namespace dsp56720 {
+// DMA request sources as selected by DCR::DRS
+enum DmaRequest : uint32_t {
+	DmaRequest_IRQA = 0,
+	DmaRequest_IRQB = 1,
+	DmaRequest_IRQC = 2,
+	DmaRequest_IRQD = 3,
+	DmaRequest_TransferDone0 = 4, // Channels 0-5 at 4-9
+	DmaRequest_ESAI_Receive = 10,
+	DmaRequest_ESAI_Transmit = 11,
+	DmaRequest_SHI_Receive = 12,
+	DmaRequest_SHI_Transmit = 13,
+	DmaRequest_ESAI1_Receive = 14,
+	DmaRequest_ESAI1_Transmit = 15,
+	DmaRequest_SHI1_Receive = 16,
+	DmaRequest_SHI1_Transmit = 17,
+	DmaRequest_ASRC_InputA = 18,  // Pairs A-C at 18-20
+	DmaRequest_ASRC_OutputA = 21, // Pairs A-C at 21-23
+	DmaRequest_SPDIF_Receive = 24,
+	DmaRequest_SPDIF_Transmit = 25,
+	DmaRequest_Count = 32,
+};
+
+// Six channel DMA controller. Transfers run inside exec() as a loop of word
+// copies through dsp56k::Memory, or the register dispatch for I/O addresses,
+// so a whole block costs one call instead of an interrupt and service
+// routine per word. Only one-dimensional addressing is modelled.
+class DmaController : public Peripheral {
+public:
+	static constexpr size_t channels = 6;
+
+	// Channel n interrupts at VBA:$18 + 2n, above IRQA-IRQD at $10-$16
+	static constexpr dsp56k::TWord Vba_DMA_Channel0 = 0x18;
+
+	struct DCR : BitField<dsp56k::TWord> {
+		using BitField<dsp56k::TWord>::operator=;
+
+		using DE = Bit<23>;         // DMA Channel Enable
+		using DIE = Bit<22>;        // DMA Interrupt Enable
+		using DTM = Packed<19, 3>;  // DMA Transfer Mode
+		using DPR = Packed<17, 2>;  // DMA Channel Priority
+		using DCON = Bit<16>;       // DMA Continuous Mode Enable
+		using DRS = Packed<11, 5>;  // DMA Request Source
+		using D3D = Bit<10>;        // Three Dimensional Mode
+		using DAMS = Packed<7, 3>;  // Source Address Generation Mode
+		using DAMD = Packed<4, 3>;  // Destination Address Generation Mode
+		using DDS = Packed<2, 2>;   // Destination Space
+		using DSS = Packed<0, 2>;   // Source Space
+	};
+
+	enum TransferMode {
+		BlockPerRequest = 0,
+		WordPerRequest = 1,
+		LinePerRequest = 2,
+		BlockPerEnable = 3,
+		WordPerRequestContinuous = 4,
+		LinePerRequestContinuous = 5,
+	};
+
+	enum AddressMode {
+		NoUpdate = 4,
+		PostIncrement = 5,
+	};
+
+	virtual const char* name() const override { return "dma"; }
+
+	virtual uint32_t idleCycles() override {
+		return m_enabled && (m_started || bus().dmaPending()) ? 0 : unbounded;
+	}
+
+	virtual void exec() override {
+		if (!m_enabled || (!m_started && !bus().dmaPending())) {
+			return;
+		}
+
+		m_started = false;
+
+		// Requests nobody consumes this time around are dropped, like a
+		// level that deasserts before the channel samples it. Requests raised
+		// by completing transfers are seen on the next call.
+		auto requests = bus().takeDmaRequests();
+		for (size_t c = 0; c < channels; c++) {
+			auto& channel = m_channels[c];
+			if (!DCR::DE(channel.dcr)) {
+				continue;
+			}
+
+			auto mode = DCR::DTM(channel.dcr);
+			if (mode == BlockPerEnable) {
+				transfer(c, channel.remaining);
+				continue;
+			}
+
+			auto& pending = requests[DCR::DRS(channel.dcr)];
+			while (pending && DCR::DE(channel.dcr)) {
+				--pending;
+				transfer(c, mode == BlockPerRequest ? channel.remaining : 1);
+			}
+		}
+	}
+
+	virtual void reset() override {
+		for (auto& channel : m_channels) {
+			channel = Channel{};
+		}
+
+		m_enabled = 0;
+		m_started = false;
+		updateSources();
+	}
+
+	virtual void terminate() override {}
+	virtual RegisterTable registers() override { return Registers; }
+
+	// Words moved since startup, safe to call from any thread
+	uint64_t words() const { return m_words.load(std::memory_order_relaxed); }
+
+	dsp56k::TWord readDSTR() {
+		dsp56k::TWord value = 0;
+		for (size_t c = 0; c < channels; c++) {
+			if (!DCR::DE(m_channels[c].dcr)) {
+				value |= 1 << c; // DTD
+			}
+		}
+
+		return value;
+	}
+
+	template <int N> dsp56k::TWord readDOR() { return m_dor[N]; }
+	template <int N> void writeDOR(dsp56k::TWord value) { m_dor[N] = value; }
+
+	template <int C> dsp56k::TWord readDSR() { return m_channels[C].source; }
+	template <int C> void writeDSR(dsp56k::TWord value) { m_channels[C].source = value; }
+
+	template <int C> dsp56k::TWord readDDR() { return m_channels[C].destination; }
+	template <int C> void writeDDR(dsp56k::TWord value) { m_channels[C].destination = value; }
+
+	template <int C> dsp56k::TWord readDCO() { return m_channels[C].counter; }
+	template <int C> void writeDCO(dsp56k::TWord value) { m_channels[C].counter = value & 0xffffff; }
+
+	template <int C> dsp56k::TWord readDCR() { return m_channels[C].dcr; }
+
+	template <int C> void writeDCR(dsp56k::TWord value) {
+		auto& channel = m_channels[C];
+		bool wasEnabled = DCR::DE(channel.dcr);
+		channel.dcr = value;
+
+		if (DCR::DE(channel.dcr)) {
+			if (!wasEnabled) {
+				start(channel);
+			}
+
+			m_enabled |= 1 << C;
+		} else {
+			m_enabled &= ~(1 << C);
+		}
+
+		updateSources();
+	}
+
+private:
+	struct Channel {
+		DCR dcr{};
+		dsp56k::TWord source = 0;
+		dsp56k::TWord destination = 0;
+		dsp56k::TWord counter = 0;
+
+		// Latched when the channel is enabled, for continuous modes
+		dsp56k::TWord startSource = 0;
+		dsp56k::TWord startDestination = 0;
+		dsp56k::TWord startCounter = 0;
+		dsp56k::TWord remaining = 0;
+	};
+
+	static dsp56k::EMemArea space(dsp56k::TWord field) {
+		switch (field) {
+			case 0: return dsp56k::MemArea_X;
+			case 1: return dsp56k::MemArea_Y;
+			default: return dsp56k::MemArea_P;
+		}
+	}
+
+	void start(Channel& channel) {
+		if (DCR::D3D(channel.dcr)) {
+			LOG("DMA: three-dimensional mode is not supported, using linear addressing");
+		}
+
+		channel.startSource = channel.source;
+		channel.startDestination = channel.destination;
+		channel.startCounter = channel.counter;
+		channel.remaining = channel.counter + 1;
+		m_started = true;
+	}
+
+	dsp56k::TWord load(dsp56k::EMemArea area, dsp56k::TWord address) {
+		if (area != dsp56k::MemArea_P && Peripherals::isIO(address)) {
+			return bus().read(area, address, dsp56k::Nop);
+		}
+
+		return dsp().memory().get(area, address);
+	}
+
+	void store(dsp56k::EMemArea area, dsp56k::TWord address, dsp56k::TWord value) {
+		if (area != dsp56k::MemArea_P && Peripherals::isIO(address)) {
+			bus().write(area, address, value);
+			return;
+		}
+
+		dsp().memory().set(area, address, value);
+	}
+
+	void transfer(size_t c, dsp56k::TWord words) {
+		auto& channel = m_channels[c];
+		auto from = space(DCR::DSS(channel.dcr));
+		auto to = space(DCR::DDS(channel.dcr));
+		dsp56k::TWord sourceStep = DCR::DAMS(channel.dcr) == PostIncrement;
+		dsp56k::TWord destinationStep = DCR::DAMD(channel.dcr) == PostIncrement;
+
+		words = std::min(words, channel.remaining);
+		for (dsp56k::TWord i = 0; i < words; i++) {
+			store(to, channel.destination, load(from, channel.source));
+			channel.source = (channel.source + sourceStep) & 0xffffff;
+			channel.destination = (channel.destination + destinationStep) & 0xffffff;
+		}
+
+		count(m_words, words);
+		channel.remaining -= words;
+		channel.counter = channel.remaining ? channel.remaining - 1 : 0;
+
+		if (!channel.remaining) {
+			done(c);
+		}
+	}
+
+	void done(size_t c) {
+		auto& channel = m_channels[c];
+		auto mode = DCR::DTM(channel.dcr);
+
+		if (mode == WordPerRequestContinuous || mode == LinePerRequestContinuous) {
+			channel.source = channel.startSource;
+			channel.destination = channel.startDestination;
+			channel.counter = channel.startCounter;
+			channel.remaining = channel.startCounter + 1;
+		} else {
+			channel.dcr |= DCR::DE(0);
+			m_enabled &= ~(1 << c);
+			updateSources();
+		}
+
+		dmaRequest(DmaRequest_TransferDone0 + c);
+		if (DCR::DIE(channel.dcr)) {
+			interrupt(Vba_DMA_Channel0 + 2 * c);
+		}
+	}
+
+	void updateSources() {
+		uint32_t sources = 0;
+		for (auto& channel : m_channels) {
+			if (DCR::DE(channel.dcr) && DCR::DTM(channel.dcr) != BlockPerEnable) {
+				sources |= 1u << DCR::DRS(channel.dcr);
+			}
+		}
+
+		bus().setDmaSources(sources);
+	}
+
+	std::array<Channel, channels> m_channels{};
+	std::array<dsp56k::TWord, 4> m_dor{};
+	uint32_t m_enabled = 0;
+	bool m_started = false; // A channel was enabled since the last exec()
+	std::atomic<uint64_t> m_words{0};
+
+	using DMA = DmaController;
+
+	static constexpr Register Registers[] = {
+		reg<&DMA::readDSTR, nullptr>("DSTR", 0xFFFFF4_xmem),
+		reg<&DMA::readDOR<0>, &DMA::writeDOR<0>>("DOR0", 0xFFFFF3_xmem),
+		reg<&DMA::readDOR<1>, &DMA::writeDOR<1>>("DOR1", 0xFFFFF2_xmem),
+		reg<&DMA::readDOR<2>, &DMA::writeDOR<2>>("DOR2", 0xFFFFF1_xmem),
+		reg<&DMA::readDOR<3>, &DMA::writeDOR<3>>("DOR3", 0xFFFFF0_xmem),
+
+		reg<&DMA::readDSR<0>, &DMA::writeDSR<0>>("DSR0", 0xFFFFEF_xmem),
+		reg<&DMA::readDDR<0>, &DMA::writeDDR<0>>("DDR0", 0xFFFFEE_xmem),
+		reg<&DMA::readDCO<0>, &DMA::writeDCO<0>>("DCO0", 0xFFFFED_xmem),
+		reg<&DMA::readDCR<0>, &DMA::writeDCR<0>>("DCR0", 0xFFFFEC_xmem),
+
+		reg<&DMA::readDSR<1>, &DMA::writeDSR<1>>("DSR1", 0xFFFFEB_xmem),
+		reg<&DMA::readDDR<1>, &DMA::writeDDR<1>>("DDR1", 0xFFFFEA_xmem),
+		reg<&DMA::readDCO<1>, &DMA::writeDCO<1>>("DCO1", 0xFFFFE9_xmem),
+		reg<&DMA::readDCR<1>, &DMA::writeDCR<1>>("DCR1", 0xFFFFE8_xmem),
+
+		reg<&DMA::readDSR<2>, &DMA::writeDSR<2>>("DSR2", 0xFFFFE7_xmem),
+		reg<&DMA::readDDR<2>, &DMA::writeDDR<2>>("DDR2", 0xFFFFE6_xmem),
+		reg<&DMA::readDCO<2>, &DMA::writeDCO<2>>("DCO2", 0xFFFFE5_xmem),
+		reg<&DMA::readDCR<2>, &DMA::writeDCR<2>>("DCR2", 0xFFFFE4_xmem),
+
+		reg<&DMA::readDSR<3>, &DMA::writeDSR<3>>("DSR3", 0xFFFFE3_xmem),
+		reg<&DMA::readDDR<3>, &DMA::writeDDR<3>>("DDR3", 0xFFFFE2_xmem),
+		reg<&DMA::readDCO<3>, &DMA::writeDCO<3>>("DCO3", 0xFFFFE1_xmem),
+		reg<&DMA::readDCR<3>, &DMA::writeDCR<3>>("DCR3", 0xFFFFE0_xmem),
+
+		reg<&DMA::readDSR<4>, &DMA::writeDSR<4>>("DSR4", 0xFFFFDF_xmem),
+		reg<&DMA::readDDR<4>, &DMA::writeDDR<4>>("DDR4", 0xFFFFDE_xmem),
+		reg<&DMA::readDCO<4>, &DMA::writeDCO<4>>("DCO4", 0xFFFFDD_xmem),
+		reg<&DMA::readDCR<4>, &DMA::writeDCR<4>>("DCR4", 0xFFFFDC_xmem),
+
+		reg<&DMA::readDSR<5>, &DMA::writeDSR<5>>("DSR5", 0xFFFFDB_xmem),
+		reg<&DMA::readDDR<5>, &DMA::writeDDR<5>>("DDR5", 0xFFFFDA_xmem),
+		reg<&DMA::readDCO<5>, &DMA::writeDCO<5>>("DCO5", 0xFFFFD9_xmem),
+		reg<&DMA::readDCR<5>, &DMA::writeDCR<5>>("DCR5", 0xFFFFD8_xmem),
+	};
+};
+}
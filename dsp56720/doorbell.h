@@ -0,0 +1,31 @@
+#pragma once
+
+#include <atomic>
+#include <functional>
+
+namespace dsp56720 {
+// Wakes a parked chip. Host side producers ring it after handing the core
+// something that can end a WAIT or an empty-input stall: samples, SHI
+// words, pin changes.
+class Doorbell {
+public:
+	// Set before the chip starts running
+	void setHandler(std::function<void()> handler) {
+		m_handler = std::move(handler);
+	}
+
+	// Safe to call from any thread
+	void ring() {
+		m_rings.fetch_add(1, std::memory_order_relaxed);
+		if (m_handler) {
+			m_handler();
+		}
+	}
+
+	uint64_t rings() const { return m_rings.load(std::memory_order_relaxed); }
+
+private:
+	std::function<void()> m_handler;
+	std::atomic<uint64_t> m_rings{0};
+};
+}
@@ -0,0 +1,61 @@
+#include "emc.h"
+
+#include <cerrno>
+#include <system_error>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace dsp56720 {
+MemoryImage::MemoryImage(dsp56k::TWord words, const std::string& path)
+	: m_words(words), m_bytes(size_t(words) * dsp56k::MemArea_COUNT * sizeof(dsp56k::TWord)) {
+	void* data;
+
+	if (path.empty()) {
+		data = mmap(nullptr, m_bytes, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	} else {
+		int fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+		if (fd < 0) {
+			throw std::system_error(errno, std::generic_category(), path);
+		}
+
+		// Growing the file leaves a hole, which reads as zeros
+		if (ftruncate(fd, m_bytes) < 0) {
+			auto error = errno;
+			close(fd);
+			throw std::system_error(error, std::generic_category(), path);
+		}
+
+		data = mmap(nullptr, m_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		close(fd);
+	}
+
+	if (data == MAP_FAILED) {
+		throw std::system_error(errno, std::generic_category(),
+				path.empty() ? "memory image" : path);
+	}
+
+	m_data = static_cast<dsp56k::TWord*>(data);
+}
+
+MemoryImage::~MemoryImage() {
+	munmap(m_data, m_bytes);
+}
+
+size_t MemoryImage::resident() const {
+	auto page = size_t(sysconf(_SC_PAGESIZE));
+	std::vector<unsigned char> pages((m_bytes + page - 1) / page);
+	if (mincore(m_data, m_bytes, pages.data()) < 0) {
+		return 0;
+	}
+
+	size_t resident = 0;
+	for (auto state : pages) {
+		resident += state & 1;
+	}
+
+	return resident * page;
+}
+}
@@ -0,0 +1,169 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <string>
+#include <dsp56kEmu/dsp.h>
+#include "peripherals.h"
+#include "ccm.h"
+#include "guard.h"
+
+namespace dsp56720 {
+// Backing store of dsp56k::Memory for all three areas. Pages are only
+// allocated when first touched, so a large external memory costs what the
+// firmware uses. With a path the store is a file mapped shared, keeping
+// its contents across runs and readable by other processes.
+class MemoryImage {
+public:
+	MemoryImage(dsp56k::TWord words, const std::string& path = "");
+	~MemoryImage();
+
+	MemoryImage(const MemoryImage&) = delete;
+	MemoryImage& operator=(const MemoryImage&) = delete;
+
+	dsp56k::TWord* data() { return m_data; }
+
+	// Words of one area, laid out X, Y, P as dsp56k::Memory uses them
+	const dsp56k::TWord* area(dsp56k::EMemArea area) const { return m_data + size_t(area) * m_words; }
+	dsp56k::TWord words() const { return m_words; }
+
+	// Bytes actually backed by memory, safe to call from any thread
+	size_t resident() const;
+
+private:
+	dsp56k::TWord* m_data = nullptr;
+	dsp56k::TWord m_words;
+	size_t m_bytes = 0;
+};
+
+// External memory controller. Addresses from base up to the end of memory
+// are external; X and Y are bridged to P. With timing enabled every
+// external access the core reports to its memory validator is charged wait
+// states according to the burst buffer configured in EMBC:
+//
+// - Without the burst buffer each access is a single SDRAM access.
+// - Reads that hit a buffered line are free, misses fill the least
+//   recently used line with a burst.
+// - Writes go around the buffer, dropping a stale line. Posted writes are
+//   free.
+//
+// Wait states advance the clock the peripherals see, so firmware that
+// misses a lot gets fewer instructions per audio frame, as on hardware.
+//
+// As the validator of all of memory it also applies the debugger's page
+// guards, internal memory included.
+class ExternalMemoryController : public dsp56k::IMemoryValidator {
+public:
+	// Row activation and CAS latency of an SDRAM access, then one cycle
+	// per further word of a burst
+	static constexpr uint32_t accessWaitStates = 8;
+	static constexpr uint32_t burstWaitStates = 1;
+
+	static constexpr size_t maxLines = 8;
+
+	ExternalMemoryController(ChipConfigurationModule& ccm, Peripherals& peripherals,
+			const MemoryGuard& guard, dsp56k::TWord base, dsp56k::TWord end, bool timing)
+		: m_ccm(ccm), m_peripherals(peripherals), m_guard(guard),
+		m_base(base), m_end(end), m_timing(timing) {}
+
+	// The core only holds a const validator, the model state is mutable
+	bool memValidateAccess(dsp56k::EMemArea area, dsp56k::TWord address, bool write) const override {
+		m_guard.check(area, address, write);
+
+		if (write && (area == dsp56k::MemArea_P || address < dsp56k::XIO_Reserved_High_First)) {
+			m_peripherals.stored();
+		}
+
+		if (m_timing && address >= m_base && address < m_end) {
+			m_peripherals.advance(waitStates(area, address, write));
+		}
+
+		return true;
+	}
+
+	dsp56k::TWord base() const { return m_base; }
+	bool timing() const { return m_timing; }
+
+	// Safe to call from any thread
+	uint64_t hits() const { return m_hits.load(std::memory_order_relaxed); }
+	uint64_t misses() const { return m_misses.load(std::memory_order_relaxed); }
+	uint64_t totalWaitStates() const { return m_waitStates.load(std::memory_order_relaxed); }
+
+private:
+	using EMBC = ChipConfigurationModule::EMBC;
+
+	struct Line {
+		bool valid = false;
+		dsp56k::EMemArea area;
+		dsp56k::TWord tag;
+		uint64_t used;
+	};
+
+	uint32_t waitStates(dsp56k::EMemArea area, dsp56k::TWord address, bool write) const {
+		auto embc = m_ccm.embc();
+		if (embc != m_embc) {
+			// A new line size or count invalidates the buffer
+			m_embc = embc;
+			m_lines = {};
+		}
+
+		if (!EMBC::BBE(embc)) {
+			return charge(accessWaitStates);
+		}
+
+		// P is bridged to X, so they share lines
+		if (area == dsp56k::MemArea_P) {
+			area = dsp56k::MemArea_X;
+		}
+
+		auto lineWords = 4u << EMBC::BL(embc);
+		auto tag = address / lineWords;
+		auto lines = m_lines.begin() + (size_t(1) << EMBC::BN(embc));
+
+		auto line = std::find_if(m_lines.begin(), lines, [&](const Line& line) {
+			return line.valid && line.area == area && line.tag == tag;
+		});
+
+		if (write) {
+			if (line != lines) {
+				line->valid = false;
+			}
+
+			return charge(EMBC::PWE(embc) ? 0 : accessWaitStates);
+		}
+
+		if (line != lines) {
+			line->used = ++m_accesses;
+			count(m_hits);
+			return 0;
+		}
+
+		auto victim = std::min_element(m_lines.begin(), lines, [](const Line& a, const Line& b) {
+			return !a.valid ? b.valid : b.valid && a.used < b.used;
+		});
+
+		*victim = Line{true, area, tag, ++m_accesses};
+		count(m_misses);
+		return charge(accessWaitStates + (lineWords - 1) * burstWaitStates);
+	}
+
+	uint32_t charge(uint32_t waitStates) const {
+		count(m_waitStates, waitStates);
+		return waitStates;
+	}
+
+	ChipConfigurationModule& m_ccm;
+	Peripherals& m_peripherals;
+	const MemoryGuard& m_guard;
+	const dsp56k::TWord m_base;
+	const dsp56k::TWord m_end;
+	const bool m_timing;
+
+	mutable EMBC m_embc{};
+	mutable std::array<Line, maxLines> m_lines{};
+	mutable uint64_t m_accesses = 0;
+
+	mutable std::atomic<uint64_t> m_hits{0}, m_misses{0}, m_waitStates{0};
+};
+}
@@ -1,37 +1,192 @@
 #pragma once
 
+#include <algorithm>
+#include <memory>
 #include <dsp56kEmu/dsp.h>
 #include "peripherals.h"
 #include "cgm.h"
 #include "bitfield.h"
+#include "queue.h"
+#include "pacer.h"
+#include "dma.h"
+#include "doorbell.h"
 
 namespace dsp56720 {
+class SpdifTransceiver;
+
+// State and behaviour shared by the ESAI instances. The register addresses
+// are supplied by EnhancedSerialAudioPort.
 class EnhancedSerialAudioInterface : public Peripheral {
 public:
+	using SampleQueue = Queue<uint32_t, CircularBuffer<uint32_t, 8192>>;
+
+	class Input;
+	class Output;
+	// Samples produced by the DSP. Unless the policy is Policy::Block a slow
+	// reader causes dropped samples instead of stalling the core.
 	class Output {
 	public:
-		uint32_t readSample() { return m_queue.pop(); }
+		uint32_t readSample() { return m_queue->pop(); }
+
+		// Block read for file sinks, see Queue::popFor()
+		template <typename Duration>
+		size_t readSamples(uint32_t* samples, size_t count, Duration timeout) {
+			return m_queue->popFor(samples, count, timeout);
+		}
+
+		size_t fill() const { return m_queue->size(); }
+		Watermarks watermarks() const { return m_queue->watermarks(); }
+		void resetWatermarks() { m_queue->resetWatermarks(); }
+
+		// See Queue::watch(). Only call before the chip runs.
+		void watch(QueueWatcher watcher) { m_queue->watch(std::move(watcher)); }
+
+		size_t capacity() const { return m_queue->capacity(); }
+		size_t setCapacity(size_t capacity) { return m_queue->setCapacity(capacity); }
+
+		Policy policy() const { return m_policy; }
+		// Fails for Policy::Block once connected, see Input::connect()
+		bool setPolicy(Policy policy) {
+			if (policy == Policy::Block && m_connected) {
+				return false;
+			}
+
+			m_policy = policy;
+			return true;
+		}
+
+		uint64_t overruns() const { return m_overruns.load(std::memory_order_relaxed); }
 
 	private:
 		friend EnhancedSerialAudioInterface;
+		friend SpdifTransceiver;
+		friend Input;
+
+		void shutdown() { m_queue->shutdown(); }
+
+		void push(uint32_t v) {
+			if (!m_queue->push(v, m_policy)) {
+				count(m_overruns);
+			}
+		}
 
-		void shutdown() { m_queue.shutdown(); }
-		void push(uint32_t v) { m_queue.push(v); }
+		void push(const uint32_t* values, size_t n) {
+			if (auto dropped = m_queue->push(values, n, m_policy)) {
+				count(m_overruns, dropped);
+			}
+		}
 
-		Queue<uint32_t, CircularBuffer<uint32_t, 8192>> m_queue;
+		std::shared_ptr<SampleQueue> m_queue = std::make_shared<SampleQueue>();
+		std::atomic<Policy> m_policy{Policy::DropOldest};
+		std::atomic<bool> m_connected{false};
+		std::atomic<uint64_t> m_overruns{0};
 	};
 
+	// Samples consumed by the DSP. Unless the policy is Policy::Block an
+	// empty queue feeds zeros instead of stalling the core.
 	class Input {
 	public:
-		void writeSample(uint32_t v) { m_queue.push(v); }
+		void writeSample(uint32_t v) {
+			m_queue->push(v);
+			ring();
+		}
+
+		// Block write for the VFS, ringing once per chunk instead of once
+		// per sample. A chunk never exceeds the queue, so its push only
+		// waits for samples the core was already rung for.
+		void writeSamples(const uint32_t* samples, size_t count) {
+			while (count) {
+				auto n = std::min({count, writeChunk, m_queue->capacity()});
+				m_queue->push(samples, n);
+				ring();
+				samples += n;
+				count -= n;
+			}
+		}
+
+		// Block write for file sources, see Queue::pushFor()
+		template <typename Duration>
+		size_t writeSamples(const uint32_t* samples, size_t count, Duration timeout) {
+			auto written = m_queue->pushFor(samples, count, timeout);
+			ring();
+			return written;
+		}
+
+		// Consume the samples of another chip's output directly from its
+		// queue. Both ends then run on one thread and would wait for each
+		// other forever, so neither may block: fails if either has
+		// Policy::Block, and both refuse it from then on. Only call before
+		// the chips start, see Chip::start().
+		bool connect(Output& output) {
+			if (m_policy == Policy::Block || output.m_policy == Policy::Block) {
+				return false;
+			}
+
+			m_queue = output.m_queue;
+			m_connected = output.m_connected = true;
+			return true;
+		}
+
+		size_t fill() const { return m_queue->size(); }
+		Watermarks watermarks() const { return m_queue->watermarks(); }
+		void resetWatermarks() { m_queue->resetWatermarks(); }
+
+		// See Queue::watch(). Only call before the chip runs.
+		void watch(QueueWatcher watcher) { m_queue->watch(std::move(watcher)); }
+
+		size_t capacity() const { return m_queue->capacity(); }
+		size_t setCapacity(size_t capacity) { return m_queue->setCapacity(capacity); }
+
+		Policy policy() const { return m_policy; }
+		// Fails for Policy::Block once connected, see connect()
+		bool setPolicy(Policy policy) {
+			if (policy == Policy::Block && m_connected) {
+				return false;
+			}
+
+			m_policy = policy;
+			return true;
+		}
+
+		uint64_t underruns() const { return m_underruns.load(std::memory_order_relaxed); }
+
+		// Rung after every host write. Only call before the chip runs.
+		void setDoorbell(Doorbell* doorbell) { m_doorbell = doorbell; }
 
 	private:
 		friend EnhancedSerialAudioInterface;
+		friend SpdifTransceiver;
 
-		void shutdown() { m_queue.shutdown(); }
-		uint32_t pop() { return m_queue.pop(); }
+		static constexpr size_t writeChunk = 256;
 
-		Queue<uint32_t, CircularBuffer<uint32_t, 8192>> m_queue;
+		void shutdown() { m_queue->shutdown(); }
+
+		void ring() {
+			if (m_doorbell) {
+				m_doorbell->ring();
+			}
+		}
+
+		uint32_t pop() {
+			uint32_t value;
+			if (!m_queue->pop(value, m_policy)) {
+				count(m_underruns);
+			}
+
+			return value;
+		}
+
+		void pop(uint32_t* values, size_t n) {
+			if (auto missing = m_queue->pop(values, n, m_policy)) {
+				count(m_underruns, missing);
+			}
+		}
+
+		std::shared_ptr<SampleQueue> m_queue = std::make_shared<SampleQueue>();
+		std::atomic<Policy> m_policy{Policy::ZeroFill};
+		std::atomic<bool> m_connected{false};
+		std::atomic<uint64_t> m_underruns{0};
+		Doorbell* m_doorbell = nullptr;
 	};
 
 	struct SR : BitField<dsp56k::TWord> {
@@ -57,7 +212,16 @@ public:
 		using TE = Set<0, 6>; // Transmit Enable
 	};
 
-	EnhancedSerialAudioInterface(ClockGenerationModule& cgm) : m_cgm(cgm) {
+	// Interrupt vectors and DMA request sources of an instance
+	struct Vectors {
+		dsp56k::TWord transmitData;
+		dsp56k::TWord transmitLastSlot;
+		uint32_t dmaReceive;
+		uint32_t dmaTransmit;
+	};
+
+	EnhancedSerialAudioInterface(ClockGenerationModule& cgm, const Vectors& vectors)
+		: m_cgm(cgm), m_vectors(vectors) {
 		m_tx.fill(0);
 		m_rx.fill(0);
 	}
@@ -78,6 +242,7 @@ public:
 
 		// Time to xfer samples!
 		m_cyclesSinceWrite -= m_cgm.cyclesPerSample();
+		count(m_frames);
 		for (int i = 0; i < m_audioOutputs.size(); i++) {
 			if (outputEnabled(i)) {
 				m_audioOutputs[i].push(m_tx[i]);
@@ -102,12 +267,21 @@ public:
 		/* 	interrupt(dsp56k::Vba_ESAI_Transmit_Data); */
 		/* } */
 
+		if (m_pacer) {
+			m_pacer->frame(outputFill());
+		}
+
+		// One request per enabled transmitter and receiver, for firmware
+		// that moves frames by DMA instead of the data interrupts
+		dmaRequest(m_vectors.dmaTransmit, __builtin_popcount(TCR::TE(m_tcr)));
+		dmaRequest(m_vectors.dmaReceive, __builtin_popcount(RCR::RE(m_rcr)));
+
 		if (TCR::TIE(m_tcr)) {
-			interrupt(dsp56k::Vba_ESAI_Transmit_Data);
+			interrupt(m_vectors.transmitData);
 		}
 
 		if (SR::TFS(m_sr) && TCR::TLIE(m_tcr)) {
-			interrupt(dsp56k::Vba_ESAI_Transmit_Last_Slot);
+			interrupt(m_vectors.transmitLastSlot);
 		}
 
 		m_sr |= SR::TUE(1);
@@ -116,6 +290,16 @@ public:
 		m_hasReadStatus = 0;
 	}
 
+	virtual uint32_t idleCycles() override {
+		if (!TCR::TE(m_tcr)) {
+			return unbounded;
+		}
+
+		// exec() moves a frame once more than cyclesPerSample have passed
+		auto elapsed = m_cyclesSinceWrite + dsp56k::delta(getInstructionCounter(), m_lastClock);
+		return elapsed < m_cgm.cyclesPerSample() ? m_cgm.cyclesPerSample() - elapsed : 0;
+	}
+
 	virtual void reset() override {}
 
 	virtual void terminate() override {
@@ -128,10 +312,6 @@ public:
 		}
 	}
 
-	virtual std::vector<Register> registers() override {
-		return m_registers;
-	}
-
 	Input& input(size_t n) {
 		return m_audioInputs[n];
 	}
@@ -140,6 +320,12 @@ public:
 		return m_audioOutputs[n];
 	}
 
+	// Optional realtime pacing, called once per frame
+	void setPacer(Pacer* pacer) { m_pacer = pacer; }
+
+	// Frames transferred since startup, safe to call from any thread
+	uint64_t frames() const { return m_frames.load(std::memory_order_relaxed); }
+
 	size_t outputs() { return m_audioOutputs.size(); }
 	size_t inputs() { return m_audioInputs.size(); }
 
@@ -165,6 +351,9 @@ public:
 			}
 
 			m_sr |= SR::TDE(0);
+
+			// Serviced by polling, the interrupt has nothing left to do
+			clearInterrupt(m_vectors.transmitData);
 		}
 	}
 
@@ -217,7 +406,26 @@ public:
 		m_rccr = val;
 	}
 
+protected:
+	template <uint32_t N>
+	dsp56k::TWord readRX() { return readRX(N); }
+
+	template <uint32_t N>
+	void writeTX(dsp56k::TWord val) { writeTX(N, val); }
+
 private:
+	// Fill level of the fullest enabled output
+	size_t outputFill() const {
+		size_t fill = 0;
+		for (size_t i = 0; i < m_audioOutputs.size(); i++) {
+			if (outputEnabled(i)) {
+				fill = std::max(fill, m_audioOutputs[i].fill());
+			}
+		}
+
+		return fill;
+	}
+
 	bool inputEnabled(uint32_t index) const {
 		return RCR::RE(m_rcr).test(index);
 	}
@@ -239,104 +447,85 @@ private:
 	uint32_t m_cyclesSinceWrite = 0;
 	uint32_t m_writtenTX = 0;
 	uint32_t m_lastClock = 0;
+	std::atomic<uint64_t> m_frames{0};
+	Pacer* m_pacer = nullptr;
 
 	SR m_sr;
 	TCR m_tcr;
 	RCR m_rcr;
 	dsp56k::TWord m_rccr, m_cr, m_tccr;
+	Vectors m_vectors;
+};
+
+// ESAI instance N, ESAI at X:$FFFFA0 for 0 and ESAI_1 at Y:$FFFFA0 for 1.
+// ESAI_1 vectors and IPRP field follow those of ESAI at a fixed offset.
+template <size_t N>
+class EnhancedSerialAudioPort : public EnhancedSerialAudioInterface {
+public:
+	static_assert(N < 2, "the DSP56720 has two ESAI instances");
+
+	static constexpr Address Base = N ? 0xFFFFA0_ymem : 0xFFFFA0_xmem;
+	static constexpr dsp56k::TWord VectorOffset = N * 0x40;
+
+	EnhancedSerialAudioPort(ClockGenerationModule& cgm)
+		: EnhancedSerialAudioInterface(cgm, {
+			dsp56k::Vba_ESAI_Transmit_Data + VectorOffset,
+			dsp56k::Vba_ESAI_Transmit_Last_Slot + VectorOffset,
+			N ? DmaRequest_ESAI1_Receive : DmaRequest_ESAI_Receive,
+			N ? DmaRequest_ESAI1_Transmit : DmaRequest_ESAI_Transmit,
+		}) {}
+
+	virtual const char* name() const override { return N ? "esai1" : "esai"; }
+
+	virtual RegisterTable registers() override {
+		return Registers;
+	}
+
+private:
+	static constexpr const char* pick(const char* esai, const char* esai1) {
+		return N ? esai1 : esai;
+	}
+
+	using ESAI = EnhancedSerialAudioInterface;
+
+	static constexpr Register Registers[] = {
+		// ESAI Receive Data Registers (RX0-RX3)
+		reg<&ESAI::readRX<0>, nullptr>(pick("RX0", "RX0_1"), Base + 0x08),
+		reg<&ESAI::readRX<1>, nullptr>(pick("RX1", "RX1_1"), Base + 0x09),
+		reg<&ESAI::readRX<2>, nullptr>(pick("RX2", "RX2_1"), Base + 0x0A),
+		reg<&ESAI::readRX<3>, nullptr>(pick("RX3", "RX3_1"), Base + 0x0B),
 
-	std::vector<Register> m_registers = {
-		// ESAI Receive Data Register 3 (RX0)
-		{"RX0", 0xFFFFA8_xmem,
-		[&](auto inst) { return readRX(0); },
-		[&](auto value) {}},
-
-		// ESAI Receive Data Register 3 (RX1)
-		{"RX1", 0xFFFFA9_xmem,
-		[&](auto inst) { return readRX(1); },
-		[&](auto value) {}},
-
-		// ESAI Receive Data Register 3 (RX2)
-		{"RX2", 0xFFFFAA_xmem,
-		[&](auto inst) { return readRX(2); },
-		[&](auto value) {}},
-
-		// ESAI Receive Data Register 3 (RX3)
-		{"RX3", 0xFFFFAB_xmem,
-		[&](auto inst) { return readRX(3); },
-		[&](auto value) {}},
-
-		// ESAI Transmit Data Register 0 (TX0)
-		{"TX0",
-		0xFFFFA0_xmem,
-		[&](auto inst) { return 0; },
-		[&](auto value) { writeTX(0, value); }},
-
-		// ESAI Transmit Data Register 1 (TX1)
-		{"TX1",
-		0xFFFFA1_xmem,
-		[&](auto inst) { return 0; },
-		[&](auto value) { writeTX(1, value); }},
-
-		// ESAI Transmit Data Register 2 (TX2)
-		{"TX2",
-		0xFFFFA2_xmem,
-		[&](auto inst) { return 0; },
-		[&](auto value) { writeTX(2, value); }},
-
-		// ESAI Transmit Data Register 3 (TX3)
-		{"TX3",
-		0xFFFFA3_xmem,
-		[&](auto inst) { return 0; },
-		[&](auto value) { writeTX(3, value); }},
-
-		// ESAI Transmit Data Register 4 (TX4)
-		{"TX4",
-		0xFFFFA4_xmem,
-		[&](auto inst) { return 0; },
-		[&](auto value) { writeTX(4, value); }},
-
-		// ESAI Transmit Data Register 5 (TX5)
-		{"TX5",
-		0xFFFFA5_xmem,
-		[&](auto inst) { return 0; },
-		[&](auto value) { writeTX(5, value); }},
+		// ESAI Transmit Data Registers (TX0-TX5)
+		reg<nullptr, &ESAI::writeTX<0>>(pick("TX0", "TX0_1"), Base + 0x00),
+		reg<nullptr, &ESAI::writeTX<1>>(pick("TX1", "TX1_1"), Base + 0x01),
+		reg<nullptr, &ESAI::writeTX<2>>(pick("TX2", "TX2_1"), Base + 0x02),
+		reg<nullptr, &ESAI::writeTX<3>>(pick("TX3", "TX3_1"), Base + 0x03),
+		reg<nullptr, &ESAI::writeTX<4>>(pick("TX4", "TX4_1"), Base + 0x04),
+		reg<nullptr, &ESAI::writeTX<5>>(pick("TX5", "TX5_1"), Base + 0x05),
 
 		// ESAI Status Register (SAISR)
-		{"SAISR",
-		0xFFFFB3_xmem,
-		[&](auto inst) { return readStatusRegister(); },
-		[&](auto value) { writestatusRegister(value); }},
+		reg<&ESAI::readStatusRegister, &ESAI::writestatusRegister>(
+			pick("SAISR", "SAISR_1"), Base + 0x13),
 
 		// ESAI Control Register (SAICR)
-		{"SAICR",
-		0xFFFFB4_xmem,
-		[&](auto inst) { return readControlRegister(); },
-		[&](auto value) { writeControlRegister(value); }},
+		reg<&ESAI::readControlRegister, &ESAI::writeControlRegister>(
+			pick("SAICR", "SAICR_1"), Base + 0x14),
 
 		// ESAI Receive Control Register (RCR)
-		{"RCR",
-		0xFFFFB7_xmem,
-		[&](auto inst) { return readReceiveControlRegister(); },
-		[&](auto value) { writeReceiveControlRegister(value); }},
+		reg<&ESAI::readReceiveControlRegister, &ESAI::writeReceiveControlRegister>(
+			pick("RCR", "RCR_1"), Base + 0x17),
 
 		// ESAI Receive Clock Control Register (RCCR)
-		{"RCCR",
-		0xFFFFB8_xmem,
-		[&](auto inst) { return 0; },
-		[&](auto value) { writeReceiveClockControlRegister(value); }},
+		reg<nullptr, &ESAI::writeReceiveClockControlRegister>(
+			pick("RCCR", "RCCR_1"), Base + 0x18),
 
 		// ESAI Transmit Control Register (TCR)
-		{"TCR",
-		0xFFFFB5_xmem,
-		[&](auto inst) { return readTransmitControlRegister(); },
-		[&](auto value) { writeTransmitControlRegister(value); }},
+		reg<&ESAI::readTransmitControlRegister, &ESAI::writeTransmitControlRegister>(
+			pick("TCR", "TCR_1"), Base + 0x15),
 
 		// ESAI Transmit Clock Control Register (TCCR)
-		{"TCCR",
-		0xFFFFB6_xmem,
-		[&](auto inst) { return 0; },
-		[&](auto value) { writeTransmitClockControlRegister(value); }}
+		reg<nullptr, &ESAI::writeTransmitClockControlRegister>(
+			pick("TCCR", "TCCR_1"), Base + 0x16),
 	};
 };
 }
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <functional>
+#include <vector>
+#include <dsp56kEmu/dsp.h>
+
+namespace dsp56720 {
+// Page-granular access guards over X, Y and P. The memory validator tests
+// the page of every access the core reports, one byte load, and only calls
+// the handler for guarded pages, which then looks at exact addresses.
+class MemoryGuard {
+public:
+	static constexpr unsigned pageBits = 8;
+	static constexpr size_t pages = size_t(1) << (24 - pageBits);
+
+	using Handler = std::function<void(dsp56k::EMemArea, dsp56k::TWord address, bool write)>;
+
+	MemoryGuard() {
+		for (auto& area : m_pages) {
+			area.assign(pages, 0);
+		}
+	}
+
+	void setHandler(Handler handler) { m_handler = std::move(handler); }
+
+	// Guards may only change while the core isn't running
+	void clear() {
+		for (auto& area : m_pages) {
+			std::fill(area.begin(), area.end(), 0);
+		}
+	}
+
+	void guard(dsp56k::EMemArea area, dsp56k::TWord first, dsp56k::TWord last) {
+		for (size_t page = first >> pageBits; page <= last >> pageBits && page < pages; page++) {
+			m_pages[area][page] = 1;
+		}
+	}
+
+	void check(dsp56k::EMemArea area, dsp56k::TWord address, bool write) const {
+		if (area < dsp56k::MemArea_COUNT && m_pages[area][(address >> pageBits) & (pages - 1)]) {
+			m_handler(area, address, write);
+		}
+	}
+
+private:
+	std::array<std::vector<uint8_t>, dsp56k::MemArea_COUNT> m_pages;
+	Handler m_handler;
+};
+}
@@ -0,0 +1,116 @@
+#pragma once
+
+#include <atomic>
+#include <dsp56kEmu/dsp.h>
+#include "peripherals.h"
+#include "inspector.h"
+
+namespace dsp56720 {
+// Detects polling loops like `jclr #TDE,x:SAISR,*`. An iteration ends when
+// the core branches back to the loop head. Once two consecutive iterations
+// of at most maxLoop instructions read the same values from I/O registers,
+// write neither I/O registers nor memory and leave the core registers as
+// they found them, every further iteration behaves the same until a
+// peripheral changes what it returns. The caller can then let time pass up
+// to the next peripheral event without executing them, which preserves
+// what the loop does.
+//
+// A branch back to a WAIT or STOP counts as idle right away: the core
+// sleeps there until an interrupt, which only a peripheral event or the
+// host can raise.
+//
+// Loops without I/O reads are rejected on the cheap counters alone, so
+// ordinary code only pays for a PC comparison per instruction.
+class IdleDetector {
+public:
+	static constexpr uint32_t maxLoop = 8;
+
+	static constexpr dsp56k::TWord opWait = 0x000086;
+	static constexpr dsp56k::TWord opStop = 0x000087;
+
+	// Called after every instruction. Returns true while the core spins in
+	// an idle loop.
+	bool step(dsp56k::DSP& dsp, const Peripherals& peripherals) {
+		auto pc = dsp.getPC().toWord();
+		bool backward = pc <= m_lastPC;
+		m_lastPC = pc;
+
+		if (++m_length > maxLoop) {
+			m_head = noHead;
+		}
+
+		if (!backward) {
+			return false;
+		}
+
+		auto op = dsp.memory().get(dsp56k::MemArea_P, pc);
+		if (op == opWait || op == opStop) {
+			m_head = noHead;
+			return true;
+		}
+
+		auto& io = peripherals.ioActivity();
+		if (pc != m_head) {
+			start(pc, io);
+			return false;
+		}
+
+		auto reads = io.reads - m_io.reads;
+		auto signature = io.signature - m_io.signature;
+		bool quiet = reads && io.writes == m_io.writes && io.stores == m_io.stores;
+		m_io = io;
+		m_length = 0;
+
+		if (!quiet) {
+			m_captured = false;
+			return false;
+		}
+
+		CoreRegisters registers;
+		readRegisters(dsp, registers);
+
+		bool idle = m_captured && registers == m_registers
+			&& reads == m_reads && signature == m_signature;
+
+		m_registers = registers;
+		m_reads = reads;
+		m_signature = signature;
+		m_captured = true;
+		return idle;
+	}
+
+	// Account cycles fast-forwarded past
+	void skipped(uint32_t cycles) {
+		count(m_skippedCycles, cycles);
+		count(m_skips);
+	}
+
+	// Safe to call from any thread
+	uint64_t skippedCycles() const { return m_skippedCycles.load(std::memory_order_relaxed); }
+	uint64_t skips() const { return m_skips.load(std::memory_order_relaxed); }
+
+private:
+	static constexpr dsp56k::TWord noHead = ~0u;
+
+	void start(dsp56k::TWord head, const Peripherals::IoActivity& io) {
+		m_head = head;
+		m_io = io;
+		m_length = 0;
+		m_captured = false;
+	}
+
+	dsp56k::TWord m_lastPC = 0;
+	dsp56k::TWord m_head = noHead;
+	uint32_t m_length = 0;
+
+	// State at the end of the last iteration
+	Peripherals::IoActivity m_io;
+	CoreRegisters m_registers{};
+	uint64_t m_reads = 0;
+	uint64_t m_signature = 0;
+	bool m_captured = false;
+
+	std::atomic<uint64_t> m_skippedCycles{0};
+	std::atomic<uint64_t> m_skips{0};
+};
+}
@@ -0,0 +1,151 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <mutex>
+#include <dsp56kEmu/dsp.h>
+#include "emc.h"
+
+namespace dsp56720 {
+struct CoreRegisters {
+	dsp56k::TWord pc, sr, omr, sp, la, lc, vba;
+	uint64_t a, b, x, y;
+	dsp56k::TWord r[8], n[8], m[8];
+};
+
+inline void readRegisters(dsp56k::DSP& dsp, CoreRegisters& registers) {
+	auto& regs = dsp.regs();
+
+	registers.pc = dsp.getPC().toWord();
+	registers.sr = regs.sr.var;
+	registers.omr = regs.omr.var;
+	registers.sp = regs.sp.var;
+	registers.la = regs.la.var;
+	registers.lc = regs.lc.var;
+	registers.vba = regs.vba.var;
+	registers.a = regs.a.var;
+	registers.b = regs.b.var;
+	registers.x = regs.x.var;
+	registers.y = regs.y.var;
+
+	for (size_t i = 0; i < 8; i++) {
+		registers.r[i] = regs.r[i].var;
+		registers.n[i] = regs.n[i].var;
+		registers.m[i] = regs.m[i].var;
+	}
+}
+
+inline bool operator==(const CoreRegisters& a, const CoreRegisters& b) {
+	for (size_t i = 0; i < 8; i++) {
+		if (a.r[i] != b.r[i] || a.n[i] != b.n[i] || a.m[i] != b.m[i]) {
+			return false;
+		}
+	}
+
+	return a.pc == b.pc && a.sr == b.sr && a.omr == b.omr && a.sp == b.sp
+		&& a.la == b.la && a.lc == b.lc && a.vba == b.vba
+		&& a.a == b.a && a.b == b.b && a.x == b.x && a.y == b.y;
+}
+
+// Lock-free snapshot of the core registers. Readers ask the emulation
+// thread for a fresh copy, which it publishes through a sequence lock the
+// next time it polls. The emulation thread never waits on a reader.
+class CoreSnapshot {
+public:
+	// Called by the emulation thread between instructions
+	void poll(dsp56k::DSP& dsp) {
+		if (!m_requested.load(std::memory_order_relaxed)) {
+			return;
+		}
+
+		capture(dsp);
+		m_requested.store(false, std::memory_order_relaxed);
+		m_published.notify_all();
+	}
+
+	void capture(dsp56k::DSP& dsp) {
+		m_sequence.fetch_add(1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+
+		readRegisters(dsp, m_registers);
+
+		std::atomic_thread_fence(std::memory_order_release);
+		m_sequence.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	// Request a fresh snapshot and wait briefly for it. If the core isn't
+	// running (e.g. stopped in the debugger) the last published one is used.
+	CoreRegisters read() {
+		auto sequence = m_sequence.load(std::memory_order_acquire);
+
+		m_requested.store(true, std::memory_order_relaxed);
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_published.wait_for(lock, std::chrono::milliseconds(20), [&]() {
+				return m_sequence.load(std::memory_order_acquire) != sequence;
+			});
+		}
+
+		return last();
+	}
+
+	CoreRegisters last() const {
+		CoreRegisters copy;
+		uint32_t before, after;
+
+		do {
+			before = m_sequence.load(std::memory_order_acquire);
+			copy = m_registers;
+			std::atomic_thread_fence(std::memory_order_acquire);
+			after = m_sequence.load(std::memory_order_relaxed);
+		} while ((before & 1) || before != after);
+
+		return copy;
+	}
+
+private:
+	std::atomic<bool> m_requested{false};
+	std::atomic<uint32_t> m_sequence{0};
+	CoreRegisters m_registers{};
+
+	std::mutex m_mutex;
+	std::condition_variable m_published;
+};
+
+// Copy out of DSP memory. Memory has no read side effects, so ranges are
+// copied straight from the image, X and Y from P at and above the bridge
+// as Memory::setExternalMemory() maps them. Only the I/O space past the
+// image goes through Memory::get() word by word. Words are read without
+// stopping the core, so a dump of a running core is consistent per word
+// only.
+inline size_t readMemory(const dsp56k::Memory& memory, const MemoryImage& image,
+		dsp56k::TWord bridge, dsp56k::EMemArea area, dsp56k::TWord address,
+		uint32_t* words, size_t count) {
+	auto copy = [&](dsp56k::EMemArea from, dsp56k::TWord end) {
+		if (address >= end || !count) {
+			return;
+		}
+
+		auto n = std::min<size_t>(count, end - address);
+		std::memcpy(words, image.area(from) + address, n * sizeof(uint32_t));
+		address += n;
+		words += n;
+		count -= n;
+	};
+
+	auto total = count;
+	if (area != dsp56k::MemArea_P) {
+		copy(area, std::min(bridge, image.words()));
+	}
+
+	copy(dsp56k::MemArea_P, image.words());
+
+	for (size_t i = 0; i < count; i++) {
+		words[i] = memory.get(area, address + i);
+	}
+
+	return total;
+}
+}
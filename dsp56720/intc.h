@@ -0,0 +1,224 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <dsp56kEmu/dsp.h>
+#include <dsp56kEmu/interrupts.h>
+#include "peripherals.h"
+#include "asrc.h"
+#include "esai.h"
+#include "shi.h"
+#include "spdif.h"
+#include "tec.h"
+
+namespace dsp56720 {
+// Interrupt priority registers and arbitration. Peripherals raise vectors
+// into pending bits instead of injecting them into the core; raising a
+// vector that is already pending is coalesced. Each exec() hands the core
+// the highest priority pending vector that IPRC/IPRP enable and the SR
+// interrupt mask admits. Masked vectors stay pending until admitted.
+class InterruptController : public Peripheral {
+public:
+	enum PriorityRegister : uint8_t {
+		IPRC,
+		IPRP,
+	};
+
+	// Interrupt priority level field of a vector, 2 bits at shift. Field
+	// values 1-3 are IPL 0-2, 0 disables the vector.
+	struct Source {
+		dsp56k::TWord vector;
+		PriorityRegister reg;
+		uint8_t shift;
+	};
+
+	static constexpr Source Sources[] = {
+		{0x10, IPRC, 0},  // IRQA
+		{0x12, IPRC, 3},  // IRQB
+		{0x14, IPRC, 6},  // IRQC
+		{0x16, IPRC, 9},  // IRQD
+		{DmaController::Vba_DMA_Channel0, IPRC, 12}, // DMA channels 0-5
+		{DmaController::Vba_DMA_Channel0 + 2, IPRC, 14},
+		{DmaController::Vba_DMA_Channel0 + 4, IPRC, 16},
+		{DmaController::Vba_DMA_Channel0 + 6, IPRC, 18},
+		{DmaController::Vba_DMA_Channel0 + 8, IPRC, 20},
+		{DmaController::Vba_DMA_Channel0 + 10, IPRC, 22},
+		{dsp56k::Vba_ESAI_Receive_Data + EnhancedSerialAudioPort<0>::VectorOffset, IPRP, 0},
+		{dsp56k::Vba_ESAI_Transmit_Data_with_Exception_Status + EnhancedSerialAudioPort<0>::VectorOffset, IPRP, 0},
+		{dsp56k::Vba_ESAI_Transmit_Data + EnhancedSerialAudioPort<0>::VectorOffset, IPRP, 0},
+		{dsp56k::Vba_ESAI_Transmit_Last_Slot + EnhancedSerialAudioPort<0>::VectorOffset, IPRP, 0},
+		{dsp56k::Vba_SHI_Transmit_Data + SerialHostPort<0>::VectorOffset, IPRP, 2},
+		{dsp56k::Vba_SHI_Receive_FIFO_Not_Empty + SerialHostPort<0>::VectorOffset, IPRP, 2},
+		{dsp56k::Vba_SHI_Receive_FIFO_Full + SerialHostPort<0>::VectorOffset, IPRP, 2},
+		{dsp56k::Vba_ESAI_Receive_Data + EnhancedSerialAudioPort<1>::VectorOffset, IPRP, 4},
+		{dsp56k::Vba_ESAI_Transmit_Data_with_Exception_Status + EnhancedSerialAudioPort<1>::VectorOffset, IPRP, 4},
+		{dsp56k::Vba_ESAI_Transmit_Data + EnhancedSerialAudioPort<1>::VectorOffset, IPRP, 4},
+		{dsp56k::Vba_ESAI_Transmit_Last_Slot + EnhancedSerialAudioPort<1>::VectorOffset, IPRP, 4},
+		{dsp56k::Vba_SHI_Transmit_Data + SerialHostPort<1>::VectorOffset, IPRP, 6},
+		{dsp56k::Vba_SHI_Receive_FIFO_Not_Empty + SerialHostPort<1>::VectorOffset, IPRP, 6},
+		{dsp56k::Vba_SHI_Receive_FIFO_Full + SerialHostPort<1>::VectorOffset, IPRP, 6},
+		{AsyncSampleRateConverter::Vba_ASRC_Input, IPRP, 12},
+		{AsyncSampleRateConverter::Vba_ASRC_Output, IPRP, 12},
+		{AsyncSampleRateConverter::Vba_ASRC_Overload, IPRP, 12},
+		{SpdifTransceiver::Vba_SPDIF_Receive, IPRP, 10},
+		{SpdifTransceiver::Vba_SPDIF_Transmit, IPRP, 10},
+		{SpdifTransceiver::Vba_SPDIF_Status, IPRP, 10},
+		{TripleTimer::Vba_Timer0_Compare, IPRP, 8}, // Timers 0-2, 4 words apart
+		{TripleTimer::Vba_Timer0_Overflow, IPRP, 8},
+		{TripleTimer::Vba_Timer0_Compare + 4, IPRP, 8},
+		{TripleTimer::Vba_Timer0_Overflow + 4, IPRP, 8},
+		{TripleTimer::Vba_Timer0_Compare + 8, IPRP, 8},
+		{TripleTimer::Vba_Timer0_Overflow + 8, IPRP, 8},
+	};
+
+	// Vectors without a priority field, like traps, are never masked
+	static constexpr int NonMaskable = 3;
+
+	InterruptController() {
+		updateLevels();
+	}
+
+	virtual const char* name() const override { return "intc"; }
+	virtual void reset() override {}
+	virtual void terminate() override {}
+	virtual RegisterTable registers() override { return Registers; }
+
+	virtual void exec() override {
+		// The core has executed an instruction since the last injection,
+		// which serviced it
+		m_injected = false;
+
+		if (!m_pendingCount) {
+			return;
+		}
+
+		auto best = next();
+		if (best < 0) {
+			return;
+		}
+
+		setPending(best, false);
+
+		bus().countInterrupt(best * 2);
+		dsp().injectInterrupt(best * 2);
+		m_injected = true;
+	}
+
+	// Masked vectors don't hold up fast-forwarding, the core can't see
+	// them until it changes SR. A vector injected this cycle does: the
+	// core in WAIT hasn't run its handler yet.
+	virtual uint32_t idleCycles() override {
+		return m_injected || (m_pendingCount && next() >= 0) ? 0 : unbounded;
+	}
+
+	// A vector raised while its IPR field disables it stays pending, like
+	// a peripheral's request line, and is handed over once enabled
+	void raise(dsp56k::TWord vector) {
+		auto slot = slotOf(vector);
+		if (pending(slot)) {
+			count(m_coalesced);
+			return;
+		}
+
+		setPending(slot, true);
+	}
+
+	// Withdraw a vector that hasn't been handed to the core yet
+	void clear(dsp56k::TWord vector) {
+		setPending(slotOf(vector), false);
+	}
+
+	// Priority level of a vector, -1 if disabled
+	int level(dsp56k::TWord vector) const { return m_levels[slotOf(vector)]; }
+
+	// Raises merged into an already pending vector, safe to call from any
+	// thread
+	uint64_t coalesced() const { return m_coalesced.load(std::memory_order_relaxed); }
+
+	dsp56k::TWord readIPRC() { return m_iprc; }
+	void writeIPRC(dsp56k::TWord value) {
+		m_iprc = value;
+		updateLevels();
+	}
+
+	dsp56k::TWord readIPRP() { return m_iprp; }
+	void writeIPRP(dsp56k::TWord value) {
+		m_iprp = value;
+		updateLevels();
+	}
+
+private:
+	// One slot per vector address, which are always even
+	static constexpr size_t slots = 128;
+	using Slots = std::array<uint64_t, slots / 64>;
+
+	static size_t slotOf(dsp56k::TWord vector) { return (vector / 2) % slots; }
+
+	bool pending(size_t slot) const { return m_pending[slot / 64] >> (slot % 64) & 1; }
+
+	void setPending(size_t slot, bool pending) {
+		if (this->pending(slot) == pending) {
+			return;
+		}
+
+		m_pending[slot / 64] ^= uint64_t(1) << (slot % 64);
+		m_pendingCount += pending ? 1 : -1;
+	}
+
+	// Rebuilds the levels from IPRC/IPRP, so arbitration never searches
+	// Sources
+	void updateLevels() {
+		m_levels.fill(NonMaskable);
+		for (auto& source : Sources) {
+			auto field = (source.reg == IPRC ? m_iprc : m_iprp) >> source.shift & 3;
+			m_levels[slotOf(source.vector)] = int8_t(int(field) - 1);
+		}
+
+		m_enabled = {};
+		for (size_t slot = 0; slot < slots; slot++) {
+			if (m_levels[slot] >= 0) {
+				m_enabled[m_levels[slot]][slot / 64] |= uint64_t(1) << (slot % 64);
+			}
+		}
+	}
+
+	// Slot of the pending vector to hand to the core next, -1 if the SR
+	// mask admits none. Ties go to the lower vector. Disabled vectors are
+	// in no level's slots, so they are never looked at.
+	int next() {
+		auto mask = int(dsp().getSR().toWord() >> 8 & 3);
+
+		for (int level = NonMaskable; level >= mask; level--) {
+			for (size_t word = 0; word < m_pending.size(); word++) {
+				if (auto bits = m_pending[word] & m_enabled[level][word]) {
+					return int(word * 64 + __builtin_ctzll(bits));
+				}
+			}
+		}
+
+		return -1;
+	}
+
+	dsp56k::TWord m_iprc = 0;
+	dsp56k::TWord m_iprp = 0;
+
+	// Level per slot, -1 if disabled, and the enabled slots of each level
+	std::array<int8_t, slots> m_levels;
+	std::array<Slots, NonMaskable + 1> m_enabled;
+
+	Slots m_pending{};
+	size_t m_pendingCount = 0;
+	bool m_injected = false;
+	std::atomic<uint64_t> m_coalesced{0};
+
+	using INTC = InterruptController;
+
+	static constexpr Register Registers[] = {
+		// Interrupt Priority Register Core
+		reg<&INTC::readIPRC, &INTC::writeIPRC>("IPRC", 0xFFFFFF_xmem),
+
+		// Interrupt Priority Register Peripherals
+		reg<&INTC::readIPRP, &INTC::writeIPRP>("IPRP", 0xFFFFFE_xmem),
+	};
+};
+}
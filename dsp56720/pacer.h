@@ -0,0 +1,134 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <sstream>
+#include <string>
+
+namespace dsp56720 {
+// Paces a chip so that emulated audio frames track the host's monotonic
+// clock. In consumer mode a PI controller additionally trims the rate to
+// hold the output queues at a target fill level, following the consumer's
+// clock with minimal buffering.
+//
+// The pacer never sleeps, the thread it runs on is a shared scheduler
+// worker. Once the emulation gets ahead it reports waiting() and the chip
+// hands the wait to the scheduler, resuming at resumeTime().
+class Pacer {
+public:
+	enum class Mode {
+		HostClock,
+		Consumer,
+	};
+
+	// Frames between pacing decisions, about 0.7ms at 48kHz
+	static constexpr uint32_t batch = 32;
+
+	Pacer(Mode mode, double sampleRate, size_t targetFill)
+		: m_mode(mode), m_sampleRate(sampleRate), m_targetFill(targetFill) {}
+
+	using Clock = std::chrono::steady_clock;
+
+	// Called by the emulation thread once per frame with the current output
+	// queue fill level
+	void frame(size_t fill) {
+		if (++m_frames < batch) {
+			return;
+		}
+
+		m_frames = 0;
+		pace(fill);
+	}
+
+	// Cheap enough to poll after every instruction
+	bool waiting() const { return m_waiting; }
+	Clock::time_point resumeTime() const { return m_deadline; }
+
+	// Ends the wait once its time has come. Returns whether the emulation
+	// may run.
+	bool resume(Clock::time_point now) {
+		if (m_waiting && now >= m_deadline) {
+			m_waiting = false;
+		}
+
+		return !m_waiting;
+	}
+
+	std::string report() const {
+		std::ostringstream out;
+		out << "pacer_mode " << (m_mode == Mode::HostClock ? "host" : "consumer") << "\n"
+			<< "pacer_correction " << m_correction.load(std::memory_order_relaxed) << "\n"
+			<< "pacer_resyncs " << m_resyncs.load(std::memory_order_relaxed) << "\n";
+		return out.str();
+	}
+
+private:
+	using Seconds = std::chrono::duration<double>;
+
+	// Proportional and integral gains on the normalized fill error
+	static constexpr double kp = 0.02;
+	static constexpr double ki = 0.005;
+	static constexpr double maxCorrection = 0.05;
+	// Falling further behind than this restarts the timeline
+	static constexpr double maxLag = 0.05;
+
+	void pace(size_t fill) {
+		auto now = Clock::now();
+		if (!m_started) {
+			m_started = true;
+			m_origin = now;
+			m_emulated = 0;
+			return;
+		}
+
+		auto rate = m_sampleRate;
+		if (m_mode == Mode::Consumer && m_targetFill) {
+			// Positive when the consumer falls behind and samples pile up
+			double error = (double(fill) - m_targetFill) / m_targetFill;
+			double period = batch / m_sampleRate;
+
+			m_integral = std::clamp(m_integral + error * period,
+					-maxCorrection / ki, maxCorrection / ki);
+			auto correction = std::clamp(kp * error + ki * m_integral,
+					-maxCorrection, maxCorrection);
+
+			m_correction.store(correction, std::memory_order_relaxed);
+			rate *= 1 - correction;
+		}
+
+		m_emulated += batch / rate;
+		auto deadline = m_origin + std::chrono::duration_cast<Clock::duration>(Seconds(m_emulated));
+		auto ahead = Seconds(deadline - now).count();
+
+		if (ahead < -maxLag) {
+			m_origin = now;
+			m_emulated = 0;
+			m_resyncs.store(m_resyncs.load(std::memory_order_relaxed) + 1,
+					std::memory_order_relaxed);
+			return;
+		}
+
+		if (ahead > 0) {
+			m_deadline = deadline;
+			m_waiting = true;
+		}
+	}
+
+	Mode m_mode;
+	double m_sampleRate;
+	size_t m_targetFill;
+
+	// Emulation thread only
+	uint32_t m_frames = 0;
+	bool m_started = false;
+	Clock::time_point m_origin;
+	double m_emulated = 0;
+	double m_integral = 0;
+	bool m_waiting = false;
+	Clock::time_point m_deadline;
+
+	std::atomic<double> m_correction{0};
+	std::atomic<uint64_t> m_resyncs{0};
+};
+}
@@ -0,0 +1,156 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <sstream>
+#include <dsp56kEmu/dsp.h>
+#include "peripherals.h"
+#include "esai.h"
+#include "cgm.h"
+
+namespace dsp56720 {
+// Always-on performance counters. The emulation thread folds the core's
+// instruction counter into a 64-bit total every few thousand instructions;
+// everything else is read from single-writer counters kept by the
+// peripherals, so reporting never stalls the core.
+class PerformanceCounters {
+public:
+	static constexpr uint32_t batch = 4096;
+
+	PerformanceCounters(dsp56k::DSP& dsp, Peripherals& peripherals,
+			EnhancedSerialAudioInterface& esai, ClockGenerationModule& cgm)
+		: m_dsp(dsp), m_peripherals(peripherals), m_esai(esai), m_cgm(cgm),
+		m_start(Clock::now()), m_interval{m_start, 0, 0} {}
+
+	// Called by the emulation thread after every instruction
+	void tick() {
+		if (++m_ticks < batch) {
+			return;
+		}
+
+		m_ticks = 0;
+		publish();
+	}
+
+	void publish() {
+		auto counter = m_dsp.getInstructionCounter();
+		count(m_instructions, dsp56k::delta(counter, m_lastCounter));
+		m_lastCounter = counter;
+	}
+
+	uint64_t instructions() const { return m_instructions.load(std::memory_order_relaxed); }
+
+	// Full report for the VFS
+	std::string report() {
+		auto now = Clock::now();
+		auto seconds = std::chrono::duration<double>(now - m_start).count();
+		auto instructions = this->instructions();
+		auto frames = m_esai.frames();
+
+		std::ostringstream out;
+		out << "wall_seconds " << seconds << "\n"
+			<< "instructions " << instructions << "\n"
+			<< "mips " << instructions / seconds / 1e6 << "\n"
+			<< "esai_frames " << frames << "\n"
+			<< "realtime_factor " << frames / seconds / m_cgm.sampleRate() << "\n";
+
+		for (size_t i = 0; i < m_esai.outputs(); i++) {
+			auto marks = m_esai.output(i).watermarks();
+			out << "esai_output" << i << " fill " << m_esai.output(i).fill()
+				<< " capacity " << m_esai.output(i).capacity()
+				<< " latency_us " << latency(m_esai.output(i).fill())
+				<< " low " << marks.low << " high " << marks.high
+				<< " overruns " << m_esai.output(i).overruns() << "\n";
+		}
+
+		for (size_t i = 0; i < m_esai.inputs(); i++) {
+			auto marks = m_esai.input(i).watermarks();
+			out << "esai_input" << i << " fill " << m_esai.input(i).fill()
+				<< " capacity " << m_esai.input(i).capacity()
+				<< " latency_us " << latency(m_esai.input(i).fill())
+				<< " low " << marks.low << " high " << marks.high
+				<< " underruns " << m_esai.input(i).underruns() << "\n";
+		}
+
+		for (dsp56k::TWord vector = 0; vector < m_peripherals.vectors(); vector++) {
+			if (auto n = m_peripherals.interrupts(vector)) {
+				out << "interrupt $" << std::hex << vector << std::dec << " " << n << "\n";
+			}
+		}
+
+		out << "interrupts_coalesced " << m_peripherals.coalescedInterrupts() << "\n";
+
+		for (auto& stats : m_peripherals.registerStats()) {
+			if (stats.reads || stats.writes) {
+				out << "register " << stats.peripheral << "/" << stats.reg->name
+					<< " reads " << stats.reads << " writes " << stats.writes << "\n";
+			}
+		}
+
+		return out.str();
+	}
+
+	// One line covering the time since the previous call, resets the queue
+	// watermarks
+	std::string summary() {
+		std::unique_lock<std::mutex> lock(m_mutex);
+
+		Interval now{Clock::now(), instructions(), m_esai.frames()};
+		auto seconds = std::chrono::duration<double>(now.time - m_interval.time).count();
+		auto mips = (now.instructions - m_interval.instructions) / seconds / 1e6;
+		auto realtime = (now.frames - m_interval.frames) / seconds / m_cgm.sampleRate();
+		m_interval = now;
+
+		size_t outputLow = SIZE_MAX, inputHigh = 0;
+		uint64_t overruns = 0, underruns = 0;
+		for (size_t i = 0; i < m_esai.outputs(); i++) {
+			outputLow = std::min(outputLow, m_esai.output(i).watermarks().low);
+			overruns += m_esai.output(i).overruns();
+			m_esai.output(i).resetWatermarks();
+		}
+
+		for (size_t i = 0; i < m_esai.inputs(); i++) {
+			inputHigh = std::max(inputHigh, m_esai.input(i).watermarks().high);
+			underruns += m_esai.input(i).underruns();
+			m_esai.input(i).resetWatermarks();
+		}
+
+		std::ostringstream out;
+		out.precision(3);
+		out << "perf: " << std::fixed << mips << " MIPS, realtime x" << realtime
+			<< ", ESAI output low " << outputLow << ", input high " << inputHigh
+			<< ", overruns " << overruns << ", underruns " << underruns;
+		return out.str();
+	}
+
+private:
+	// Time in microseconds for the given number of queued samples to drain
+	uint64_t latency(size_t samples) const {
+		return samples * 1000000ull / m_cgm.sampleRate();
+	}
+
+	using Clock = std::chrono::steady_clock;
+
+	struct Interval {
+		Clock::time_point time;
+		uint64_t instructions;
+		uint64_t frames;
+	};
+
+	dsp56k::DSP& m_dsp;
+	Peripherals& m_peripherals;
+	EnhancedSerialAudioInterface& m_esai;
+	ClockGenerationModule& m_cgm;
+
+	// Emulation thread only
+	uint32_t m_ticks = 0;
+	uint32_t m_lastCounter = 0;
+
+	std::atomic<uint64_t> m_instructions{0};
+	Clock::time_point m_start;
+
+	std::mutex m_mutex;
+	Interval m_interval;
+};
+}
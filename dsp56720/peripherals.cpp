@@ -1,4 +1,7 @@
 #include "peripherals.h"
+
+#include <algorithm>
+#include "intc.h"
 #include "dsp56kEmu/aar.h"
 #include "dsp56kEmu/esai.h"
 
@@ -13,35 +16,32 @@ void Peripherals::add(Peripheral& peripheral) {
 	m_peripherals.push_back(peripheral);
 
 	for (auto& reg : peripheral.registers()) {
-		switch (reg.address.area) {
-		case dsp56k::MemArea_X:
-			m_x.emplace(reg.address.value, reg);
-			break;
-		case dsp56k::MemArea_Y:
-			m_y.emplace(reg.address.value, reg);
-			break;
+		auto slot = findSlot(reg.address.area, reg.address.value);
+		if (!slot) {
+			LOG("Periph register " << reg.name << " at $" << HEX(reg.address.value)
+				<< " is outside of the I/O space");
+			continue;
 		}
+
+		slot->reg = &reg;
+		slot->peripheral = &peripheral;
 	}
 }
 
-Register *findRegisterFrom(std::unordered_map<dsp56k::TWord, Register>& m, dsp56k::TWord addr) {
-	auto it = m.find(addr);
-	if (it != m.end()) {
-		return &it->second;
+Peripherals::Slot* Peripherals::findSlot(dsp56k::EMemArea area, dsp56k::TWord addr) {
+	auto index = addr - ioFirst;
+	if (index >= ioSize) {
+		return nullptr;
 	}
 
-	return nullptr;
-}
-
-Register* Peripherals::findRegister(dsp56k::EMemArea area, dsp56k::TWord addr) {
 	switch (area) {
 		case dsp56k::MemArea_X:
-			return findRegisterFrom(m_x, addr);
+			return &m_x[index];
 		case dsp56k::MemArea_Y:
-			return findRegisterFrom(m_y, addr);
+			return &m_y[index];
+		default:
+			return nullptr;
 	}
-
-	return nullptr;
 }
 
 size_t bank(dsp56k::EMemArea area) {
@@ -68,14 +68,30 @@ const char *areaName(dsp56k::EMemArea area) {
 	}
 }
 
+// Hash of an I/O read, summed into IoActivity::signature
+static uint64_t readSignature(dsp56k::EMemArea area, dsp56k::TWord addr, dsp56k::TWord value) {
+	return (uint64_t(area) << 56 | uint64_t(addr) << 32 | value) * 0x9e3779b97f4a7c15ull;
+}
+
 dsp56k::TWord Peripherals::read(dsp56k::EMemArea area, dsp56k::TWord addr, dsp56k::Instruction inst) {
-	auto reg = findRegister(area, addr);
-	if (reg) {
-		return reg->read(inst);
+	auto slot = findSlot(area, addr);
+	++m_io.reads;
+
+	if (slot && slot->reg) {
+		auto value = slot->reg->read(*slot->peripheral, inst);
+		m_io.signature += readSignature(area, addr, value);
+		slot->value.store(value, std::memory_order_relaxed);
+		count(slot->reads);
+
+		if (slot->watched) {
+			m_watchHandler(Address{area, addr}, value, false);
+		}
+
+		return value;
 	}
 
 	auto offset = addr - dsp56k::XIO_Reserved_High_First;
-	auto index = offset * bank(area);
+	auto index = offset + size * bank(area);
 
 	auto pc = getDSP().getPC().toWord();
 	if (index >= m_mem.size()) {
@@ -86,22 +102,35 @@ dsp56k::TWord Peripherals::read(dsp56k::EMemArea area, dsp56k::TWord addr, dsp56
 	}
 
 	auto& value = m_mem[index];
+	m_io.signature += readSignature(area, addr, value);
 	LOG("Periph " << areaName(area) << " read $" << HEX(addr)
 			<< ": returning 0x" <<  HEX(value)
 			<< " at " << HEX(pc));
 
+	if (slot && slot->watched) {
+		m_watchHandler(Address{area, addr}, value, false);
+	}
+
 	return value;
 }
 
 void Peripherals::write(dsp56k::EMemArea area, dsp56k::TWord addr, dsp56k::TWord val) {
-	auto reg = findRegister(area, addr);
-	if (reg) {
-		reg->write(val);
+	auto slot = findSlot(area, addr);
+	++m_io.writes;
+
+	if (slot && slot->watched) {
+		m_watchHandler(Address{area, addr}, val, true);
+	}
+
+	if (slot && slot->reg) {
+		slot->value.store(val, std::memory_order_relaxed);
+		count(slot->writes);
+		slot->reg->write(*slot->peripheral, val);
 		return;
 	}
 
 	auto offset = addr - dsp56k::XIO_Reserved_High_First;
-	auto index = offset * bank(area);
+	auto index = offset + size * bank(area);
 
 	auto pc = getDSP().getPC().toWord();
 	if (index >= m_mem.size()) {
@@ -121,9 +150,38 @@ void Peripherals::exec() {
 	}
 }
 
+uint32_t Peripherals::idleCycles() {
+	uint32_t cycles = Peripheral::unbounded;
+	for (auto& peripheral : m_peripherals) {
+		cycles = std::min(cycles, peripheral.get().idleCycles());
+	}
+
+	return cycles;
+}
+
+void Peripherals::raiseInterrupt(dsp56k::TWord vector) {
+	if (m_intc) {
+		m_intc->raise(vector);
+		return;
+	}
+
+	countInterrupt(vector);
+	getDSP().injectInterrupt(vector);
+}
+
+void Peripherals::clearInterrupt(dsp56k::TWord vector) {
+	if (m_intc) {
+		m_intc->clear(vector);
+	}
+}
+
+uint64_t Peripherals::coalescedInterrupts() const {
+	return m_intc ? m_intc->coalesced() : 0;
+}
+
 void Peripherals::reset() {
 	for (auto& peripheral : m_peripherals) {
-		peripheral.get().connect(getDSP());
+		peripheral.get().connect(getDSP(), *this);
 		peripheral.get().reset();
 	}
 }
@@ -134,15 +192,58 @@ void Peripherals::terminate() {
 	}
 }
 
-void Peripherals::setSymbols(dsp56k::Disassembler& disasm) {
-	for (auto& pair : m_x) {
-		auto& reg = pair.second;
-		disasm.addSymbol(dsp56k::Disassembler::MemX, reg.address.value, reg.name);
+dsp56k::TWord Peripherals::snapshot(Address address) {
+	auto slot = findSlot(address.area, address.value);
+	if (!slot) {
+		return 0;
+	}
+
+	return slot->value.load(std::memory_order_relaxed);
+}
+
+std::vector<Peripherals::RegisterStats> Peripherals::registerStats() {
+	std::vector<RegisterStats> stats;
+
+	for (auto& peripheral : m_peripherals) {
+		for (auto& reg : peripheral.get().registers()) {
+			auto slot = findSlot(reg.address.area, reg.address.value);
+			if (!slot) {
+				continue;
+			}
+
+			stats.push_back({peripheral.get().name(), &reg,
+				slot->reads.load(std::memory_order_relaxed),
+				slot->writes.load(std::memory_order_relaxed)});
+		}
 	}
 
-	for (auto& pair : m_y) {
-		auto& reg = pair.second;
-		disasm.addSymbol(dsp56k::Disassembler::MemY, reg.address.value, reg.name);
+	return stats;
+}
+
+bool Peripherals::watch(Address address, bool enable) {
+	auto slot = findSlot(address.area, address.value);
+	if (!slot) {
+		return false;
+	}
+
+	slot->watched = enable;
+	return true;
+}
+
+void Peripherals::setSymbols(dsp56k::Disassembler& disasm) {
+	for (auto& peripheral : m_peripherals) {
+		for (auto& reg : peripheral.get().registers()) {
+			switch (reg.address.area) {
+			case dsp56k::MemArea_X:
+				disasm.addSymbol(dsp56k::Disassembler::MemX, reg.address.value, reg.name);
+				break;
+			case dsp56k::MemArea_Y:
+				disasm.addSymbol(dsp56k::Disassembler::MemY, reg.address.value, reg.name);
+				break;
+			default:
+				break;
+			}
+		}
 	}
 }
 }
@@ -1,5 +1,8 @@
 #pragma once
 
+#include <atomic>
+#include <cstdint>
+#include <type_traits>
 #include <dsp56kEmu/dsp.h>
 
 namespace dsp56720 {
@@ -16,53 +19,144 @@ constexpr Address operator"" _ymem (unsigned long long address) {
     return Address{dsp56k::MemArea_Y, dsp56k::TWord(address)};
 }
 
+constexpr Address operator+(Address address, dsp56k::TWord offset) {
+	return Address{address.area, address.value + offset};
+}
+
+class Peripheral;
+class Peripherals;
+class InterruptController;
+
+// Compile-time register description. Handlers are plain function pointers
+// to thunks that forward to a member function of the owning peripheral, so
+// tables can be constexpr and need no allocation.
 struct Register {
-	using Read = std::function<dsp56k::TWord(dsp56k::Instruction)>;
-	using Write = std::function<void(dsp56k::TWord)>;
+	using Read = dsp56k::TWord (*)(Peripheral&, dsp56k::Instruction);
+	using Write = void (*)(Peripheral&, dsp56k::TWord);
 
-	std::string name;
+	const char* name;
 	Address address;
 	Read read;
 	Write write;
 };
 
+// View of a peripheral's static register table
+class RegisterTable {
+public:
+	template <size_t N>
+	constexpr RegisterTable(const Register (&registers)[N])
+		: m_begin(registers), m_end(registers + N) {}
+
+	constexpr const Register* begin() const { return m_begin; }
+	constexpr const Register* end() const { return m_end; }
+	constexpr size_t size() const { return m_end - m_begin; }
+
+private:
+	const Register* m_begin;
+	const Register* m_end;
+};
+
+namespace detail {
+template <typename F>
+struct MemberOf;
+
+template <typename T, typename R, typename... Args>
+struct MemberOf<R (T::*)(Args...)> { using type = T; };
+
+template <auto Fn>
+dsp56k::TWord readRegister(Peripheral& peripheral, dsp56k::Instruction inst) {
+	if constexpr (std::is_null_pointer_v<decltype(Fn)>) {
+		return 0;
+	} else {
+		using T = typename MemberOf<decltype(Fn)>::type;
+		auto& self = static_cast<T&>(peripheral);
+
+		if constexpr (std::is_invocable_v<decltype(Fn), T&, dsp56k::Instruction>) {
+			return (self.*Fn)(inst);
+		} else {
+			return (self.*Fn)();
+		}
+	}
+}
+
+template <auto Fn>
+void writeRegister(Peripheral& peripheral, dsp56k::TWord value) {
+	if constexpr (!std::is_null_pointer_v<decltype(Fn)>) {
+		using T = typename MemberOf<decltype(Fn)>::type;
+		(static_cast<T&>(peripheral).*Fn)(value);
+	}
+}
+}
+
+// Describe a register backed by member functions. Read handlers may take the
+// accessing instruction; nullptr reads as 0 or ignores writes.
+template <auto Read, auto Write>
+constexpr Register reg(const char* name, Address address) {
+	return Register{name, address,
+		&detail::readRegister<Read>, &detail::writeRegister<Write>};
+}
+
 class Peripheral {
 public:
+	virtual const char* name() const = 0;
 	virtual void exec() = 0;
 	virtual void reset() = 0;
 	virtual void terminate() = 0;
-	virtual std::vector<Register> registers() = 0;
-	void connect(dsp56k::DSP& dsp) { m_dsp = &dsp; }
+	virtual RegisterTable registers() = 0;
+
+	// Cycles that may pass before the peripheral next acts on its own, for
+	// fast-forwarding idle loops. Peripherals driven only by register
+	// accesses or host transfers never do.
+	static constexpr uint32_t unbounded = UINT32_MAX;
+	virtual uint32_t idleCycles() { return unbounded; }
+
+	void connect(dsp56k::DSP& dsp, Peripherals& peripherals) {
+		m_dsp = &dsp;
+		m_peripherals = &peripherals;
+	}
 
 protected:
-	void interrupt(uint32_t n) { m_dsp->injectInterrupt(n); }
-	const uint32_t getInstructionCounter() const { return m_dsp->getInstructionCounter(); }
+	void interrupt(uint32_t n);
+	void clearInterrupt(uint32_t n);
+	void dmaRequest(uint32_t source, uint32_t n = 1);
+
+	// Core cycles: instructions plus cycles passed without executing any,
+	// see Peripherals::advance(). Wraps
+	// like the core's counter, use dsp56k::delta for intervals.
+	const uint32_t getInstructionCounter() const;
+
+	dsp56k::DSP& dsp() { return *m_dsp; }
+	Peripherals& bus() { return *m_peripherals; }
 
 private:
 	dsp56k::DSP* m_dsp;
+	Peripherals* m_peripherals;
 };
 
-// Peripheral with a single register
+// Peripheral with a single register, T provides Name, Addr, read() and
+// write()
 template <typename T>
 class SimplePeripheral : public Peripheral {
 public:
+	virtual const char* name() const override { return T::Name; }
 	virtual void exec() override {}
 	virtual void reset() override {}
 	virtual void terminate() override {}
-	virtual std::vector<Register> registers() override { return m_registers; }
 
-	virtual dsp56k::TWord read() = 0;
-	virtual void write(dsp56k::TWord value) = 0;
+	virtual RegisterTable registers() override {
+		static constexpr Register table[] = {
+			reg<&T::read, &T::write>(T::Name, T::Addr),
+		};
 
-private:
-	std::vector<Register> m_registers = {
-		{T::Name, T::Addr,
-			[&](auto inst) { return read(); },
-			[&](auto value) { write(value); }}
-	};
+		return table;
+	}
 };
 
-class Peripherals;
+// Single writer counter, incremented without a locked instruction
+template <typename T>
+inline void count(std::atomic<T>& counter, typename std::atomic<T>::value_type n = 1) {
+	counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
 
 class Peripherals : public dsp56k::IPeripherals {
 public:
@@ -76,14 +170,141 @@ public:
 	void terminate();
 	void setSymbols(dsp56k::Disassembler& _disasm);
 
+	const std::vector<std::reference_wrapper<Peripheral>>& peripherals() const {
+		return m_peripherals;
+	}
+
+	// Last value the core read from or wrote to a register. Safe to call
+	// from any thread, never has side effects on the peripheral.
+	dsp56k::TWord snapshot(Address address);
+
+	// Report accesses to an I/O address to the watch handler. Unwatched
+	// addresses only pay for a flag test.
+	using WatchHandler = std::function<void(Address, dsp56k::TWord value, bool write)>;
+	bool watch(Address address, bool enable);
+	void setWatchHandler(WatchHandler handler) { m_watchHandler = handler; }
+	static bool isIO(dsp56k::TWord address) { return address - ioFirst < ioSize; }
+
+	struct RegisterStats {
+		const char* peripheral;
+		const Register* reg;
+		uint64_t reads;
+		uint64_t writes;
+	};
+
+	// Access counts per register, safe to call from any thread
+	std::vector<RegisterStats> registerStats();
+
+	// Interrupts injected per vector address, safe to call from any thread
+	uint64_t interrupts(dsp56k::TWord vector) const {
+		return m_interrupts[vector % m_interrupts.size()].load(std::memory_order_relaxed);
+	}
+
+	size_t vectors() const { return m_interrupts.size(); }
+
+	void countInterrupt(dsp56k::TWord vector) {
+		count(m_interrupts[vector % m_interrupts.size()]);
+	}
+
+	// Route interrupts through the controller. Without one they are
+	// injected into the core directly.
+	void setInterruptController(InterruptController& controller) { m_intc = &controller; }
+	void raiseInterrupt(dsp56k::TWord vector);
+	void clearInterrupt(dsp56k::TWord vector);
+
+	// Interrupts merged into an already pending one, safe to call from any
+	// thread
+	uint64_t coalescedInterrupts() const;
+
+	// DMA requests, counted per request source. Only sources some enabled
+	// channel listens to are recorded, so peripherals can raise requests
+	// unconditionally.
+	using DmaRequests = std::array<uint32_t, 32>;
+
+	void requestDma(uint32_t source, uint32_t n) {
+		if (n && (m_dmaSources >> source & 1)) {
+			m_dmaRequests[source] += n;
+			m_dmaPending = true;
+		}
+	}
+
+	void setDmaSources(uint32_t sources) { m_dmaSources = sources; }
+	bool dmaPending() const { return m_dmaPending; }
+
+	// Let cycles pass without the core executing instructions, for
+	// external memory wait states and fast-forwarded idle loops
+	void advance(uint32_t cycles) { m_advanced += cycles; }
+	uint32_t advanced() const { return m_advanced; }
+
+	// Minimum of the peripherals' idleCycles()
+	uint32_t idleCycles();
+
+	// I/O register traffic, for idle loop detection. The signature sums a
+	// hash of every address and value read, stores counts the writes to
+	// memory outside the I/O space. Emulation thread only.
+	struct IoActivity {
+		uint64_t reads = 0;
+		uint64_t writes = 0;
+		uint64_t signature = 0;
+		uint64_t stores = 0;
+	};
+
+	const IoActivity& ioActivity() const { return m_io; }
+
+	// Called by the memory validator for every store to X, Y or P memory
+	void stored() { ++m_io.stores; }
+
+	DmaRequests takeDmaRequests() {
+		DmaRequests requests = m_dmaRequests;
+		m_dmaRequests.fill(0);
+		m_dmaPending = false;
+		return requests;
+	}
+
 private:
 	static const size_t size = dsp56k::XIO_Reserved_High_Last
 		- dsp56k::XIO_Reserved_High_First + 1;
 
-	Register* findRegister(dsp56k::EMemArea area, dsp56k::TWord addr);
+	// Register dispatch covers the whole on-chip I/O space of both X and Y
+	static const dsp56k::TWord ioFirst = 0xFFFF00;
+	static const size_t ioSize = 0x1000000 - ioFirst;
+
+	struct Slot {
+		const Register* reg = nullptr;
+		Peripheral* peripheral = nullptr;
+		std::atomic<dsp56k::TWord> value{0};
+		std::atomic<uint64_t> reads{0}, writes{0};
+		bool watched = false;
+	};
+
+	Slot* findSlot(dsp56k::EMemArea area, dsp56k::TWord addr);
 
 	std::vector<std::reference_wrapper<Peripheral>> m_peripherals;
-	std::unordered_map<dsp56k::TWord, Register> m_x, m_y;
+	std::array<Slot, ioSize> m_x, m_y;
+	WatchHandler m_watchHandler;
+	std::array<std::atomic<uint64_t>, 256> m_interrupts{};
+	InterruptController* m_intc = nullptr;
+	uint32_t m_dmaSources = 0;
+	DmaRequests m_dmaRequests{};
+	bool m_dmaPending = false;
+	uint32_t m_advanced = 0;
+	IoActivity m_io;
 	StaticArray<dsp56k::TWord, size * 2> m_mem;
 };
+
+inline const uint32_t Peripheral::getInstructionCounter() const {
+	return m_dsp->getInstructionCounter() + m_peripherals->advanced();
+}
+
+inline void Peripheral::interrupt(uint32_t n) {
+	m_peripherals->raiseInterrupt(n);
+}
+
+inline void Peripheral::clearInterrupt(uint32_t n) {
+	m_peripherals->clearInterrupt(n);
+}
+
+inline void Peripheral::dmaRequest(uint32_t source, uint32_t n) {
+	m_peripherals->requestDma(source, n);
+}
 }
@@ -0,0 +1,224 @@
+#include "profiler.h"
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <unordered_map>
+#include <vector>
+#include "peripherals.h"
+
+namespace dsp56720 {
+bool SymbolMap::load(const std::string& filename) {
+	std::ifstream in(filename);
+	if (!in) {
+		return false;
+	}
+
+	std::string line;
+	while (std::getline(in, line)) {
+		std::istringstream fields(line);
+		dsp56k::TWord address;
+		std::string name;
+
+		if (fields >> std::hex >> address >> name) {
+			add(address, name);
+		}
+	}
+
+	return true;
+}
+
+void SymbolMap::addTo(dsp56k::Disassembler& disasm) const {
+	for (auto& symbol : m_symbols) {
+		disasm.addSymbol(dsp56k::Disassembler::MemP, symbol.first, symbol.second);
+	}
+}
+
+std::string SymbolMap::symbolize(dsp56k::TWord address) const {
+	std::ostringstream out;
+
+	auto it = m_symbols.upper_bound(address);
+	if (it == m_symbols.begin()) {
+		out << "P:$" << std::hex << address;
+		return out.str();
+	}
+
+	--it;
+	out << it->second;
+	if (address != it->first) {
+		out << "+0x" << std::hex << address - it->first;
+	}
+
+	return out.str();
+}
+
+dsp56k::TWord SymbolMap::function(dsp56k::TWord address) const {
+	auto it = m_symbols.upper_bound(address);
+	if (it == m_symbols.begin()) {
+		return address;
+	}
+
+	return (--it)->first;
+}
+
+Profiler::Profiler(uint32_t interval, bool callStacks, const SymbolMap& symbols,
+		dsp56k::Disassembler& disasm, std::mutex& disasmMutex)
+	: m_interval(interval), m_countdown(interval), m_callStacks(callStacks),
+	m_symbols(symbols), m_disasm(disasm), m_disasmMutex(disasmMutex) {
+	if (m_callStacks) {
+		m_stacks.reset(new Stack[stackSlots]);
+	}
+}
+
+Profiler::~Profiler() {
+	for (auto& page : m_pages) {
+		delete page.load();
+	}
+}
+
+void Profiler::sample(dsp56k::DSP& dsp) {
+	auto pc = dsp.getPC().toWord() & 0xffffff;
+	auto& slot = m_pages[pc >> pageBits];
+
+	auto page = slot.load(std::memory_order_relaxed);
+	if (!page) {
+		// Allocated once per touched 4K words of program memory
+		page = new Page{};
+		slot.store(page, std::memory_order_release);
+	}
+
+	count((*page)[pc & (pageSize - 1)]);
+	count(m_samples);
+
+	if (m_callStacks) {
+		sampleStack(dsp, pc);
+	}
+}
+
+void Profiler::sampleStack(dsp56k::DSP& dsp, dsp56k::TWord pc) {
+	auto& regs = dsp.regs();
+	auto depth = std::min<size_t>(regs.sp.var & 0xf, maxDepth);
+
+	// Root first: SSH of each stack level holds the return address
+	dsp56k::TWord frames[maxDepth + 1];
+	for (size_t i = 0; i < depth; i++) {
+		frames[i] = dsp56k::TWord(regs.ss[i + 1].var >> 24) & 0xffffff;
+	}
+
+	frames[depth++] = pc;
+
+	uint64_t key = 14695981039346656037ull;
+	for (size_t i = 0; i < depth; i++) {
+		key = (key ^ frames[i]) * 1099511628211ull;
+	}
+
+	key |= 1; // 0 marks a free slot
+
+	for (size_t probe = 0; probe < 64; probe++) {
+		auto& stack = m_stacks[(key + probe) & (stackSlots - 1)];
+		auto existing = stack.key.load(std::memory_order_relaxed);
+
+		if (existing == key) {
+			count(stack.count);
+			return;
+		}
+
+		if (!existing) {
+			stack.depth = depth;
+			std::copy(frames, frames + depth, stack.frames);
+			stack.count.store(1, std::memory_order_relaxed);
+			stack.key.store(key, std::memory_order_release);
+			return;
+		}
+	}
+
+	count(m_droppedStacks);
+}
+
+std::string Profiler::flatReport(dsp56k::DSP& dsp, size_t limit) {
+	struct Entry {
+		dsp56k::TWord address;
+		uint64_t samples;
+	};
+
+	std::vector<Entry> entries;
+	std::unordered_map<dsp56k::TWord, uint64_t> functions;
+
+	for (size_t i = 0; i < pages; i++) {
+		auto page = m_pages[i].load(std::memory_order_acquire);
+		if (!page) {
+			continue;
+		}
+
+		for (size_t j = 0; j < pageSize; j++) {
+			auto samples = (*page)[j].load(std::memory_order_relaxed);
+			if (samples) {
+				dsp56k::TWord address = (i << pageBits) | j;
+				entries.push_back({address, samples});
+				functions[m_symbols.function(address)] += samples;
+			}
+		}
+	}
+
+	auto byCount = [](auto& a, auto& b) { return a.samples > b.samples; };
+	std::sort(entries.begin(), entries.end(), byCount);
+
+	std::vector<Entry> totals;
+	for (auto& function : functions) {
+		totals.push_back({function.first, function.second});
+	}
+
+	std::sort(totals.begin(), totals.end(), byCount);
+
+	auto total = std::max<uint64_t>(m_samples.load(std::memory_order_relaxed), 1);
+	std::ostringstream out;
+	out.setf(std::ios::fixed);
+	out.precision(2);
+
+	out << "# " << total << " samples, one every " << m_interval << " instructions\n"
+		<< "# functions\n";
+	for (size_t i = 0; i < std::min(limit, totals.size()); i++) {
+		out << 100.0 * totals[i].samples / total << "% " << totals[i].samples
+			<< " " << m_symbols.symbolize(totals[i].address) << "\n";
+	}
+
+	out << "# instructions\n";
+	auto& memory = dsp.memory();
+	auto& regs = dsp.regs();
+	std::lock_guard<std::mutex> lock(m_disasmMutex);
+	for (size_t i = 0; i < std::min(limit, entries.size()); i++) {
+		auto address = entries[i].address;
+		std::string text;
+		m_disasm.disassemble(text, memory.get(dsp56k::MemArea_P, address),
+				memory.get(dsp56k::MemArea_P, address + 1),
+				regs.sr.var, regs.omr.var, address);
+
+		out << 100.0 * entries[i].samples / total << "% " << entries[i].samples
+			<< " " << m_symbols.symbolize(address) << ": " << text << "\n";
+	}
+
+	return out.str();
+}
+
+std::string Profiler::foldedStacks() {
+	std::ostringstream out;
+	if (!m_callStacks) {
+		return "";
+	}
+
+	for (size_t i = 0; i < stackSlots; i++) {
+		auto& stack = m_stacks[i];
+		if (!stack.key.load(std::memory_order_acquire)) {
+			continue;
+		}
+
+		for (size_t j = 0; j < stack.depth; j++) {
+			out << (j ? ";" : "") << m_symbols.symbolize(m_symbols.function(stack.frames[j]));
+		}
+
+		out << " " << stack.count.load(std::memory_order_relaxed) << "\n";
+	}
+
+	return out.str();
+}
+}
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <dsp56kEmu/dsp.h>
+#include <dsp56kEmu/disasm.h>
+
+namespace dsp56720 {
+// Firmware symbols read from a text file with one "<hex address> <name>"
+// pair per line
+class SymbolMap {
+public:
+	bool load(const std::string& filename);
+	void add(dsp56k::TWord address, const std::string& name) { m_symbols[address] = name; }
+	void addTo(dsp56k::Disassembler& disasm) const;
+
+	// "name+0xoffset", or the bare address when nothing precedes it
+	std::string symbolize(dsp56k::TWord address) const;
+	// Start address of the function containing address
+	dsp56k::TWord function(dsp56k::TWord address) const;
+
+private:
+	std::map<dsp56k::TWord, std::string> m_symbols;
+};
+
+// Sampling profiler recording the PC, and optionally the return addresses
+// on the system stack, every N instructions. Both tables are written by the
+// emulation thread only and read lock-free by the reports.
+class Profiler {
+public:
+	// disasm is shared with other threads, which lock disasmMutex too
+	Profiler(uint32_t interval, bool callStacks, const SymbolMap& symbols,
+			dsp56k::Disassembler& disasm, std::mutex& disasmMutex);
+	~Profiler();
+
+	// Called by the emulation thread after every instruction
+	void tick(dsp56k::DSP& dsp) {
+		if (--m_countdown) {
+			return;
+		}
+
+		m_countdown = m_interval;
+		sample(dsp);
+	}
+
+	std::string flatReport(dsp56k::DSP& dsp, size_t limit = 50);
+	// Stacks in the folded format consumed by flamegraph.pl and friends
+	std::string foldedStacks();
+
+private:
+	static constexpr size_t pageBits = 12;
+	static constexpr size_t pageSize = 1 << pageBits;
+	static constexpr size_t pages = 0x1000000 >> pageBits;
+	static constexpr size_t maxDepth = 16;
+	static constexpr size_t stackSlots = 1 << 14;
+
+	using Page = std::array<std::atomic<uint32_t>, pageSize>;
+
+	struct Stack {
+		std::atomic<uint64_t> key{0};
+		std::atomic<uint32_t> count{0};
+		uint32_t depth;
+		dsp56k::TWord frames[maxDepth + 1];
+	};
+
+	void sample(dsp56k::DSP& dsp);
+	void sampleStack(dsp56k::DSP& dsp, dsp56k::TWord pc);
+
+	uint32_t m_interval;
+	uint32_t m_countdown;
+	bool m_callStacks;
+	const SymbolMap& m_symbols;
+	dsp56k::Disassembler& m_disasm;
+	std::mutex& m_disasmMutex;
+
+	std::array<std::atomic<Page*>, pages> m_pages{};
+	std::unique_ptr<Stack[]> m_stacks;
+	std::atomic<uint64_t> m_samples{0}, m_droppedStacks{0};
+};
+}
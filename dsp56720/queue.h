@@ -1,23 +1,47 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
 #include <condition_variable>
+#include <functional>
 #include <mutex>
 #include <atomic>
-#include <array>
+#include <vector>
+#include <string>
 
 namespace dsp56720 {
+// Largest capacity a queue is configured with, from the command line or
+// its depth file
+constexpr size_t maxQueueCapacity = 1 << 24;
+
+// Rounds up to the next power of two, at least 1
+inline size_t ceilPowerOfTwo(size_t n) {
+	size_t result = 1;
+	while (result < n) {
+		result <<= 1;
+	}
+
+	return result;
+}
+
+// Ring buffer with a power-of-two capacity so indices wrap with a mask. N is
+// the initial capacity.
 template <typename T, size_t N>
 class CircularBuffer {
 public:
-	CircularBuffer() : m_head(0), m_tail(0), m_size(0) {}
+	static_assert(N && (N & (N - 1)) == 0, "capacity must be a power of two");
+
+	CircularBuffer() : m_head(0), m_tail(0), m_data(N), m_mask(N - 1), m_size(0) {}
 
 	void pushBack(const T& value) {
-		m_data[m_head++] = value;
-		m_head %= N;
+		m_data[m_head] = value;
+		m_head = (m_head + 1) & m_mask;
 		++m_size;
 	}
 
 	T popFront() {
-		T value = m_data[m_tail++];
-		m_tail %= N;
+		T value = m_data[m_tail];
+		m_tail = (m_tail + 1) & m_mask;
 		--m_size;
 		return value;
 	}
@@ -26,28 +50,120 @@ public:
 		return m_data[m_tail];
 	}
 
+	// Value index places behind the front
+	const T& at(size_t index) const {
+		return m_data[(m_tail + index) & m_mask];
+	}
+
+	void clear() {
+		m_head = m_tail = m_size = 0;
+	}
+
 	bool empty() const {
 		return m_size == 0;
 	}
 
 	bool full() const {
-		return m_size == N;
+		return m_size > m_mask;
+	}
+
+	size_t size() const {
+		return m_size;
+	}
+
+	size_t capacity() const {
+		return m_mask + 1;
+	}
+
+	// Resize to capacity rounded up to a power of two. If the contents don't
+	// fit the oldest values are discarded.
+	size_t setCapacity(size_t capacity) {
+		capacity = ceilPowerOfTwo(capacity);
+
+		while (m_size > capacity) {
+			popFront();
+		}
+
+		std::vector<T> data(capacity);
+		for (size_t i = 0; i < m_size; i++) {
+			data[i] = m_data[(m_tail + i) & m_mask];
+		}
+
+		m_data.swap(data);
+		m_mask = capacity - 1;
+		m_tail = 0;
+		m_head = m_size & m_mask;
+		return capacity;
 	}
 
 private:
 	size_t m_head;
 	size_t m_tail;
-	std::array<T, N> m_data;
+	std::vector<T> m_data;
+	size_t m_mask;
 	size_t m_size;
 };
 
 struct QueueShutdown : public std::exception {};
 
+// Changes of a queue reported to its watchers, see Queue::watch()
+enum QueueEdge : unsigned {
+	QueueEdge_NotEmpty = 1, // The queue had been empty
+	QueueEdge_NotFull = 2,  // The queue had been full
+};
+
+using QueueWatcher = std::function<void(unsigned edges)>;
+
+// What the emulation thread does when it can't push to a full queue or pop
+// from an empty one
+enum class Policy {
+	Block,      // Wait for the other side
+	DropOldest, // Full: discard the oldest queued value
+	DropNewest, // Full: discard the value being pushed
+	ZeroFill,   // Empty: return 0; full: like DropNewest
+};
+
+inline const char* policyName(Policy policy) {
+	switch (policy) {
+		case Policy::Block: return "block";
+		case Policy::DropOldest: return "drop-oldest";
+		case Policy::DropNewest: return "drop-newest";
+		case Policy::ZeroFill: return "zero-fill";
+	}
+
+	return "unknown";
+}
+
+inline bool parsePolicy(const std::string& name, Policy& policy) {
+	for (auto candidate : {Policy::Block, Policy::DropOldest, Policy::DropNewest, Policy::ZeroFill}) {
+		if (name == policyName(candidate)) {
+			policy = candidate;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+// Lowest and highest fill level seen since the last reset
+struct Watermarks {
+	size_t low;
+	size_t high;
+};
+
 template <typename T, typename Container>
 class Queue {
 public:
 	Queue() : m_shutdown(false) {}
 
+	// Call watcher on every edge, from the thread that caused it and with
+	// the queue locked, so it must be quick and leave the queue alone.
+	// Without watchers the edges cost nothing.
+	void watch(QueueWatcher watcher) {
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_watchers.push_back(std::move(watcher));
+	}
+
 	void push(const T& value) {
 		std::unique_lock<std::mutex> lock(m_mutex);
 		while (m_container.full()) {
@@ -58,11 +174,132 @@ public:
 		}
 
 		m_container.pushBack(value);
+		updateWatermarks();
 		m_not_empty.notify_one();
 	}
 
-	T& front() {
-		return m_container.front();
+	// Push a block of values, taking the lock once per batch instead of
+	// once per value
+	void push(const T* values, size_t count) {
+		std::unique_lock<std::mutex> lock(m_mutex);
+		while (count) {
+			while (m_container.full()) {
+				m_not_empty.notify_one();
+				m_not_full.wait(lock);
+				if (m_shutdown) {
+					throw QueueShutdown();
+				}
+			}
+
+			while (count && !m_container.full()) {
+				m_container.pushBack(*values++);
+				--count;
+			}
+
+			updateWatermarks();
+		}
+
+		m_not_empty.notify_one();
+	}
+
+	// Push according to policy. Returns false if a value had to be dropped.
+	bool push(const T& value, Policy policy) {
+		if (policy == Policy::Block) {
+			push(value);
+			return true;
+		}
+
+		std::unique_lock<std::mutex> lock(m_mutex);
+		bool overrun = m_container.full();
+
+		if (overrun) {
+			if (policy != Policy::DropOldest) {
+				return false;
+			}
+
+			m_container.popFront();
+		}
+
+		m_container.pushBack(value);
+		updateWatermarks();
+		m_not_empty.notify_one();
+		return !overrun;
+	}
+
+	// Pop according to policy. Returns false if the queue was empty and 0
+	// was returned instead.
+	bool pop(T& value, Policy policy) {
+		if (policy == Policy::Block) {
+			value = pop();
+			return true;
+		}
+
+		std::unique_lock<std::mutex> lock(m_mutex);
+		if (m_container.empty()) {
+			value = T{};
+			return false;
+		}
+
+		value = m_container.popFront();
+		updateWatermarks();
+		m_not_full.notify_one();
+		return true;
+	}
+
+	// Push a block according to policy. Returns the number of values
+	// dropped.
+	size_t push(const T* values, size_t count, Policy policy) {
+		if (policy == Policy::Block) {
+			push(values, count);
+			return 0;
+		}
+
+		std::unique_lock<std::mutex> lock(m_mutex);
+		size_t dropped = 0;
+		for (size_t i = 0; i < count; i++) {
+			if (m_container.full()) {
+				if (policy != Policy::DropOldest) {
+					dropped += count - i;
+					break;
+				}
+
+				m_container.popFront();
+				dropped++;
+			}
+
+			m_container.pushBack(values[i]);
+		}
+
+		updateWatermarks();
+		m_not_empty.notify_one();
+		return dropped;
+	}
+
+	// Pop a block according to policy, zero filling what the queue doesn't
+	// hold. Returns the number of values missing.
+	size_t pop(T* values, size_t count, Policy policy) {
+		if (policy == Policy::Block) {
+			pop(values, count);
+			return 0;
+		}
+
+		std::unique_lock<std::mutex> lock(m_mutex);
+		size_t popped = 0;
+		while (popped < count && !m_container.empty()) {
+			values[popped++] = m_container.popFront();
+		}
+
+		std::fill(values + popped, values + count, T{});
+		updateWatermarks();
+		m_not_full.notify_one();
+		return count - popped;
+	}
+
+	// Oldest value without popping it, T{} if empty. A copy, since
+	// setCapacity() may replace the storage from another thread.
+	T front() {
+		std::unique_lock<std::mutex> lock(m_mutex);
+		return m_container.empty() ? T{} : m_container.front();
 	}
 
 	T pop() {
@@ -75,24 +312,154 @@ public:
 		}
 
 		T value = m_container.popFront();
+		updateWatermarks();
 		m_not_full.notify_one();
 		return value;
 	}
 
+	// Pop a block of values, taking the lock once per batch instead of
+	// once per value
+	void pop(T* values, size_t count) {
+		std::unique_lock<std::mutex> lock(m_mutex);
+		while (count) {
+			while (m_container.empty()) {
+				m_not_full.notify_one();
+				m_not_empty.wait(lock);
+				if (m_shutdown) {
+					throw QueueShutdown();
+				}
+			}
+
+			while (count && !m_container.empty()) {
+				*values++ = m_container.popFront();
+				--count;
+			}
+
+			updateWatermarks();
+		}
+
+		m_not_full.notify_one();
+	}
+
+	// Push as many values as fit, waiting up to timeout for space. Returns
+	// the number of values pushed.
+	template <typename Rep, typename Period>
+	size_t pushFor(const T* values, size_t count, std::chrono::duration<Rep, Period> timeout) {
+		std::unique_lock<std::mutex> lock(m_mutex);
+		if (!m_not_full.wait_for(lock, timeout,
+				[this]() { return m_shutdown || !m_container.full(); })) {
+			return 0;
+		}
+
+		if (m_shutdown) {
+			throw QueueShutdown();
+		}
+
+		size_t pushed = 0;
+		while (pushed < count && !m_container.full()) {
+			m_container.pushBack(values[pushed++]);
+		}
+
+		updateWatermarks();
+		m_not_empty.notify_one();
+		return pushed;
+	}
+
+	// Pop up to count values, waiting up to timeout for the first one.
+	// Returns the number of values popped.
+	template <typename Rep, typename Period>
+	size_t popFor(T* values, size_t count, std::chrono::duration<Rep, Period> timeout) {
+		std::unique_lock<std::mutex> lock(m_mutex);
+		if (!m_not_empty.wait_for(lock, timeout,
+				[this]() { return m_shutdown || !m_container.empty(); })) {
+			return 0;
+		}
+
+		if (m_container.empty()) {
+			throw QueueShutdown();
+		}
+
+		size_t popped = 0;
+		while (popped < count && !m_container.empty()) {
+			values[popped++] = m_container.popFront();
+		}
+
+		updateWatermarks();
+		m_not_full.notify_one();
+		return popped;
+	}
+
 	void shutdown() {
 		m_shutdown = true;
 		m_not_full.notify_all();
 		m_not_empty.notify_all();
 	}
 
-	bool empty() const { return m_container.empty(); }
-	bool full() const { return m_container.full(); }
+	// Lock-free, from the fill published under the lock
+	bool empty() const { return size() == 0; }
+	bool full() const { return size() >= capacity(); }
+	size_t size() const { return m_size.load(std::memory_order_relaxed); }
+	size_t capacity() const { return m_capacity.load(std::memory_order_relaxed); }
+
+	// Change the capacity at runtime, see CircularBuffer::setCapacity().
+	// Returns the capacity actually used.
+	size_t setCapacity(size_t capacity) {
+		std::unique_lock<std::mutex> lock(m_mutex);
+		capacity = m_container.setCapacity(capacity);
+		m_capacity.store(capacity, std::memory_order_relaxed);
+		updateWatermarks();
+
+		m_not_full.notify_all();
+		m_not_empty.notify_all();
+		return capacity;
+	}
+
+	Watermarks watermarks() const {
+		return {m_low.load(std::memory_order_relaxed), m_high.load(std::memory_order_relaxed)};
+	}
+
+	void resetWatermarks() {
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_low = m_high = m_container.size();
+	}
 
 private:
+	// Called with the lock held after every change
+	void updateWatermarks() {
+		auto size = m_container.size();
+		auto before = m_size.load(std::memory_order_relaxed);
+		m_size.store(size, std::memory_order_relaxed);
+
+		bool full = m_container.full();
+		unsigned edges = (!before && size ? QueueEdge_NotEmpty : 0)
+			| (m_full && !full ? QueueEdge_NotFull : 0);
+		m_full = full;
+
+		if (edges) {
+			for (auto& watcher : m_watchers) {
+				watcher(edges);
+			}
+		}
+
+		if (size < m_low.load(std::memory_order_relaxed)) {
+			m_low.store(size, std::memory_order_relaxed);
+		}
+
+		if (size > m_high.load(std::memory_order_relaxed)) {
+			m_high.store(size, std::memory_order_relaxed);
+		}
+	}
+
 	std::mutex m_mutex;
 	std::condition_variable m_not_full, m_not_empty;
 
 	std::atomic<bool> m_shutdown;
 	Container m_container;
+	bool m_full = false;
+	std::vector<QueueWatcher> m_watchers;
+
+	// The low watermark starts out at the top, so the first fill seen sets it
+	std::atomic<size_t> m_size{0}, m_low{m_container.capacity()}, m_high{0};
+	std::atomic<size_t> m_capacity{m_container.capacity()};
 };
 }
@@ -0,0 +1,159 @@
+#include "resampler.h"
+
+#include <algorithm>
+#include <cmath>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define RESAMPLER_X86 1
+#endif
+
+namespace dsp56720 {
+namespace {
+using DotProduct = float (*)(const float* a, const float* b);
+
+float dotScalar(const float* a, const float* b) {
+	float sum = 0;
+	for (size_t i = 0; i < Resampler::taps; i++) {
+		sum += a[i] * b[i];
+	}
+
+	return sum;
+}
+
+#ifdef RESAMPLER_X86
+__attribute__((target("sse2")))
+float dotSse(const float* a, const float* b) {
+	auto sum = _mm_setzero_ps();
+	for (size_t i = 0; i < Resampler::taps; i += 4) {
+		sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+	}
+
+	sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+	sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+	return _mm_cvtss_f32(sum);
+}
+
+__attribute__((target("avx2,fma")))
+float dotAvx2(const float* a, const float* b) {
+	auto sum = _mm256_setzero_ps();
+	for (size_t i = 0; i < Resampler::taps; i += 8) {
+		sum = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), sum);
+	}
+
+	auto half = _mm_add_ps(_mm256_castps256_ps128(sum), _mm256_extractf128_ps(sum, 1));
+	half = _mm_add_ps(half, _mm_movehl_ps(half, half));
+	half = _mm_add_ss(half, _mm_shuffle_ps(half, half, 1));
+	return _mm_cvtss_f32(half);
+}
+#endif
+
+struct Kernel {
+	DotProduct dot;
+	const char* name;
+};
+
+Kernel selectKernel() {
+#ifdef RESAMPLER_X86
+	if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+		return {dotAvx2, "avx2"};
+	}
+
+	if (__builtin_cpu_supports("sse2")) {
+		return {dotSse, "sse2"};
+	}
+#endif
+
+	return {dotScalar, "scalar"};
+}
+
+const Kernel kernel = selectKernel();
+
+static_assert(Resampler::taps % 8 == 0, "the vector kernels need whole registers");
+
+double sinc(double x) {
+	return x == 0 ? 1 : std::sin(M_PI * x) / (M_PI * x);
+}
+
+// Blackman window over [0, 1]
+double blackman(double x) {
+	return 0.42 - 0.5 * std::cos(2 * M_PI * x) + 0.08 * std::cos(4 * M_PI * x);
+}
+}
+
+const char* resamplerKernel() {
+	return kernel.name;
+}
+
+Resampler::Resampler() {
+	setRatio(1);
+	reset();
+}
+
+void Resampler::setRatio(double ratio) {
+	m_step = std::clamp(ratio, 1.0 / 16, 16.0);
+
+	// Leave some transition band below the output Nyquist frequency
+	auto cutoff = 0.9 * std::min(1.0, 1 / m_step);
+	if (std::abs(cutoff - m_cutoff) > 0.01) {
+		design(cutoff);
+	}
+}
+
+void Resampler::reset() {
+	m_window.assign(taps - 1, 0);
+	m_position = 0;
+}
+
+void Resampler::design(double cutoff) {
+	m_cutoff = cutoff;
+	m_coefficients.resize(phases * taps);
+
+	// Phase p is the filter for an output p / phases of an input sample past
+	// the start of the window
+	for (size_t p = 0; p < phases; p++) {
+		auto row = &m_coefficients[p * taps];
+		double offset = double(p) / phases;
+		double sum = 0;
+
+		for (size_t t = 0; t < taps; t++) {
+			double x = t - (taps / 2 - 1) - offset;
+			double w = blackman((t - offset + 1) / (taps + 1));
+			row[t] = cutoff * sinc(cutoff * x) * w;
+			sum += row[t];
+		}
+
+		// Unity gain at DC for every phase
+		for (size_t t = 0; t < taps; t++) {
+			row[t] /= sum;
+		}
+	}
+}
+
+size_t Resampler::process(const float* in, size_t count, float* out, size_t capacity) {
+	m_window.insert(m_window.end(), in, in + count);
+
+	size_t written = 0;
+	while (written < capacity) {
+		// Round to the nearest phase; rounding up past the last one is phase 0
+		// of the next input sample
+		auto start = size_t(m_position);
+		auto phase = size_t((m_position - start) * phases + 0.5);
+		if (phase == phases) {
+			start++;
+			phase = 0;
+		}
+		if (start + taps > m_window.size()) {
+			break;
+		}
+
+		out[written++] = kernel.dot(&m_window[start], &m_coefficients[phase * taps]);
+		m_position += m_step;
+	}
+
+	auto consumed = std::min(size_t(m_position), m_window.size());
+	m_window.erase(m_window.begin(), m_window.begin() + consumed);
+	m_position -= consumed;
+	return written;
+}
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+namespace dsp56720 {
+// Polyphase windowed-sinc resampler for one channel. Each output sample is
+// a dot product of the input window with the filter phase nearest to its
+// fractional position. The dot product is vectorised with AVX2 or SSE,
+// picked at runtime, with a scalar fallback.
+class Resampler {
+public:
+	static constexpr size_t taps = 32;
+	static constexpr size_t phases = 256;
+
+	Resampler();
+
+	// Input samples per output sample. Decimating narrows the filter to the
+	// output band.
+	void setRatio(double ratio);
+	double ratio() const { return m_step; }
+
+	void reset();
+
+	// Resample a block, appending all of in to the history. Returns the
+	// number of samples written to out, at most capacity.
+	size_t process(const float* in, size_t count, float* out, size_t capacity);
+
+	// Input samples held back for the filter window
+	size_t latency() const { return taps / 2; }
+
+private:
+	void design(double cutoff);
+
+	std::vector<float> m_coefficients; // phases rows of taps
+	std::vector<float> m_window;       // Unconsumed input, oldest first
+	double m_position = 0;             // Of the next output in m_window
+	double m_step = 1;
+	double m_cutoff = 0;
+};
+
+// Name of the dot product implementation in use, for reports
+const char* resamplerKernel();
+}
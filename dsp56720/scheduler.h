@@ -0,0 +1,248 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace dsp56720 {
+// Multiplexes long running tasks, run in short slices, over a fixed set of
+// worker threads. Each worker round-robins its own queue and steals from
+// the other queues when it has nothing runnable. Parked tasks stay out of
+// the rotation until wake() is called for them, and workers with nothing
+// runnable sleep until a task becomes due or is woken.
+class Scheduler {
+public:
+	using Clock = std::chrono::steady_clock;
+
+	enum class Result {
+		Ran,  // Made progress
+		Idle,   // Waiting for something external, retry later
+		Parked, // Waiting for wake(), or parkTimeout at the latest
+		Paced,  // Ahead of schedule, retry at the slice's notBefore
+		Done,   // Never run again
+	};
+
+	// A slice that returns Paced sets notBefore, no other result reads it
+	using Slice = std::function<Result(Clock::time_point& notBefore)>;
+
+	// Idle tasks are retried after this long
+	static constexpr std::chrono::milliseconds idleDelay{1};
+
+	// Parked tasks are retried after this long even without a wake(), so a
+	// missed one costs latency instead of a hang
+	static constexpr std::chrono::milliseconds parkTimeout{100};
+
+	Scheduler(size_t workers) {
+		for (size_t i = 0; i < std::max<size_t>(workers, 1); i++) {
+			m_queues.push_back(std::make_unique<Queue>());
+		}
+	}
+
+	~Scheduler() {
+		stop();
+	}
+
+	// budget is the share of one core the task may use, throttling happens
+	// between slices. Returns the handle to pass to wake() and the stats.
+	size_t add(Slice slice, double budget = 1.0) {
+		auto task = std::make_unique<Task>();
+		task->slice = std::move(slice);
+		task->budget = std::clamp(budget, 0.001, 1.0);
+
+		auto& queue = *m_queues[m_tasks.size() % m_queues.size()];
+		queue.tasks.push_back(task.get());
+		m_tasks.push_back(std::move(task));
+		return m_tasks.size() - 1;
+	}
+
+	// Makes a parked task runnable again. Safe to call from any thread; a
+	// wake that arrives while the task runs applies to its next park.
+	// Repeated wakes before the task runs only notify the workers once.
+	void wake(size_t task) {
+		if (!m_tasks[task]->rung.exchange(true, std::memory_order_acq_rel)) {
+			notify();
+		}
+	}
+
+	void start() {
+		m_running = true;
+		for (size_t i = 0; i < m_queues.size(); i++) {
+			m_workers.emplace_back([this, i]() { work(i); });
+		}
+	}
+
+	void stop() {
+		m_running = false;
+		notify();
+		for (auto& worker : m_workers) {
+			worker.join();
+		}
+
+		m_workers.clear();
+	}
+
+	// Slices run since startup, per task in the order they were added
+	uint64_t slices(size_t task) const {
+		return m_tasks[task]->slices.load(std::memory_order_relaxed);
+	}
+
+	// Busy seconds since startup, per task
+	double busy(size_t task) const {
+		return m_tasks[task]->busy.load(std::memory_order_relaxed);
+	}
+
+	uint64_t steals() const {
+		return m_steals.load(std::memory_order_relaxed);
+	}
+
+	uint64_t parks() const {
+		return m_parks.load(std::memory_order_relaxed);
+	}
+
+private:
+	struct Task {
+		Slice slice;
+		double budget;
+		Clock::time_point notBefore{};
+		bool parked = false;
+		std::atomic<bool> rung{false};
+
+		std::atomic<uint64_t> slices{0};
+		std::atomic<double> busy{0};
+	};
+
+	struct Queue {
+		std::mutex mutex;
+		std::deque<Task*> tasks;
+	};
+
+	void notify() {
+		{
+			std::lock_guard<std::mutex> lock(m_sleepMutex);
+			m_generation++;
+		}
+
+		m_sleep.notify_all();
+	}
+
+	void work(size_t self) {
+		while (m_running) {
+			uint64_t generation;
+			{
+				std::lock_guard<std::mutex> lock(m_sleepMutex);
+				generation = m_generation;
+			}
+
+			auto now = Clock::now();
+			auto wake = now + parkTimeout;
+
+			auto task = take(self, now, wake);
+			if (!task) {
+				// A wake() since the search started ends the sleep early
+				std::unique_lock<std::mutex> lock(m_sleepMutex);
+				m_sleep.wait_until(lock, wake, [&]() {
+					return m_generation != generation || !m_running;
+				});
+				continue;
+			}
+
+			// Whatever rang before the slice starts is seen by it
+			task->parked = false;
+			task->rung.store(false, std::memory_order_relaxed);
+
+			Clock::time_point notBefore{};
+			auto result = task->slice(notBefore);
+			auto end = Clock::now();
+			auto elapsed = end - now;
+
+			task->slices.store(task->slices.load(std::memory_order_relaxed) + 1,
+					std::memory_order_relaxed);
+			task->busy.store(task->busy.load(std::memory_order_relaxed)
+					+ std::chrono::duration<double>(elapsed).count(),
+					std::memory_order_relaxed);
+
+			switch (result) {
+				case Result::Done:
+					continue;
+				case Result::Idle:
+					task->notBefore = end + idleDelay;
+					break;
+				case Result::Parked:
+					task->notBefore = end + parkTimeout;
+					task->parked = true;
+					m_parks.fetch_add(1, std::memory_order_relaxed);
+					break;
+				case Result::Paced:
+					task->notBefore = notBefore;
+					break;
+				case Result::Ran:
+					// Sit out long enough to stay within the budget
+					task->notBefore = end + std::chrono::duration_cast<Clock::duration>(
+							elapsed * (1 / task->budget - 1));
+					break;
+			}
+
+			auto& queue = *m_queues[self];
+			std::lock_guard<std::mutex> lock(queue.mutex);
+			queue.tasks.push_back(task);
+		}
+	}
+
+	// First runnable task, searching the own queue from the front and then
+	// the others from the back. Lowers wake to the earliest time a task
+	// becomes runnable.
+	Task* take(size_t self, Clock::time_point now, Clock::time_point& wake) {
+		for (size_t i = 0; i < m_queues.size(); i++) {
+			auto& queue = *m_queues[(self + i) % m_queues.size()];
+			std::lock_guard<std::mutex> lock(queue.mutex);
+
+			auto runnable = [&](Task* task) {
+				if (task->notBefore <= now
+						|| (task->parked && task->rung.load(std::memory_order_acquire))) {
+					return true;
+				}
+
+				wake = std::min(wake, task->notBefore);
+				return false;
+			};
+
+			if (i == 0) {
+				auto it = std::find_if(queue.tasks.begin(), queue.tasks.end(), runnable);
+				if (it != queue.tasks.end()) {
+					auto task = *it;
+					queue.tasks.erase(it);
+					return task;
+				}
+			} else {
+				auto it = std::find_if(queue.tasks.rbegin(), queue.tasks.rend(), runnable);
+				if (it != queue.tasks.rend()) {
+					auto task = *it;
+					queue.tasks.erase(std::next(it).base());
+					m_steals.fetch_add(1, std::memory_order_relaxed);
+					return task;
+				}
+			}
+		}
+
+		return nullptr;
+	}
+
+	std::vector<std::unique_ptr<Queue>> m_queues;
+	std::vector<std::unique_ptr<Task>> m_tasks;
+	std::vector<std::thread> m_workers;
+	std::atomic<bool> m_running{false};
+	std::atomic<uint64_t> m_steals{0};
+	std::atomic<uint64_t> m_parks{0};
+
+	std::mutex m_sleepMutex;
+	std::condition_variable m_sleep;
+	uint64_t m_generation = 0;
+};
+}
@@ -1,13 +1,20 @@
 #pragma once
 
+#include <algorithm>
+#include <array>
 #include <cstdio>
+#include <sys/uio.h>
 #include <dsp56kEmu/dsp.h>
 #include <dsp56kEmu/interrupts.h>
 #include "peripherals.h"
 #include "bitfield.h"
 #include "queue.h"
+#include "dma.h"
+#include "doorbell.h"
 
 namespace dsp56720 {
+// State and behaviour shared by the SHI instances. The register addresses
+// are supplied by SerialHostPort.
 class SerialHostInterace : public Peripheral {
 public:
 	struct HCSR : BitField<dsp56k::TWord> {
@@ -33,33 +40,164 @@ public:
 		using HBUSY = Bit<22>;
 	};
 
-	virtual void exec() override {
-		if (!HCSR::HEN(m_hcsr)) {
-			return;
+	struct HSAR : BitField<dsp56k::TWord> {
+		using BitField<dsp56k::TWord>::operator=;
+
+		using HA1 = Bit<18>;
+		using HA = Packed<20, 4>; // HA6-HA3
+	};
+
+	// Word sizes selected by HCSR::HM
+	enum class WordMode : dsp56k::TWord {
+		Bits8 = 0,
+		Bits16 = 1,
+		Bits24 = 2,
+	};
+
+	// Byte-level host endpoint. Bytes are packed into SHI words MSB first
+	// according to HCSR::HM, the way an SPI or I2C master clocks them out.
+	//
+	// In SPI mode every byte belongs to the data stream. In I2C mode each
+	// write() is one bus transaction starting with the address byte
+	// (address << 1 | R/W); a mismatch against HSAR is NACKed by returning
+	// false. A read transaction has to be addressed by a write consisting of
+	// only the address byte before read() returns any data.
+	class ByteStream {
+	public:
+		ByteStream(SerialHostInterace& shi) : m_shi(shi) {}
+
+		bool write(const uint8_t* data, size_t count) {
+			struct iovec iov = {const_cast<uint8_t*>(data), count};
+			return writev(&iov, 1);
 		}
 
+		bool read(uint8_t* data, size_t count) {
+			struct iovec iov = {data, count};
+			return readv(&iov, 1);
+		}
+
+		bool writev(const struct iovec* iov, int iovcnt) {
+			size_t skip = 0;
+
+			if (HCSR::HI2C(m_shi.m_hcsr)) {
+				if (!iovcnt || !iov[0].iov_len) {
+					return false;
+				}
 
-		if (m_pendingRXInterrupts > 0 && HCSR::HRIE(m_hcsr)) {
-			--m_pendingRXInterrupts;
+				auto address = *static_cast<const uint8_t*>(iov[0].iov_base);
+				if ((address >> 1) != m_shi.slaveAddress()) {
+					m_i2cRead = false;
+					return false;
+				}
 
-			// TODO: Document constant values
-			// TODO: We probably want to move these checks into
-			// where the interrupt is incremented
-			switch (HCSR::HRIE(m_hcsr)) {
-				case 1:
-					if (!m_rx.empty()) {
-						interrupt(dsp56k::Vba_SHI_Receive_FIFO_Not_Empty);
+				m_i2cRead = address & 1;
+				skip = 1;
+			}
+
+			std::array<dsp56k::TWord, 256> words;
+			size_t n = 0;
+
+			for (int i = 0; i < iovcnt; i++) {
+				auto bytes = static_cast<const uint8_t*>(iov[i].iov_base);
+				for (size_t j = skip; j < iov[i].iov_len; j++) {
+					m_word = (m_word << 8) | bytes[j];
+					if (++m_wordBytes < m_shi.wordBytes()) {
+						continue;
 					}
-					break;
-				case 3:
-					if (m_rx.full()) {
-						interrupt(dsp56k::Vba_SHI_Receive_FIFO_Full);
+
+					words[n++] = m_word & 0x00ffffff;
+					m_word = 0;
+					m_wordBytes = 0;
+
+					if (n == words.size()) {
+						m_shi.writeRX(words.data(), n);
+						n = 0;
+					}
+				}
+
+				skip = 0;
+			}
+
+			if (n) {
+				m_shi.writeRX(words.data(), n);
+			}
+
+			return true;
+		}
+
+		bool readv(const struct iovec* iov, int iovcnt) {
+			if (HCSR::HI2C(m_shi.m_hcsr) && !m_i2cRead) {
+				return false;
+			}
+
+			for (int i = 0; i < iovcnt; i++) {
+				auto bytes = static_cast<uint8_t*>(iov[i].iov_base);
+				for (size_t j = 0; j < iov[i].iov_len; j++) {
+					if (!m_pendingBytes) {
+						m_pending = m_shi.readTX();
+						m_pendingBytes = m_shi.wordBytes();
 					}
-					break;
+
+					--m_pendingBytes;
+					bytes[j] = m_pending >> (m_pendingBytes * 8);
+				}
 			}
-		} else if (HCSR::HTIE(m_hcsr) && m_pendingTXInterrupts > 0) {
-			--m_pendingTXInterrupts;
-			interrupt(dsp56k::Vba_SHI_Transmit_Data);
+
+			return true;
+		}
+
+	private:
+		SerialHostInterace& m_shi;
+
+		// Partially received word, host to DSP
+		dsp56k::TWord m_word = 0;
+		size_t m_wordBytes = 0;
+
+		// Partially transmitted word, DSP to host
+		dsp56k::TWord m_pending = 0;
+		size_t m_pendingBytes = 0;
+
+		bool m_i2cRead = false;
+	};
+
+	// Interrupt vectors and DMA request sources of an instance
+	struct Vectors {
+		dsp56k::TWord transmitData;
+		dsp56k::TWord receiveNotEmpty;
+		dsp56k::TWord receiveFull;
+		uint32_t dmaReceive;
+		uint32_t dmaTransmit;
+	};
+
+	SerialHostInterace(const Vectors& vectors) : m_vectors(vectors) {}
+
+	virtual void exec() override {
+		if (!HCSR::HEN(m_hcsr)) {
+			return;
+		}
+
+		if (!m_rx.empty()) {
+			dmaRequest(m_vectors.dmaReceive);
+		}
+
+		if (!m_tx.full()) {
+			dmaRequest(m_vectors.dmaTransmit);
+		}
+
+		// Interrupts follow the FIFO levels. Each one is raised once and
+		// re-armed when the DSP reads HRX or writes HTX, so a service
+		// routine that hasn't run yet isn't interrupted again.
+		switch (HCSR::HRIE(m_hcsr)) {
+			case 1: // Receive FIFO not empty
+				raise(m_rxArmed, !m_rx.empty(), m_vectors.receiveNotEmpty);
+				break;
+			case 3: // Receive FIFO full
+				raise(m_rxArmed, m_rx.full(), m_vectors.receiveFull);
+				break;
+		}
+
+		if (HCSR::HTIE(m_hcsr)) {
+			raise(m_txArmed, !m_tx.full(), m_vectors.transmitData);
 		}
 	}
 
@@ -79,28 +217,79 @@ public:
 		m_hcsr = value;
 	}
 
-	virtual std::vector<Register> registers() override {
-		return m_registers;
+	dsp56k::TWord readSlaveAddressRegister() {
+		return m_hsar;
+	}
+
+	void writeSlaveAddressRegister(dsp56k::TWord value) {
+		m_hsar = value;
+	}
+
+	dsp56k::TWord readClockControlRegister() {
+		return m_hckr;
+	}
+
+	void writeClockControlRegister(dsp56k::TWord value) {
+		m_hckr = value;
+	}
+
+	// HA2 and HA0 are taken from the HREQ and MOSI pins in I2C mode
+	void setAddressPins(bool ha2, bool ha0) {
+		m_ha2 = ha2;
+		m_ha0 = ha0;
+	}
+
+	uint8_t slaveAddress() const {
+		return (HSAR::HA(m_hsar) << 3) | (m_ha2 << 2)
+			| (HSAR::HA1(m_hsar) << 1) | m_ha0;
+	}
+
+	size_t wordBytes() const {
+		switch (WordMode(dsp56k::TWord(HCSR::HM(m_hcsr)))) {
+			case WordMode::Bits8:
+				return 1;
+			case WordMode::Bits16:
+				return 2;
+			default:
+				return 3;
+		}
 	}
 
 	void writeRX(const std::vector<dsp56k::TWord>& _data) {
 		writeRX(&_data[0], _data.size());
 	}
 
+	// Host words carry 32 bits, the FIFO only 24. Rings after every chunk,
+	// which is capped at the FIFO depth so the core has been told about
+	// everything a blocked push waits on.
 	void writeRX(const dsp56k::TWord* data, size_t count) {
-		for (size_t i = 0; i < count; ++i) {
-			m_rx.push(data[i] & 0x00ffffff);
-			if (HCSR::HEN(m_hcsr) && HCSR::HRIE(m_hcsr)) {
-				++m_pendingRXInterrupts;
+		std::array<dsp56k::TWord, 256> chunk;
+		while (count) {
+			auto n = std::min({count, chunk.size(), m_rx.capacity()});
+			for (size_t i = 0; i < n; i++) {
+				chunk[i] = data[i] & 0x00ffffff;
 			}
+
+			m_rx.push(chunk.data(), n);
+			ring();
+			data += n;
+			count -= n;
 		}
 	}
 
 	void writeRX(const dsp56k::TWord word) {
 		m_rx.push(word & 0x00ffffff);
-		if (HCSR::HEN(m_hcsr) && HCSR::HRIE(m_hcsr)) {
-			++m_pendingRXInterrupts;
+		ring();
+	}
+
+	// Word from a linked peer. Never blocks, since the peer may run on the
+	// same thread; a full FIFO drops the word like a receive overrun.
+	void receive(dsp56k::TWord word) {
+		if (!m_rx.push(word & 0x00ffffff, Policy::DropNewest)) {
+			m_overruns.fetch_add(1, std::memory_order_relaxed);
 		}
+
+		ring();
 	}
 
 	void pipe(std::FILE *f) {
@@ -114,9 +303,7 @@ public:
 			uint32_t word = (b[0]<<0) | (b[1]<<8) | (b[2]<<16) | (b[3]<<24);
 
 			m_rx.push(word);
-			if (HCSR::HEN(m_hcsr) && HCSR::HRIE(m_hcsr)) {
-				++m_pendingRXInterrupts;
-			}
+			ring();
 		}
 	}
 
@@ -142,6 +329,7 @@ public:
                         break;
                 default:
                         res = m_rx.pop();
+                        m_rxArmed = true;
                         break;
                 }
 
@@ -149,44 +337,136 @@ public:
 	}
 
 	void writeTX(dsp56k::TWord value) {
-		m_tx.push(value);
-		++m_pendingTXInterrupts;
+		if (m_peer) {
+			m_peer->receive(value);
+		} else {
+			m_tx.push(value);
+		}
+
+		m_txArmed = true;
+	}
+
+	// Wire two interfaces back to back, each one's transmitted words arrive
+	// in the other's receive FIFO. Only call before either chip runs.
+	static void connect(SerialHostInterace& master, SerialHostInterace& slave) {
+		master.m_peer = &slave;
+		slave.m_peer = &master;
 	}
 
+	// Words a linked peer sent while the receive FIFO was full
+	uint64_t overruns() const { return m_overruns.load(std::memory_order_relaxed); }
+
 	dsp56k::TWord readTX() {
 		return m_tx.pop();
 	}
 
+	void readTX(dsp56k::TWord* data, size_t count) {
+		m_tx.pop(data, count);
+	}
+
+	// Words queued by the host that the DSP hasn't read yet
+	size_t received() const { return m_rx.size(); }
+
+	// Words sent by the DSP that the host hasn't read yet
+	size_t transmitted() const { return m_tx.size(); }
+
+	// See Queue::watch(). Only call before the chip runs.
+	void watchRX(QueueWatcher watcher) { m_rx.watch(std::move(watcher)); }
+	void watchTX(QueueWatcher watcher) { m_tx.watch(std::move(watcher)); }
+
+	// Depth of each of the RX and TX queues
+	size_t capacity() const { return m_rx.capacity(); }
+	size_t fill() const { return std::max(m_rx.size(), m_tx.size()); }
+
+	size_t setCapacity(size_t capacity) {
+		m_tx.setCapacity(capacity);
+		return m_rx.setCapacity(capacity);
+	}
+
+	// Rung after every write to the receive FIFO. Only call before the chip
+	// runs.
+	void setDoorbell(Doorbell* doorbell) { m_doorbell = doorbell; }
+
 private:
+	void ring() {
+		if (m_doorbell) {
+			m_doorbell->ring();
+		}
+	}
+
+	void raise(bool& armed, bool condition, dsp56k::TWord vector) {
+		if (armed && condition) {
+			armed = false;
+			interrupt(vector);
+		}
+	}
+
 	HCSR m_hcsr;
+	HSAR m_hsar{};
+	dsp56k::TWord m_hckr = 0;
+	bool m_ha2 = false;
+	bool m_ha0 = false;
 	Queue<dsp56k::TWord, CircularBuffer<dsp56k::TWord, 8192>> m_rx;
 	Queue<dsp56k::TWord, CircularBuffer<dsp56k::TWord, 8192>> m_tx;
-	std::atomic<uint32_t> m_pendingRXInterrupts;
-	std::atomic<uint32_t> m_pendingTXInterrupts;
+	bool m_rxArmed = true;
+	bool m_txArmed = true;
+	SerialHostInterace* m_peer = nullptr;
+	Doorbell* m_doorbell = nullptr;
+	std::atomic<uint64_t> m_overruns{0};
+	Vectors m_vectors;
+};
+
+// SHI instance N, SHI at X:$FFFF90 for 0 and SHI_1 at Y:$FFFF90 for 1.
+// SHI_1 vectors and IPRP field follow those of SHI at a fixed offset.
+template <size_t N>
+class SerialHostPort : public SerialHostInterace {
+public:
+	static_assert(N < 2, "the DSP56720 has two SHI instances");
+
+	static constexpr Address Base = N ? 0xFFFF90_ymem : 0xFFFF90_xmem;
+	static constexpr dsp56k::TWord VectorOffset = N * 0x40;
+
+	SerialHostPort()
+		: SerialHostInterace({
+			dsp56k::Vba_SHI_Transmit_Data + VectorOffset,
+			dsp56k::Vba_SHI_Receive_FIFO_Not_Empty + VectorOffset,
+			dsp56k::Vba_SHI_Receive_FIFO_Full + VectorOffset,
+			N ? DmaRequest_SHI1_Receive : DmaRequest_SHI_Receive,
+			N ? DmaRequest_SHI1_Transmit : DmaRequest_SHI_Transmit,
+		}) {}
+
+	virtual const char* name() const override { return N ? "shi1" : "shi"; }
+
+	virtual RegisterTable registers() override {
+		return Registers;
+	}
+
+private:
+	static constexpr const char* pick(const char* shi, const char* shi1) {
+		return N ? shi1 : shi;
+	}
+
+	using SHI = SerialHostInterace;
 
-	std::vector<Register> m_registers = {
+	static constexpr Register Registers[] = {
 		// SHI Receive FIFO
-		{"HRX", 0xFFFF94_xmem,
-			[&](auto inst) { return readRX(inst); },
-			[&](auto value) {}},
+		reg<static_cast<dsp56k::TWord (SHI::*)(dsp56k::Instruction)>(&SHI::readRX),
+			nullptr>(pick("HRX", "HRX_1"), Base + 0x4),
 
 		// SHI Transmit Register
-		{"HTX", 0xFFFF93_xmem,
-			[&](auto inst) { return 0; },
-			[&](auto value) { writeTX(value); }},
+		reg<nullptr, &SHI::writeTX>(pick("HTX", "HTX_1"), Base + 0x3),
 
 		// SHI I2C Slave Address Register
-		{"HSAR", 0xFFFF92_xmem,
-			[&](auto inst) { return 0; },
-			[&](auto value) {}},
+		reg<&SHI::readSlaveAddressRegister, &SHI::writeSlaveAddressRegister>(
+			pick("HSAR", "HSAR_1"), Base + 0x2),
 
 		// SHI Control/Status Register
-		{"HCSR", 0xFFFF91_xmem,
-			[&](auto inst) { return readStatusControlRegister(inst); },
-			[&](auto value) { writeStatusControlRegister(value); }},
+		reg<&SHI::readStatusControlRegister, &SHI::writeStatusControlRegister>(
+			pick("HCSR", "HCSR_1"), Base + 0x1),
 
 		// SHI Clock Control Register
-		{"HCKR", 0xFFFF90_xmem, [&](auto inst) { return 0; }, [&](auto value) {}},
+		reg<&SHI::readClockControlRegister, &SHI::writeClockControlRegister>(
+			pick("HCKR", "HCKR_1"), Base + 0x0),
 	};
 };
 }
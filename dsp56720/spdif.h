@@ -0,0 +1,487 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <mutex>
+#include <dsp56kEmu/dsp.h>
+#include "peripherals.h"
+#include "bitfield.h"
+#include "cgm.h"
+#include "dma.h"
+#include "esai.h"
+
+namespace dsp56720 {
+// S/PDIF transmitter and receiver. Frames move at the rates of the CGM
+// S/PDIF clocks, but the streams are only encoded, decoded and queued once
+// per 192-frame block: per frame the transmitter latches STL/STR and the
+// receiver presents the next decoded frame in SRL/SRR.
+//
+// The line is a stream of IEC 60958 subframes, one word each with the
+// preamble in bits 3:0 (B/Z 8, M/X 2, W/Y 4), the audio in bits 27:4 and
+// the validity, user, channel status and parity bits in bits 28-31. The
+// receiver takes a block from the subframe input when one is queued and
+// otherwise from the PCM input, which it frames with a consumer channel
+// status for the receive clock rate. With neither the receiver loses lock
+// for a block, unless the subframe input blocks.
+//
+// The endpoints are ESAI queue endpoints, so they share its policies and
+// VFS plumbing. Only a subset of the registers is modelled: there is no Q
+// channel, the user bits of the transmitter are zero and the receiver's
+// channel status comes from channel A.
+class SpdifTransceiver : public Peripheral {
+public:
+	using Output = EnhancedSerialAudioInterface::Output;
+	using Input = EnhancedSerialAudioInterface::Input;
+
+	static constexpr size_t blockFrames = 192;
+	static constexpr size_t blockWords = 2 * blockFrames;
+
+	// Channel status or user bits of a block, bit n of the block in bit
+	// n % 8 of byte n / 8
+	using Bits = std::array<uint8_t, blockFrames / 8>;
+
+	static constexpr dsp56k::TWord Vba_SPDIF_Receive = 0x68;
+	static constexpr dsp56k::TWord Vba_SPDIF_Transmit = 0x6a;
+	static constexpr dsp56k::TWord Vba_SPDIF_Status = 0x6c;
+
+	enum Preamble : uint32_t {
+		Preamble_B = 0x8, // Left, first frame of a block
+		Preamble_M = 0x2, // Left
+		Preamble_W = 0x4, // Right
+	};
+
+	struct SCR : BitField<dsp56k::TWord> {
+		using BitField<dsp56k::TWord>::operator=;
+
+		using TXSEL = Packed<2, 3>;     // Transmit source: 0 off, 1 receiver, 5 STL/STR
+		using VALCTRL = Bit<5>;         // Mark transmitted samples invalid
+		using DMA_TX_EN = Bit<8>;       // Transmit DMA Request Enable
+		using DMA_RX_EN = Bit<9>;       // Receive DMA Request Enable
+		using RXFIFO_OFF_ON = Bit<22>;  // Receiver off
+	};
+
+	// Layout shared by SIE, SIS and SIC
+	struct SIS : BitField<dsp56k::TWord> {
+		using BitField<dsp56k::TWord>::operator=;
+
+		using RxFIFOFul = Bit<0>;   // Receive frame in SRL/SRR
+		using TxEm = Bit<1>;        // Transmit frame wanted in STL/STR
+		using LockLoss = Bit<2>;    // Receiver lost block sync
+		using BitErr = Bit<14>;     // Parity error in the last block
+		using ValNoGood = Bit<16>;  // Validity bit set in the last block
+		using CNew = Bit<17>;       // Channel status changed
+		using TxUnOv = Bit<19>;     // Transmit frame not written in time
+		using Lock = Bit<20>;       // Receiver locked
+	};
+
+	static constexpr dsp56k::TWord TxSel_Off = 0;
+	static constexpr dsp56k::TWord TxSel_Receiver = 1;
+	static constexpr dsp56k::TWord TxSel_Normal = 5;
+
+	SpdifTransceiver(ClockGenerationModule& cgm) : m_cgm(cgm) {
+		reset();
+	}
+
+	virtual const char* name() const override { return "spdif"; }
+
+	virtual void exec() override {
+		const auto clock = getInstructionCounter();
+		const auto diff = dsp56k::delta(clock, m_lastClock);
+		m_lastClock = clock;
+
+		uint64_t coreRate = uint64_t(m_cgm.cyclesPerSample()) * m_cgm.sampleRate();
+
+		if (!SCR::RXFIFO_OFF_ON(m_scr)
+				&& m_rxClock.tick(diff, m_cgm.clockRate(ClockGenerationModule::Clock_SPDIF_Receive), coreRate)) {
+			receiveFrame();
+		}
+
+		if (SCR::TXSEL(m_scr) != TxSel_Off
+				&& m_txClock.tick(diff, m_cgm.clockRate(ClockGenerationModule::Clock_SPDIF_Transmit), coreRate)) {
+			transmitFrame();
+		}
+	}
+
+	virtual uint32_t idleCycles() override {
+		uint64_t coreRate = uint64_t(m_cgm.cyclesPerSample()) * m_cgm.sampleRate();
+		uint32_t cycles = unbounded;
+
+		if (!SCR::RXFIFO_OFF_ON(m_scr)) {
+			cycles = std::min(cycles, m_rxClock.idle(m_cgm.clockRate(ClockGenerationModule::Clock_SPDIF_Receive), coreRate));
+		}
+
+		if (SCR::TXSEL(m_scr) != TxSel_Off) {
+			cycles = std::min(cycles, m_txClock.idle(m_cgm.clockRate(ClockGenerationModule::Clock_SPDIF_Transmit), coreRate));
+		}
+
+		return cycles;
+	}
+
+	virtual void reset() override {
+		m_scr = SCR::RXFIFO_OFF_ON::Mask;
+		m_sie = 0;
+		m_sis = 0;
+		m_stc = 0;
+		m_stcsch = m_stcscl = 0;
+		m_rxFrame = m_txFrame = 0;
+	}
+
+	virtual void terminate() override {
+		m_tx.shutdown();
+		m_txPcm.shutdown();
+		m_rx.shutdown();
+		m_rxPcm.shutdown();
+	}
+
+	virtual RegisterTable registers() override { return Registers; }
+
+	// Encoded subframes sent by the transmitter
+	Output& transmitter() { return m_tx; }
+	// Samples sent by the transmitter, interleaved left and right
+	Output& transmitterPcm() { return m_txPcm; }
+	// Subframes for the receiver
+	Input& receiver() { return m_rx; }
+	// Samples for the receiver, interleaved left and right
+	Input& receiverPcm() { return m_rxPcm; }
+
+	// Channel status and user bits of the last complete blocks, safe to
+	// call from any thread
+	Bits transmitStatus() const { return copy(m_txStatusShown); }
+	Bits receiveStatus() const { return copy(m_rxStatusShown); }
+	Bits receiveUser() const { return copy(m_rxUserShown); }
+
+	// Blocks sent and received since startup, safe to call from any thread
+	uint64_t blocks() const { return m_blocks.load(std::memory_order_relaxed); }
+
+	dsp56k::TWord readSCR() { return m_scr; }
+	void writeSCR(dsp56k::TWord value) {
+		LOG("Write SPDIF SCR " << HEX(value) << " TXSEL=" << SCR::TXSEL(value));
+		m_scr = value;
+	}
+
+	// Receiver lock in bit 6, like the phase configuration register
+	dsp56k::TWord readSRPC() { return SIS::Lock(m_sis) ? 1 << 6 : 0; }
+
+	dsp56k::TWord readSIE() { return m_sie; }
+	void writeSIE(dsp56k::TWord value) { m_sie = value; }
+
+	dsp56k::TWord readSIS() { return m_sis; }
+
+	// The event flags are cleared by writing 1 to SIC
+	void writeSIC(dsp56k::TWord value) {
+		auto events = SIS::LockLoss::Mask | SIS::BitErr::Mask | SIS::ValNoGood::Mask
+			| SIS::CNew::Mask | SIS::TxUnOv::Mask;
+		m_sis = m_sis & ~(value & events);
+	}
+
+	dsp56k::TWord readSRL() { return m_rxPcmBlock[2 * m_rxShown]; }
+
+	// Reading the right channel completes the frame
+	dsp56k::TWord readSRR() {
+		m_sis = m_sis & ~SIS::RxFIFOFul::Mask;
+		clearInterrupt(Vba_SPDIF_Receive);
+		return m_rxPcmBlock[2 * m_rxShown + 1];
+	}
+
+	dsp56k::TWord readSRCSH() { return bytes(m_rxStatus, 0); }
+	dsp56k::TWord readSRCSL() { return bytes(m_rxStatus, 3); }
+	dsp56k::TWord readSRU() { return bytes(m_rxUser, 0); }
+
+	void writeSTL(dsp56k::TWord value) { m_stl = value & 0xffffff; }
+
+	// Writing the right channel completes the frame
+	void writeSTR(dsp56k::TWord value) {
+		m_str = value & 0xffffff;
+		m_sis = m_sis & ~SIS::TxEm::Mask;
+		clearInterrupt(Vba_SPDIF_Transmit);
+	}
+
+	dsp56k::TWord readSTCSCH() { return m_stcsch; }
+	void writeSTCSCH(dsp56k::TWord value) { m_stcsch = value; }
+	dsp56k::TWord readSTCSCL() { return m_stcscl; }
+	void writeSTCSCL(dsp56k::TWord value) { m_stcscl = value; }
+
+	// Measured receive frame rate, in Hz
+	dsp56k::TWord readSRFM() {
+		return SIS::Lock(m_sis) ? m_cgm.clockRate(ClockGenerationModule::Clock_SPDIF_Receive) & 0xffffff : 0;
+	}
+
+	dsp56k::TWord readSTC() { return m_stc; }
+	void writeSTC(dsp56k::TWord value) { m_stc = value; }
+
+	// Subframe with the given fields and even parity over bits 4-31
+	static uint32_t subframe(uint32_t preamble, dsp56k::TWord sample, bool v, bool u, bool c) {
+		uint32_t word = (sample & 0xffffff) << 4 | uint32_t(v) << 28 | uint32_t(u) << 29 | uint32_t(c) << 30;
+		return preamble | word | uint32_t(__builtin_parity(word)) << 31;
+	}
+
+	// Consumer channel status for linear 24-bit PCM at rate
+	static Bits consumerStatus(uint32_t rate) {
+		Bits status{};
+		switch (rate) {
+			case 44100: status[3] = 0x0; break;
+			case 48000: status[3] = 0x2; break;
+			case 32000: status[3] = 0x3; break;
+			case 88200: status[3] = 0x8; break;
+			case 96000: status[3] = 0xa; break;
+			case 176400: status[3] = 0xc; break;
+			case 192000: status[3] = 0xe; break;
+			default: status[3] = 0x1; break; // Not indicated
+		}
+
+		status[4] = 0x0b; // 24-bit words
+		return status;
+	}
+
+private:
+	// Frames due on a clock: the phase advances by rate per core cycle and
+	// a frame is due every coreRate
+	struct FrameClock {
+		uint64_t phase = 0;
+
+		bool tick(uint64_t cycles, uint64_t rate, uint64_t coreRate) {
+			phase += cycles * rate;
+			if (phase < coreRate) {
+				return false;
+			}
+
+			phase -= coreRate;
+			return true;
+		}
+
+		// Cycles that can pass before the one that makes a frame due
+		uint32_t idle(uint64_t rate, uint64_t coreRate) const {
+			if (!rate) {
+				return unbounded;
+			}
+
+			return phase < coreRate ? std::min<uint64_t>((coreRate - phase - 1) / rate, unbounded - 1) : 0;
+		}
+	};
+
+	static bool bit(const Bits& bits, size_t n) {
+		return bits[n / 8] >> (n % 8) & 1;
+	}
+
+	static void setBit(Bits& bits, size_t n, bool value) {
+		bits[n / 8] = (bits[n / 8] & ~(1 << (n % 8))) | int(value) << (n % 8);
+	}
+
+	// Three bytes of a block as a register, the first in bits 23:16
+	static dsp56k::TWord bytes(const Bits& bits, size_t first) {
+		return dsp56k::TWord(bits[first]) << 16 | dsp56k::TWord(bits[first + 1]) << 8 | bits[first + 2];
+	}
+
+	Bits copy(const Bits& bits) const {
+		std::lock_guard<std::mutex> lock(m_shownMutex);
+		return bits;
+	}
+
+	static void encode(const dsp56k::TWord* pcm, const Bits& status, const Bits& user,
+			bool invalid, uint32_t* subframes) {
+		for (size_t f = 0; f < blockFrames; f++) {
+			bool c = bit(status, f);
+			bool u = bit(user, f);
+			subframes[2 * f] = subframe(f ? Preamble_M : Preamble_B, pcm[2 * f], invalid, u, c);
+			subframes[2 * f + 1] = subframe(Preamble_W, pcm[2 * f + 1], invalid, u, c);
+		}
+	}
+
+	void flag(dsp56k::TWord mask) {
+		// Raise the status interrupt for newly set enabled events only
+		if (mask & ~m_sis & m_sie) {
+			interrupt(Vba_SPDIF_Status);
+		}
+
+		m_sis = m_sis | mask;
+	}
+
+	void receiveFrame() {
+		if (m_rxFrame == 0) {
+			receiveBlock();
+		}
+
+		m_rxShown = m_rxFrame;
+		m_rxFrame = (m_rxFrame + 1) % blockFrames;
+
+		m_sis = m_sis | SIS::RxFIFOFul::Mask;
+		if (SIS::RxFIFOFul(m_sie)) {
+			interrupt(Vba_SPDIF_Receive);
+		}
+
+		if (SCR::DMA_RX_EN(m_scr)) {
+			dmaRequest(DmaRequest_SPDIF_Receive);
+		}
+	}
+
+	void receiveBlock() {
+		// Subframes when a whole block is queued, else PCM. Without either
+		// only a blocking subframe input is read: padding a partial block
+		// would shift the preambles of every block after it, so it stays
+		// queued and the block is lost.
+		if (m_rx.fill() < blockWords && m_rxPcm.fill() >= blockWords) {
+			m_rxPcm.pop(m_rxPcmBlock.data(), blockWords);
+			auto status = consumerStatus(m_cgm.clockRate(ClockGenerationModule::Clock_SPDIF_Receive));
+			encode(m_rxPcmBlock.data(), status, Bits{}, false, m_rxBlock.data());
+		} else if (m_rx.fill() < blockWords && m_rx.policy() != Policy::Block) {
+			count(m_rx.m_underruns, blockWords);
+			m_rxBlock.fill(0);
+		} else {
+			m_rx.pop(m_rxBlock.data(), blockWords);
+		}
+
+		Bits status{}, user{};
+		bool locked = true, parity = false, valid = true;
+
+		for (size_t f = 0; f < blockFrames; f++) {
+			auto left = m_rxBlock[2 * f];
+			auto right = m_rxBlock[2 * f + 1];
+
+			locked &= (left & 0xf) == (f ? Preamble_M : Preamble_B) && (right & 0xf) == Preamble_W;
+			parity |= __builtin_parity(left >> 4) || __builtin_parity(right >> 4);
+			valid &= !(left >> 28 & 1) && !(right >> 28 & 1);
+
+			setBit(status, f, left >> 30 & 1);
+			setBit(user, f, left >> 29 & 1);
+			m_rxPcmBlock[2 * f] = left >> 4 & 0xffffff;
+			m_rxPcmBlock[2 * f + 1] = right >> 4 & 0xffffff;
+		}
+
+		count(m_blocks);
+
+		if (!locked) {
+			// Without block sync there is no audio
+			m_rxPcmBlock.fill(0);
+			if (SIS::Lock(m_sis)) {
+				m_sis = m_sis & ~SIS::Lock::Mask;
+				flag(SIS::LockLoss::Mask);
+			}
+
+			return;
+		}
+
+		dsp56k::TWord events = SIS::Lock::Mask;
+		if (parity) {
+			events |= SIS::BitErr::Mask;
+		}
+
+		if (!valid) {
+			events |= SIS::ValNoGood::Mask;
+		}
+
+		if (status != m_rxStatus) {
+			events |= SIS::CNew::Mask;
+		}
+
+		m_rxStatus = status;
+		m_rxUser = user;
+		flag(events);
+
+		std::lock_guard<std::mutex> lock(m_shownMutex);
+		m_rxStatusShown = status;
+		m_rxUserShown = user;
+	}
+
+	void transmitFrame() {
+		if (SIS::TxEm(m_sis)) {
+			// The previous frame wasn't written, it is sent again
+			flag(SIS::TxUnOv::Mask);
+		}
+
+		m_txPcmBlock[2 * m_txFrame] = m_stl;
+		m_txPcmBlock[2 * m_txFrame + 1] = m_str;
+
+		if (++m_txFrame == blockFrames) {
+			m_txFrame = 0;
+			transmitBlock();
+		}
+
+		m_sis = m_sis | SIS::TxEm::Mask;
+		if (SIS::TxEm(m_sie)) {
+			interrupt(Vba_SPDIF_Transmit);
+		}
+
+		if (SCR::DMA_TX_EN(m_scr)) {
+			dmaRequest(DmaRequest_SPDIF_Transmit);
+		}
+	}
+
+	void transmitBlock() {
+		if (SCR::TXSEL(m_scr) == TxSel_Receiver) {
+			// Feed-through sends the last received block unchanged
+			m_txBlock = m_rxBlock;
+			m_txPcmBlock = m_rxPcmBlock;
+		} else {
+			Bits status{};
+			status[0] = m_stcsch >> 16;
+			status[1] = m_stcsch >> 8;
+			status[2] = m_stcsch;
+			status[3] = m_stcscl >> 16;
+			status[4] = m_stcscl >> 8;
+			status[5] = m_stcscl;
+
+			encode(m_txPcmBlock.data(), status, Bits{}, SCR::VALCTRL(m_scr), m_txBlock.data());
+
+			std::lock_guard<std::mutex> lock(m_shownMutex);
+			m_txStatusShown = status;
+		}
+
+		m_tx.push(m_txBlock.data(), blockWords);
+		m_txPcm.push(m_txPcmBlock.data(), blockWords);
+		count(m_blocks);
+	}
+
+	ClockGenerationModule& m_cgm;
+
+	Output m_tx, m_txPcm;
+	Input m_rx, m_rxPcm;
+
+	SCR m_scr{};
+	SIS m_sie{};
+	SIS m_sis{};
+	dsp56k::TWord m_stc = 0;
+	dsp56k::TWord m_stcsch = 0, m_stcscl = 0;
+	dsp56k::TWord m_stl = 0, m_str = 0;
+
+	FrameClock m_rxClock, m_txClock;
+	dsp56k::TInstructionCount m_lastClock = 0;
+
+	// Blocks being sent and received, PCM interleaved
+	std::array<uint32_t, blockWords> m_txBlock{}, m_rxBlock{};
+	std::array<dsp56k::TWord, blockWords> m_txPcmBlock{}, m_rxPcmBlock{};
+	size_t m_txFrame = 0;
+	size_t m_rxFrame = 0;
+	size_t m_rxShown = 0; // Frame in SRL/SRR
+
+	Bits m_rxStatus{}, m_rxUser{};
+
+	// Copies for other threads, updated once per block
+	mutable std::mutex m_shownMutex;
+	Bits m_txStatusShown{}, m_rxStatusShown{}, m_rxUserShown{};
+
+	std::atomic<uint64_t> m_blocks{0};
+
+	using SPDIF = SpdifTransceiver;
+
+	static constexpr Address Base = 0xFFFF70_ymem;
+
+	static constexpr Register Registers[] = {
+		reg<&SPDIF::readSCR, &SPDIF::writeSCR>("SCR", Base + 0x00),
+		reg<&SPDIF::readSRPC, nullptr>("SRPC", Base + 0x02),
+		reg<&SPDIF::readSIE, &SPDIF::writeSIE>("SIE", Base + 0x03),
+		reg<&SPDIF::readSIS, &SPDIF::writeSIC>("SIS", Base + 0x04),
+		reg<&SPDIF::readSRL, nullptr>("SRL", Base + 0x05),
+		reg<&SPDIF::readSRR, nullptr>("SRR", Base + 0x06),
+		reg<&SPDIF::readSRCSH, nullptr>("SRCSH", Base + 0x07),
+		reg<&SPDIF::readSRCSL, nullptr>("SRCSL", Base + 0x08),
+		reg<&SPDIF::readSRU, nullptr>("SRU", Base + 0x09),
+		reg<nullptr, &SPDIF::writeSTL>("STL", Base + 0x0B),
+		reg<nullptr, &SPDIF::writeSTR>("STR", Base + 0x0C),
+		reg<&SPDIF::readSTCSCH, &SPDIF::writeSTCSCH>("STCSCH", Base + 0x0D),
+		reg<&SPDIF::readSTCSCL, &SPDIF::writeSTCSCL>("STCSCL", Base + 0x0E),
+		reg<&SPDIF::readSRFM, nullptr>("SRFM", Base + 0x11),
+		reg<&SPDIF::readSTC, &SPDIF::writeSTC>("STC", Base + 0x14),
+	};
+};
+}
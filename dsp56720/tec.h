@@ -0,0 +1,294 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <dsp56kEmu/dsp.h>
+#include "peripherals.h"
+#include "bitfield.h"
+
+namespace dsp56720 {
+// Triple timer module. Counters aren't ticked: each timer keeps the cycle
+// it was loaded at and the cycles at which it next reaches its compare
+// value and overflows, so exec() is a single comparison while no timer is
+// due. Only the timer modes are modelled, the counters ignore the TIO pins
+// and the prescaler always runs from the internal clock.
+class TripleTimer : public Peripheral {
+public:
+	static constexpr size_t timers = 3;
+
+	// Timer n interrupts at VBA:$24 + 4n on compare and VBA:$26 + 4n on
+	// overflow
+	static constexpr dsp56k::TWord Vba_Timer0_Compare = 0x24;
+	static constexpr dsp56k::TWord Vba_Timer0_Overflow = 0x26;
+
+	struct TCSR : BitField<dsp56k::TWord> {
+		using BitField<dsp56k::TWord>::operator=;
+
+		using TE = Bit<0>;        // Timer Enable
+		using TOIE = Bit<1>;      // Timer Overflow Interrupt Enable
+		using TCIE = Bit<2>;      // Timer Compare Interrupt Enable
+		using TC = Packed<4, 4>;  // Timer Control (mode)
+		using INV = Bit<8>;       // Inverter
+		using TRM = Bit<9>;       // Timer Reload Mode
+		using DIR = Bit<11>;      // Direction
+		using DI = Bit<12>;       // Data Input
+		using DO = Bit<13>;       // Data Output
+		using PCE = Bit<15>;      // Prescaler Clock Enable
+		using TOF = Bit<20>;      // Timer Overflow Flag
+		using TCF = Bit<21>;      // Timer Compare Flag
+	};
+
+	struct TPLR : BitField<dsp56k::TWord> {
+		using BitField<dsp56k::TWord>::operator=;
+
+		using PL = Packed<0, 21>; // Prescaler Preload Value
+		using PS = Packed<21, 2>; // Prescaler Source
+	};
+
+	virtual const char* name() const override { return "tec"; }
+
+	virtual void exec() override {
+		sync();
+		while (m_now >= m_next) {
+			for (auto& timer : m_timers) {
+				if (TCSR::TE(timer.tcsr) && timer.next() <= m_now) {
+					expire(timer);
+				}
+			}
+
+			schedule();
+		}
+	}
+
+	virtual uint32_t idleCycles() override {
+		sync();
+		if (m_next == never) {
+			return unbounded;
+		}
+
+		// The event is seen by the exec() after the next instruction
+		return m_next > m_now ? std::min<uint64_t>(m_next - m_now - 1, unbounded - 1) : 0;
+	}
+
+	virtual void reset() override {
+		for (auto& timer : m_timers) {
+			timer = Timer{};
+		}
+
+		m_tplr = 0;
+		schedule();
+	}
+
+	virtual void terminate() override {}
+	virtual RegisterTable registers() override { return Registers; }
+
+	// Cycle at which the next timer event is due, UINT64_MAX if none
+	uint64_t nextEvent() const { return m_next; }
+
+	// Timer events since startup, safe to call from any thread
+	uint64_t events() const { return m_events.load(std::memory_order_relaxed); }
+
+	template <int T> dsp56k::TWord readTCSR() {
+		return m_timers[T].tcsr;
+	}
+
+	template <int T> void writeTCSR(dsp56k::TWord value) {
+		sync();
+		auto& timer = m_timers[T];
+		bool wasEnabled = TCSR::TE(timer.tcsr);
+
+		// The status flags are cleared by writing 1
+		auto status = TCSR::TOF::Mask | TCSR::TCF::Mask;
+		timer.tcsr = (value & ~status) | (timer.tcsr & status & ~value);
+
+		if (TCSR::TE(timer.tcsr) && !wasEnabled) {
+			load(timer, m_now, timer.tlr);
+		} else if (TCSR::TE(timer.tcsr) && timer.period != period(timer)) {
+			load(timer, m_now, timer.count(m_now));
+		} else if (!TCSR::TE(timer.tcsr) && wasEnabled) {
+			timer.hold = timer.count(m_now);
+		}
+
+		update(timer);
+	}
+
+	template <int T> dsp56k::TWord readTLR() { return m_timers[T].tlr; }
+
+	template <int T> void writeTLR(dsp56k::TWord value) {
+		m_timers[T].tlr = value & mask;
+	}
+
+	template <int T> dsp56k::TWord readTCPR() { return m_timers[T].tcpr; }
+
+	template <int T> void writeTCPR(dsp56k::TWord value) {
+		sync();
+		m_timers[T].tcpr = value & mask;
+		update(m_timers[T]);
+	}
+
+	template <int T> dsp56k::TWord readTCR() {
+		sync();
+		auto& timer = m_timers[T];
+		return TCSR::TE(timer.tcsr) ? timer.count(m_now) : timer.hold;
+	}
+
+	dsp56k::TWord readTPLR() { return m_tplr; }
+
+	void writeTPLR(dsp56k::TWord value) {
+		sync();
+		m_tplr = value;
+		m_prescalerStart = m_now;
+
+		// Timers keep their count across the change of rate
+		for (auto& timer : m_timers) {
+			if (TCSR::TE(timer.tcsr)) {
+				load(timer, m_now, timer.count(m_now));
+				update(timer);
+			}
+		}
+	}
+
+	dsp56k::TWord readTPCR() {
+		sync();
+		dsp56k::TWord preload = TPLR::PL(m_tplr);
+		return preload - ((m_now - m_prescalerStart) / 2) % (preload + 1);
+	}
+
+private:
+	static constexpr dsp56k::TWord mask = 0xffffff;
+	static constexpr uint64_t never = UINT64_MAX;
+
+	struct Timer {
+		TCSR tcsr{};
+		dsp56k::TWord tlr = 0;
+		dsp56k::TWord tcpr = 0;
+
+		// The counter reads base at start and advances every period cycles;
+		// before start it reads hold
+		uint64_t start = 0;
+		dsp56k::TWord base = 0;
+		dsp56k::TWord hold = 0;
+		uint64_t period = 2;
+
+		uint64_t compareAt = never;
+		uint64_t overflowAt = never;
+
+		dsp56k::TWord count(uint64_t now) const {
+			if (now < start) {
+				return hold;
+			}
+
+			return (base + (now - start) / period) & mask;
+		}
+
+		// First cycle after now at which the counter counts to value. Being
+		// loaded with value doesn't count.
+		uint64_t reach(dsp56k::TWord value, uint64_t now) const {
+			uint64_t elapsed = now < start ? 0 : (now - start) / period;
+			uint64_t ticks = (value - (base + elapsed)) & mask;
+			return start + (elapsed + (ticks ? ticks : mask + 1)) * period;
+		}
+
+		uint64_t next() const { return std::min(compareAt, overflowAt); }
+	};
+
+	// Advance the 64-bit cycle count from the core's wrapping counter
+	void sync() {
+		const auto clock = getInstructionCounter();
+		m_now += dsp56k::delta(clock, m_lastClock);
+		m_lastClock = clock;
+	}
+
+	uint64_t period(const Timer& timer) const {
+		// Timers count at CLK/2, or once per prescaler cycle
+		return TCSR::PCE(timer.tcsr) ? 2 * (uint64_t(TPLR::PL(m_tplr)) + 1) : 2;
+	}
+
+	void load(Timer& timer, uint64_t when, dsp56k::TWord value) {
+		timer.start = when;
+		timer.base = value;
+		timer.hold = value;
+		timer.period = period(timer);
+	}
+
+	void update(Timer& timer) {
+		if (TCSR::TE(timer.tcsr)) {
+			timer.compareAt = timer.reach(timer.tcpr, m_now);
+			timer.overflowAt = timer.reach(0, m_now);
+		} else {
+			timer.compareAt = timer.overflowAt = never;
+		}
+
+		schedule();
+	}
+
+	void schedule() {
+		m_next = never;
+		for (auto& timer : m_timers) {
+			m_next = std::min(m_next, timer.next());
+		}
+	}
+
+	void expire(Timer& timer) {
+		auto n = &timer - m_timers.data();
+		auto when = timer.next();
+		count(m_events);
+
+		if (timer.compareAt == when) {
+			timer.tcsr |= TCSR::TCF(1);
+			if (TCSR::TCIE(timer.tcsr)) {
+				interrupt(Vba_Timer0_Compare + 4 * n);
+			}
+
+			// Reload on the timer clock following the compare
+			if (TCSR::TRM(timer.tcsr)) {
+				timer.hold = timer.tcpr;
+				timer.start = when + timer.period;
+				timer.base = timer.tlr;
+			}
+		}
+
+		if (timer.overflowAt == when) {
+			timer.tcsr |= TCSR::TOF(1);
+			if (TCSR::TOIE(timer.tcsr)) {
+				interrupt(Vba_Timer0_Overflow + 4 * n);
+			}
+		}
+
+		timer.compareAt = timer.reach(timer.tcpr, when);
+		timer.overflowAt = timer.reach(0, when);
+	}
+
+	std::array<Timer, timers> m_timers{};
+	TPLR m_tplr{};
+	uint64_t m_prescalerStart = 0;
+
+	uint64_t m_now = 0;
+	dsp56k::TInstructionCount m_lastClock = 0;
+	uint64_t m_next = never;
+	std::atomic<uint64_t> m_events{0};
+
+	using TEC = TripleTimer;
+
+	static constexpr Register Registers[] = {
+		reg<&TEC::readTCSR<0>, &TEC::writeTCSR<0>>("TCSR0", 0xFFFF8F_xmem),
+		reg<&TEC::readTLR<0>, &TEC::writeTLR<0>>("TLR0", 0xFFFF8E_xmem),
+		reg<&TEC::readTCPR<0>, &TEC::writeTCPR<0>>("TCPR0", 0xFFFF8D_xmem),
+		reg<&TEC::readTCR<0>, nullptr>("TCR0", 0xFFFF8C_xmem),
+
+		reg<&TEC::readTCSR<1>, &TEC::writeTCSR<1>>("TCSR1", 0xFFFF8B_xmem),
+		reg<&TEC::readTLR<1>, &TEC::writeTLR<1>>("TLR1", 0xFFFF8A_xmem),
+		reg<&TEC::readTCPR<1>, &TEC::writeTCPR<1>>("TCPR1", 0xFFFF89_xmem),
+		reg<&TEC::readTCR<1>, nullptr>("TCR1", 0xFFFF88_xmem),
+
+		reg<&TEC::readTCSR<2>, &TEC::writeTCSR<2>>("TCSR2", 0xFFFF87_xmem),
+		reg<&TEC::readTLR<2>, &TEC::writeTLR<2>>("TLR2", 0xFFFF86_xmem),
+		reg<&TEC::readTCPR<2>, &TEC::writeTCPR<2>>("TCPR2", 0xFFFF85_xmem),
+		reg<&TEC::readTCR<2>, nullptr>("TCR2", 0xFFFF84_xmem),
+
+		reg<&TEC::readTPLR, &TEC::writeTPLR>("TPLR", 0xFFFF83_xmem),
+		reg<&TEC::readTPCR, nullptr>("TPCR", 0xFFFF82_xmem),
+	};
+};
+}
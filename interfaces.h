@@ -0,0 +1,444 @@
+#pragma once
+
+#include <limits.h>
+#include <cstring>
+#include <cstdarg>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "dsp56720/esai.h"
+#include "dsp56720/shi.h"
+#include "dsp56720/inspector.h"
+#include "dsp56720/audiofile.h"
+#include "vfs/filesystem.h"
+#include "vfs/traits.h"
+
+class PinInterface : public vfs::File {
+public:
+	PinInterface(std::atomic<bool>& value, dsp56720::Doorbell* doorbell = nullptr)
+		: m_value(value), m_doorbell(doorbell) {}
+
+	virtual std::size_t size() {
+		return 1;
+	}
+
+	virtual std::size_t read(char *buf, std::size_t count, std::size_t pos) override {
+		if (pos > 0) {
+			return 0;
+		}
+
+		if (!count) {
+			return 0;
+		}
+
+		if (count > 1) {
+			count = 1;
+		}
+
+		*buf = m_value + '0';
+		return 1;
+	}
+
+	virtual std::size_t write(const char *buf, std::size_t count, std::size_t pos) override {
+		if (pos > 0) {
+			return 0;
+		}
+
+		if (!count) {
+			return 0;
+		}
+
+		if (*buf != '0' && *buf != '1') {
+			return -EIO;
+		}
+
+		m_value = *buf == '1';
+		if (m_doorbell) {
+			m_doorbell->ring();
+		}
+
+		return count;
+	}
+
+private:
+	std::atomic<bool>& m_value;
+	dsp56720::Doorbell* m_doorbell;
+};
+
+// Read-only file whose contents are generated when read from the start.
+// Reads further in come from that snapshot, so a large file read in chunks
+// isn't torn and is generated once per pass. The size is that of the last
+// snapshot, since generating can be slow and files are opened with direct
+// I/O, so reads aren't clamped to it.
+class TextInterface : public vfs::File {
+public:
+	TextInterface(std::function<std::string()> generate) : m_generate(generate) {}
+
+	virtual std::size_t size() {
+		std::lock_guard<std::mutex> lock(m_last->mutex);
+		return m_last->text.size();
+	}
+
+	virtual std::size_t read(char *buf, std::size_t count, std::size_t pos) override {
+		std::lock_guard<std::mutex> lock(m_last->mutex);
+		if (!pos) {
+			m_last->text = m_generate();
+		}
+
+		auto& text = m_last->text;
+		if (pos >= text.size()) {
+			return 0;
+		}
+
+		count = std::min(count, text.size() - pos);
+		memcpy(buf, text.data() + pos, count);
+		return count;
+	}
+
+	virtual std::size_t write(const char *buf, std::size_t count, std::size_t pos) override {
+		return -EACCES;
+	}
+
+private:
+	struct Last {
+		std::mutex mutex;
+		std::string text;
+	};
+
+	std::function<std::string()> m_generate;
+	std::shared_ptr<Last> m_last = std::make_shared<Last>();
+};
+
+// Seekable view of a memory area, one little-endian 32-bit word per DSP word
+class MemoryInterface : public vfs::File {
+public:
+	MemoryInterface(dsp56k::Memory& memory, const dsp56720::MemoryImage& image,
+			dsp56k::TWord bridge, dsp56k::EMemArea area, dsp56k::TWord words)
+		: m_memory(memory), m_image(image), m_bridge(bridge), m_area(area), m_words(words) {}
+
+	virtual std::size_t size() {
+		return m_words * sizeof(uint32_t);
+	}
+
+	virtual std::size_t read(char *buf, std::size_t count, std::size_t pos) override {
+		auto first = pos / sizeof(uint32_t);
+		if (pos % sizeof(uint32_t) || first >= m_words) {
+			return 0;
+		}
+
+		auto words = std::min(count / sizeof(uint32_t), m_words - first);
+		dsp56720::readMemory(m_memory, m_image, m_bridge, m_area, first,
+				reinterpret_cast<uint32_t*>(buf), words);
+
+		return words * sizeof(uint32_t);
+	}
+
+	virtual std::size_t write(const char *buf, std::size_t count, std::size_t pos) override {
+		return -EACCES;
+	}
+
+private:
+	dsp56k::Memory& m_memory;
+	const dsp56720::MemoryImage& m_image;
+	dsp56k::TWord m_bridge;
+	dsp56k::EMemArea m_area;
+	size_t m_words;
+};
+
+// Control file for the overrun/underrun policy of a queue endpoint
+template <typename Endpoint>
+class PolicyInterface : public vfs::File {
+public:
+	PolicyInterface(Endpoint& endpoint) : m_endpoint(endpoint) {}
+
+	virtual std::size_t size() {
+		return text().size();
+	}
+
+	virtual std::size_t read(char *buf, std::size_t count, std::size_t pos) override {
+		auto value = text();
+		if (pos >= value.size()) {
+			return 0;
+		}
+
+		count = std::min(count, value.size() - pos);
+		memcpy(buf, value.data() + pos, count);
+		return count;
+	}
+
+	virtual std::size_t write(const char *buf, std::size_t count, std::size_t pos) override {
+		std::string name(buf, count);
+		while (!name.empty() && isspace(name.back())) {
+			name.pop_back();
+		}
+
+		// Connected endpoints refuse to block
+		dsp56720::Policy policy;
+		if (!dsp56720::parsePolicy(name, policy) || !m_endpoint.setPolicy(policy)) {
+			return -EINVAL;
+		}
+
+		return count;
+	}
+
+private:
+	std::string text() {
+		return std::string(dsp56720::policyName(m_endpoint.policy())) + "\n";
+	}
+
+	Endpoint& m_endpoint;
+};
+
+// Control file for the queue depth of an endpoint. Writes are rounded up to a
+// power of two.
+template <typename Endpoint>
+class DepthInterface : public vfs::File {
+public:
+	DepthInterface(Endpoint& endpoint) : m_endpoint(endpoint) {}
+
+	virtual std::size_t size() {
+		return text().size();
+	}
+
+	virtual std::size_t read(char *buf, std::size_t count, std::size_t pos) override {
+		auto value = text();
+		if (pos >= value.size()) {
+			return 0;
+		}
+
+		count = std::min(count, value.size() - pos);
+		memcpy(buf, value.data() + pos, count);
+		return count;
+	}
+
+	virtual std::size_t write(const char *buf, std::size_t count, std::size_t pos) override {
+		std::string text(buf, count);
+		char* end;
+		auto depth = strtoul(text.c_str(), &end, 0);
+		while (isspace(*end)) {
+			end++;
+		}
+
+		if (*end || !depth || depth > dsp56720::maxQueueCapacity) {
+			return -EINVAL;
+		}
+
+		m_endpoint.setCapacity(depth);
+		return count;
+	}
+
+private:
+	std::string text() {
+		return std::to_string(m_endpoint.capacity()) + "\n";
+	}
+
+	Endpoint& m_endpoint;
+};
+
+// Control file for a file sink or source. Writing a path starts streaming,
+// writing an empty line stops it.
+template <typename Stream>
+class AudioFileInterface : public vfs::File {
+public:
+	AudioFileInterface(Stream& stream) : m_stream(stream) {}
+
+	virtual std::size_t size() {
+		return text().size();
+	}
+
+	virtual std::size_t read(char *buf, std::size_t count, std::size_t pos) override {
+		auto value = text();
+		if (pos >= value.size()) {
+			return 0;
+		}
+
+		count = std::min(count, value.size() - pos);
+		memcpy(buf, value.data() + pos, count);
+		return count;
+	}
+
+	virtual std::size_t write(const char *buf, std::size_t count, std::size_t pos) override {
+		std::string path(buf, count);
+		while (!path.empty() && isspace(path.back())) {
+			path.pop_back();
+		}
+
+		if (path.empty()) {
+			m_stream.close();
+		} else if (!m_stream.open(path)) {
+			return -EIO;
+		}
+
+		return count;
+	}
+
+private:
+	std::string text() {
+		auto path = m_stream.path();
+		return path.empty() ? "" : path + "\n";
+	}
+
+	Stream& m_stream;
+};
+
+template <>
+struct vfs::SequentialAccess<dsp56720::EnhancedSerialAudioInterface::Input> {
+	static constexpr bool readable = false;
+	static constexpr bool writable = true;
+
+	void write(dsp56720::EnhancedSerialAudioInterface::Input& input, uint32_t sample) {
+		try {
+			input.writeSample(sample);
+		} catch(dsp56720::QueueShutdown&) {
+			throw vfs::Abort{};
+		}
+	}
+
+	void writeBlock(dsp56720::EnhancedSerialAudioInterface::Input& input, const uint32_t* samples, size_t count) {
+		try {
+			input.writeSamples(samples, count);
+		} catch(dsp56720::QueueShutdown&) {
+			throw vfs::Abort{};
+		}
+	}
+
+	size_t writeAvailable(dsp56720::EnhancedSerialAudioInterface::Input& input) {
+		auto fill = input.fill();
+		return fill < input.capacity() ? input.capacity() - fill : 0;
+	}
+
+	void watch(dsp56720::EnhancedSerialAudioInterface::Input& input, std::function<void(unsigned)> handler) {
+		input.watch([handler](unsigned edges) {
+			if (edges & dsp56720::QueueEdge_NotFull) {
+				handler(vfs::Event_Writable);
+			}
+		});
+	}
+};
+
+template <>
+struct vfs::SequentialAccess<dsp56720::EnhancedSerialAudioInterface::Output> {
+	static constexpr bool readable = true;
+	static constexpr bool writable = false;
+
+	uint32_t read(dsp56720::EnhancedSerialAudioInterface::Output& output) {
+		try {
+			return output.readSample();
+		} catch(dsp56720::QueueShutdown&) {
+			throw vfs::Abort{};
+		}
+	}
+
+	size_t readAvailable(dsp56720::EnhancedSerialAudioInterface::Output& output) {
+		return output.fill();
+	}
+
+	void watch(dsp56720::EnhancedSerialAudioInterface::Output& output, std::function<void(unsigned)> handler) {
+		output.watch([handler](unsigned edges) {
+			if (edges & dsp56720::QueueEdge_NotEmpty) {
+				handler(vfs::Event_Readable);
+			}
+		});
+	}
+};
+
+template <>
+struct vfs::SequentialAccess<dsp56720::SerialHostInterace> {
+	static constexpr bool readable = true;
+	static constexpr bool writable = true;
+
+	dsp56k::TWord read(dsp56720::SerialHostInterace& shi) {
+		try {
+			return shi.readTX();
+		} catch(dsp56720::QueueShutdown&) {
+			throw vfs::Abort{};
+		}
+	}
+
+	void write(dsp56720::SerialHostInterace& shi, dsp56k::TWord value) {
+		try {
+			shi.writeRX(value);
+		} catch(dsp56720::QueueShutdown&) {
+			throw vfs::Abort{};
+		}
+	}
+
+	void readBlock(dsp56720::SerialHostInterace& shi, dsp56k::TWord* words, size_t count) {
+		try {
+			shi.readTX(words, count);
+		} catch(dsp56720::QueueShutdown&) {
+			throw vfs::Abort{};
+		}
+	}
+
+	void writeBlock(dsp56720::SerialHostInterace& shi, const dsp56k::TWord* words, size_t count) {
+		try {
+			shi.writeRX(words, count);
+		} catch(dsp56720::QueueShutdown&) {
+			throw vfs::Abort{};
+		}
+	}
+
+	size_t readAvailable(dsp56720::SerialHostInterace& shi) {
+		return shi.transmitted();
+	}
+
+	size_t writeAvailable(dsp56720::SerialHostInterace& shi) {
+		auto received = shi.received();
+		return received < shi.capacity() ? shi.capacity() - received : 0;
+	}
+
+	// The host reads TX and writes RX
+	void watch(dsp56720::SerialHostInterace& shi, std::function<void(unsigned)> handler) {
+		shi.watchTX([handler](unsigned edges) {
+			if (edges & dsp56720::QueueEdge_NotEmpty) {
+				handler(vfs::Event_Readable);
+			}
+		});
+
+		shi.watchRX([handler](unsigned edges) {
+			if (edges & dsp56720::QueueEdge_NotFull) {
+				handler(vfs::Event_Writable);
+			}
+		});
+	}
+};
+
+template <>
+struct vfs::SequentialAccess<dsp56720::SerialHostInterace::ByteStream> {
+	static constexpr bool readable = true;
+	static constexpr bool writable = true;
+
+	void readBlock(dsp56720::SerialHostInterace::ByteStream& stream, uint8_t* bytes, size_t count) {
+		try {
+			if (!stream.read(bytes, count)) {
+				throw vfs::IOError{};
+			}
+		} catch(dsp56720::QueueShutdown&) {
+			throw vfs::Abort{};
+		}
+	}
+
+	// Every write is a single transfer, i.e. one I2C transaction
+	void writeBlock(dsp56720::SerialHostInterace::ByteStream& stream, const uint8_t* bytes, size_t count) {
+		try {
+			if (!stream.write(bytes, count)) {
+				throw vfs::IOError{};
+			}
+		} catch(dsp56720::QueueShutdown&) {
+			throw vfs::Abort{};
+		}
+	}
+};
+
+inline std::string format(const char* format, ...) {
+	char buffer[PATH_MAX];
+	va_list args;
+	va_start(args, format);
+	vsnprintf(buffer, sizeof(buffer), format, args);
+	va_end(args);
+
+	return std::string(buffer, strnlen(buffer, sizeof(buffer)));
+}
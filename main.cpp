@@ -1,180 +1,353 @@
-#include <dsp56kEmu/dsp.h>
-#include <limits.h>
-#include <cstring>
 #include <csignal>
-#include <cstdarg>
+#include <cstring>
 #include <iostream>
+#include <memory>
+#include <system_error>
+#include <vector>
 
-#include "dsp56720/peripherals.h"
-#include "dsp56720/bitfield.h"
-#include "dsp56720/debugger.h"
-#include "dsp56720/shi.h"
-#include "dsp56720/esai.h"
-#include "dsp56720/cgm.h"
-#include "dsp56720/ccm.h"
-#include "dsp56720/chipid.h"
+#include "board.h"
+#include "chip.h"
+#include "dsp56720/scheduler.h"
 #include "vfs/filesystem.h"
-#include "vfs/traits.h"
 
-class PinInterface : public vfs::File {
-public:
-	PinInterface(std::atomic<bool>& value) : m_value(value) {}
+std::function<void(int)> g_signalHandler;
 
-	virtual std::size_t size() {
-		return 1;
+void signalHandler(int signal) {
+	if (g_signalHandler) {
+		g_signalHandler(signal);
 	}
+}
 
-	virtual std::size_t read(char *buf, std::size_t count, std::size_t pos) override {
-		if (pos > 0) {
-			return 0;
+// Parses "N" as a value for every instance, or "I=N" for instance I only
+template <typename T, typename Parse>
+bool parseInstanceOption(const std::string& text, std::vector<std::pair<int, T>>& values, Parse parse) {
+	auto split = text.find('=');
+	try {
+		if (split == std::string::npos) {
+			values.emplace_back(-1, parse(text));
+		} else {
+			values.emplace_back(std::stoi(text.substr(0, split)), parse(text.substr(split + 1)));
 		}
+	} catch (std::exception&) {
+		return false;
+	}
 
-		if (!count) {
-			return 0;
-		}
+	return true;
+}
 
-		if (count > 1) {
-			count = 1;
-		}
+// Parses "[CHIP:]N=PATH", the chip defaults to 0
+bool parseStreamOption(const std::string& text,
+		std::vector<std::pair<int, std::pair<size_t, std::string>>>& streams) {
+	auto split = text.find('=');
+	if (split == std::string::npos || split + 1 == text.size()) {
+		return false;
+	}
 
-		*buf = m_value + '0';
-		return 1;
+	auto endpoint = text.substr(0, split);
+	auto colon = endpoint.find(':');
+	try {
+		int chip = colon == std::string::npos ? 0 : std::stoi(endpoint.substr(0, colon));
+		size_t index = std::stoul(colon == std::string::npos ? endpoint : endpoint.substr(colon + 1));
+		streams.push_back({chip, {index, text.substr(split + 1)}});
+	} catch (std::exception&) {
+		return false;
 	}
 
-	virtual std::size_t write(const char *buf, std::size_t count, std::size_t pos) override {
-		if (pos > 0) {
-			return 0;
-		}
+	return true;
+}
 
-		if (!count) {
-			return 0;
-		}
+int main(int argc, char *argv[]) {
+	ChipConfig config;
+	int perfInterval = 10;
+	size_t chips = 1;
+	size_t workers = 0;
+	std::vector<std::pair<int, uint32_t>> quanta;
+	std::vector<std::pair<int, double>> budgets;
+	std::vector<std::string> connections;
+	std::vector<std::pair<int, std::pair<size_t, std::string>>> sinks, sources;
+	dsp56720::SymbolMap symbols;
+
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+
+		if (arg == "--debug-socket" && i + 1 < argc) {
+			config.debugSocket = argv[++i];
+		} else if (arg == "--perf-interval" && i + 1 < argc) {
+			try {
+				perfInterval = std::stoi(argv[++i]);
+			} catch (std::exception&) {
+				std::cerr << "Invalid perf-interval " << argv[i] << std::endl;
+				return 1;
+			}
+		} else if (arg == "--profile" && i + 1 < argc) {
+			try {
+				auto interval = std::stoul(argv[++i]);
+				if (!interval || interval > UINT32_MAX) {
+					throw std::out_of_range(argv[i]);
+				}
+
+				config.profileInterval = uint32_t(interval);
+			} catch (std::exception&) {
+				std::cerr << "Invalid profile " << argv[i] << std::endl;
+				return 1;
+			}
+		} else if (arg == "--esai-output-policy" && i + 1 < argc) {
+			if (!dsp56720::parsePolicy(argv[++i], config.outputPolicy)) {
+				std::cerr << "Unknown policy " << argv[i] << std::endl;
+				return 1;
+			}
+		} else if (arg == "--esai-input-policy" && i + 1 < argc) {
+			if (!dsp56720::parsePolicy(argv[++i], config.inputPolicy)) {
+				std::cerr << "Unknown policy " << argv[i] << std::endl;
+				return 1;
+			}
+		} else if (arg == "--pace" && i + 1 < argc) {
+			config.pace = argv[++i];
+			if (config.pace != "host" && config.pace != "consumer") {
+				std::cerr << "Unknown pacing mode " << config.pace << std::endl;
+				return 1;
+			}
+		} else if (arg == "--pace-target" && i + 1 < argc) {
+			// A fill level no queue can reach would never be held
+			try {
+				config.paceTarget = std::stoul(argv[++i]);
+				if (!config.paceTarget || config.paceTarget > dsp56720::maxQueueCapacity) {
+					throw std::out_of_range(argv[i]);
+				}
+			} catch (std::exception&) {
+				std::cerr << "Invalid pace-target " << argv[i] << std::endl;
+				return 1;
+			}
+		} else if ((arg == "--esai-depth" || arg == "--shi-depth") && i + 1 < argc) {
+			try {
+				auto& depth = arg == "--esai-depth" ? config.esaiDepth : config.shiDepth;
+				depth = std::stoul(argv[++i]);
+				if (!depth || depth > dsp56720::maxQueueCapacity) {
+					throw std::out_of_range(argv[i]);
+				}
+			} catch (std::exception&) {
+				std::cerr << "Invalid " << arg.substr(2) << " " << argv[i] << std::endl;
+				return 1;
+			}
+		} else if ((arg == "--chips" || arg == "--workers") && i + 1 < argc) {
+			// Without --workers there is one per chip up to the core count
+			try {
+				auto& count = arg == "--chips" ? chips : workers;
+				count = std::stoul(argv[++i]);
+				if (!count) {
+					throw std::out_of_range(argv[i]);
+				}
+			} catch (std::exception&) {
+				std::cerr << "Invalid " << arg.substr(2) << " " << argv[i] << std::endl;
+				return 1;
+			}
+		} else if (arg == "--quantum" && i + 1 < argc) {
+			if (!parseInstanceOption(argv[++i], quanta,
+					[](const std::string& s) { return uint32_t(std::stoul(s)); })) {
+				std::cerr << "Invalid quantum " << argv[i] << std::endl;
+				return 1;
+			}
+		} else if (arg == "--budget" && i + 1 < argc) {
+			if (!parseInstanceOption(argv[++i], budgets,
+					[](const std::string& s) { return std::stod(s); })) {
+				std::cerr << "Invalid budget " << argv[i] << std::endl;
+				return 1;
+			}
+		} else if ((arg == "--esai-record" || arg == "--esai-play") && i + 1 < argc) {
+			auto& streams = arg == "--esai-record" ? sinks : sources;
+			if (!parseStreamOption(argv[++i], streams)) {
+				std::cerr << "Invalid stream " << argv[i] << std::endl;
+				return 1;
+			}
+		} else if (arg == "--connect" && i + 1 < argc) {
+			connections.push_back(argv[++i]);
+		} else if (arg == "--clock" && i + 1 < argc) {
+			std::string text = argv[++i];
+			auto split = text.find('=');
+			uint32_t clock = 0;
+			while (clock < dsp56720::ClockGenerationModule::Clock_Count
+					&& text.substr(0, split) != dsp56720::ClockGenerationModule::clockName(clock)) {
+				clock++;
+			}
 
-		if (*buf == '0') {
-			m_value = 0;
-			return count;
-		} else if (*buf == '1') {
-			m_value = 1;
-			return count;
-		}
+			try {
+				if (split == std::string::npos || clock == dsp56720::ClockGenerationModule::Clock_Count) {
+					throw std::invalid_argument(text);
+				}
 
-		return -EIO;
+				config.clocks.emplace_back(clock, std::stoul(text.substr(split + 1)));
+			} catch (std::exception&) {
+				std::cerr << "Invalid clock " << text << std::endl;
+				return 1;
+			}
+		} else if ((arg == "--ext-base" || arg == "--ext-size") && i + 1 < argc) {
+			try {
+				auto& value = arg == "--ext-base" ? config.externalBase : config.externalSize;
+				auto parsed = std::stoul(argv[++i], nullptr, 0);
+				// Range check before narrowing, 2^32 + n would wrap to n
+				if (parsed > 0xffffff) {
+					throw std::out_of_range(argv[i]);
+				}
+
+				value = dsp56k::TWord(parsed);
+			} catch (std::exception&) {
+				std::cerr << "Invalid " << arg.substr(2) << " " << argv[i] << std::endl;
+				return 1;
+			}
+		} else if (arg == "--ext-file" && i + 1 < argc) {
+			config.externalFile = argv[++i];
+		} else if (arg == "--ext-timing") {
+			config.externalTiming = true;
+		} else if (arg == "--no-fast-forward") {
+			config.fastForward = false;
+		} else if (arg == "--no-park") {
+			config.park = false;
+		} else if (arg == "--cuse") {
+			config.cuse = true;
+		} else if (arg == "--profile-stacks") {
+			config.profileStacks = true;
+		} else if (arg == "--symbols" && i + 1 < argc) {
+			if (!symbols.load(argv[++i])) {
+				std::cerr << "Failed to load symbols from " << argv[i] << std::endl;
+				return 1;
+			}
+		} else {
+			std::cerr << "Usage: " << argv[0] << " [--debug-socket PATH]"
+				<< " [--perf-interval SECONDS] [--profile INSTRUCTIONS]"
+				<< " [--profile-stacks] [--symbols FILE]"
+				<< " [--esai-output-policy POLICY] [--esai-input-policy POLICY]"
+				<< " [--pace host|consumer] [--pace-target SAMPLES]"
+				<< " [--esai-depth SAMPLES] [--shi-depth WORDS]"
+				<< " [--chips N] [--workers N] [--cuse] [--no-fast-forward] [--no-park]"
+				<< " [--clock esai|esai1|spdif-rx|spdif-tx|ext=HZ]"
+				<< " [--ext-base ADDRESS] [--ext-size WORDS] [--ext-file PATH] [--ext-timing]"
+				<< " [--quantum [CHIP=]INSTRUCTIONS] [--budget [CHIP=]CORES]"
+				<< " [--connect CHIP:outputN=CHIP:inputN|CHIP:shiN=CHIP:shiN]"
+				<< " [--esai-record [CHIP:]N=FILE] [--esai-play [CHIP:]N=FILE]" << std::endl;
+			return 1;
+		}
 	}
 
-private:
-	std::atomic<bool>& m_value;
-};
-
-std::function<void(int)> g_signalHandler;
+	// Memory ends below the on-chip I/O space
+	if (!config.externalSize || config.memorySize() > 0xffff00
+			|| config.memorySize() < config.externalBase) {
+		std::cerr << "External memory doesn't fit the address space" << std::endl;
+		return 1;
+	}
 
-void signalHandler(int signal) {
-	if (g_signalHandler) {
-		g_signalHandler(signal);
+	if (!workers) {
+		workers = std::min<size_t>(chips, std::max(1u, std::thread::hardware_concurrency()));
 	}
-}
 
-template <>
-struct vfs::SequentialAccess<dsp56720::EnhancedSerialAudioInterface::Input> {
-	static constexpr bool readable = false;
-	static constexpr bool writable = true;
+	vfs::Filesystem fs("./mount");
 
-	void write(dsp56720::EnhancedSerialAudioInterface::Input& input, uint32_t sample) {
-		try {
-			input.writeSample(sample);
-		} catch(dsp56720::QueueShutdown&) {
-			throw vfs::Abort{};
+	std::atomic<bool> running{true};
+	std::mutex stopMutex;
+	std::condition_variable stopped;
+
+	// A single chip keeps the flat layout, several get /chipN each
+	std::vector<std::unique_ptr<Chip>> instances;
+	dsp56720::Scheduler scheduler{workers};
+
+	for (size_t n = 0; n < chips; n++) {
+		auto chipConfig = config;
+		if (chips > 1) {
+			chipConfig.prefix = "/chip" + std::to_string(n);
+			if (!config.debugSocket.empty()) {
+				chipConfig.debugSocket += "." + std::to_string(n);
+			}
+
+			if (!config.externalFile.empty()) {
+				chipConfig.externalFile += "." + std::to_string(n);
+			}
 		}
-	}
-};
 
-template <>
-struct vfs::SequentialAccess<dsp56720::EnhancedSerialAudioInterface::Output> {
-	static constexpr bool readable = true;
-	static constexpr bool writable = false;
+		for (auto& [chip, quantum] : quanta) {
+			if (chip < 0 || size_t(chip) == n) {
+				chipConfig.quantum = quantum;
+			}
+		}
 
-	uint32_t read(dsp56720::EnhancedSerialAudioInterface::Output& output) {
-		try {
-			return output.readSample();
-		} catch(dsp56720::QueueShutdown&) {
-			throw vfs::Abort{};
+		for (auto& [chip, budget] : budgets) {
+			if (chip < 0 || size_t(chip) == n) {
+				chipConfig.budget = budget;
+			}
 		}
-	}
-};
 
-template <>
-struct vfs::SequentialAccess<dsp56720::SerialHostInterace> {
-	static constexpr bool readable = true;
-	static constexpr bool writable = true;
+		for (auto& [chip, stream] : sinks) {
+			if (size_t(chip) == n) {
+				chipConfig.sinks.push_back(stream);
+			}
+		}
 
-	dsp56k::TWord read(dsp56720::SerialHostInterace& shi) {
-		try {
-			return shi.readTX();
-		} catch(dsp56720::QueueShutdown&) {
-			throw vfs::Abort{};
+		for (auto& [chip, stream] : sources) {
+			if (size_t(chip) == n) {
+				chipConfig.sources.push_back(stream);
+			}
 		}
-	}
 
-	void write(dsp56720::SerialHostInterace& shi, dsp56k::TWord value) {
 		try {
-			shi.writeRX(value);
-		} catch(dsp56720::QueueShutdown&) {
-			throw vfs::Abort{};
+			instances.push_back(std::make_unique<Chip>(fs, chipConfig, symbols));
+		} catch (std::system_error& e) {
+			std::cerr << "Can't create chip " << n << ": " << e.what() << std::endl;
+			for (auto& instance : instances) {
+				instance->shutdown();
+			}
+
+			return 1;
 		}
 	}
-};
-
-std::string format(const char* format, ...) {
-	char buffer[PATH_MAX];
-	va_list args;
-	va_start(args, format);
-	vsnprintf(buffer, sizeof(buffer), format, args);
-	va_end(args);
 
-	return std::string(buffer, strnlen(buffer, sizeof(buffer)));
-}
-
-int main(int argc, char *argv[]) {
-	vfs::Filesystem fs("./mount");
+	Board board{instances};
+	for (auto& connection : connections) {
+		if (!board.connect(connection)) {
+			std::cerr << "Invalid connection " << connection << std::endl;
+			for (auto& instance : instances) {
+				instance->shutdown();
+			}
 
-	std::atomic<bool> running{true};
-	std::atomic<bool> reset, moda0;
-
-	// TODO: Use a EnumInterface mapping '0' -> 0 and '1' -> 1
-	fs.tree().put("/pins/reset", PinInterface{reset});
-	fs.tree().put("/pins/moda0", PinInterface{moda0});
-
-	dsp56720::ClockGenerationModule cgm;
-	dsp56720::ChipConfigurationModule ccm;
-	dsp56720::SerialHostInterace shi0;
-	dsp56720::EnhancedSerialAudioInterface esai{cgm};
-	dsp56720::ChipIdentification chidr{0};
-	dsp56720::Debugger debugger{false};
-
-	for (size_t i = 0; i < esai.outputs(); i++) {
-		fs.tree().put(format("/peripherals/esai/output%d", i),
-				vfs::SequentialFile<uint32_t,
-					dsp56720::EnhancedSerialAudioInterface::Output>{
-						esai.output(i)});
+			return 1;
+		}
 	}
 
-	for (size_t i = 0; i < esai.inputs(); i++) {
-		fs.tree().put("/peripherals/esai/input" + std::to_string(i),
-				vfs::SequentialFile<uint32_t,
-					dsp56720::EnhancedSerialAudioInterface::Input>{
-						esai.input(i)});
+	for (auto& instance : instances) {
+		instance->start();
 	}
 
-	fs.tree().put("/peripherals/shi0",
-			vfs::SequentialFile<uint32_t, dsp56720::SerialHostInterace>{shi0});
+	for (auto& group : board.groups()) {
+		double budget = 0;
+		for (auto chip : group) {
+			budget += chip->config().budget;
+		}
 
-	dsp56720::Peripherals peripherals{cgm, ccm, shi0, esai, chidr};
+		// Every chip of a group advances one quantum per slice, so wired
+		// chips never drift apart by more than that. The group only parks
+		// once all of its chips wait for the host, and waits for the latest
+		// of its paced chips.
+		auto task = scheduler.add([group](auto& notBefore) {
+			using Result = dsp56720::Scheduler::Result;
+			bool ran = false, idle = false, paced = false, alive = false;
+
+			for (auto chip : group) {
+				auto result = chip->slice();
+				ran |= result == Result::Ran;
+				idle |= result == Result::Idle;
+				alive |= result != Result::Done;
+
+				if (result == Result::Paced) {
+					notBefore = paced ? std::max(notBefore, chip->resumeTime()) : chip->resumeTime();
+					paced = true;
+				}
+			}
 
-	constexpr dsp56k::TWord g_memorySize = 0xf80000;
-	const dsp56k::DefaultMemoryValidator memoryMap;
-	dsp56k::Memory memory(memoryMap, g_memorySize);
-	memory.setExternalMemory(0x020000, true);
+			return paced ? Result::Paced : ran ? Result::Ran : idle ? Result::Idle
+				: alive ? Result::Parked : Result::Done;
+		}, budget);
 
-	dsp56k::DSP dsp(memory, peripherals);
+		for (auto chip : group) {
+			chip->setWakeHandler([&scheduler, task]() { scheduler.wake(task); });
+		}
+	}
 
 	struct sigaction sa;
 	memset(&sa, 0, sizeof(struct sigaction));
@@ -186,45 +359,49 @@ int main(int argc, char *argv[]) {
 		return 1;
 	}
 
-	std::thread mainloop([&](){
-		try {
-			auto count = shi0.readRX();
-			auto address = shi0.readRX();
-
-			std::cout << "Booting count=" << count << " words to address=" << address
-				<< std::endl;
-
-			for (size_t i = 0; i < count; i++) {
-				auto word = shi0.readRX();
-				dsp.memory().set(dsp56k::MemArea_P, address + i, word);
-			}
-
-			dsp.setPC(address);
-
-			std::cout << "Booted" << std::endl;
-
-			while (running) {
-				debugger.exec(dsp);
-			}
-		} catch(dsp56720::QueueShutdown&) {
-			return;
-		}
-	});
+	scheduler.start();
 
 	g_signalHandler = [&](auto signal) {
 		std::cout << "INTERRUPTED!" << std::endl;
 
 		running = false;
-		dsp.terminate();
-
-		// Wake debugger threads to allow everything to terminate
-		debugger.continueExecution();
+		for (auto& instance : instances) {
+			instance->shutdown();
+		}
 
 		fs.shutdown();
 	};
 
+	std::thread perfLog;
+	if (perfInterval > 0) {
+		perfLog = std::thread([&]() {
+			std::unique_lock<std::mutex> lock(stopMutex);
+			while (running) {
+				if (!stopped.wait_for(lock, std::chrono::seconds(perfInterval),
+						[&]() { return !running; })) {
+					for (size_t n = 0; n < instances.size(); n++) {
+						std::cout << (chips > 1 ? "chip" + std::to_string(n) + " " : "")
+							<< instances[n]->summary() << std::endl;
+					}
+				}
+			}
+		});
+	}
+
 	int ret = fs.run();
-	mainloop.join();
+
+	// Also reached when the filesystem is unmounted externally
+	running = false;
+	for (auto& instance : instances) {
+		instance->shutdown();
+	}
+
+	scheduler.stop();
+
+	if (perfLog.joinable()) {
+		stopped.notify_all();
+		perfLog.join();
+	}
 
 	return ret;
 }
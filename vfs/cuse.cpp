@@ -0,0 +1,379 @@
+#define FUSE_USE_VERSION 35
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <poll.h>
+#include <stdexcept>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <vector>
+#include <cuse_lowlevel.h>
+
+#include "cuse.h"
+#include "ioctl.h"
+
+namespace {
+vfs::CharacterDevice& deviceOf(fuse_req_t req) {
+	return *reinterpret_cast<vfs::CharacterDevice*>(fuse_req_userdata(req));
+}
+
+bool nonBlocking(struct fuse_file_info* fi) {
+	return fi->flags & O_NONBLOCK;
+}
+
+// Bytes of a nonblocking transfer, short if fewer units are available
+size_t nonBlockingSize(size_t size, size_t unit, size_t available) {
+	return std::min(size / unit, available) * unit;
+}
+
+template <typename Fn>
+void replyIO(fuse_req_t req, Fn io, bool write) {
+	ssize_t result;
+	try {
+		result = io();
+	} catch (vfs::Abort&) {
+		fuse_reply_err(req, EINTR);
+		return;
+	} catch (vfs::IOError&) {
+		fuse_reply_err(req, EIO);
+		return;
+	}
+
+	if (result < 0) {
+		fuse_reply_err(req, -result);
+	} else if (write) {
+		fuse_reply_write(req, result);
+	}
+}
+
+template <typename T>
+void replyValue(fuse_req_t req, const T& value) {
+	fuse_reply_ioctl(req, 0, &value, sizeof(value));
+}
+}
+
+static void dsp56720_cuse_open(fuse_req_t req, struct fuse_file_info* fi) {
+	// Streams have no position and must bypass the page cache
+	fi->direct_io = 1;
+	fi->nonseekable = 1;
+	fuse_reply_open(req, fi);
+}
+
+static void dsp56720_cuse_read(fuse_req_t req, size_t size, off_t offset, struct fuse_file_info* fi) {
+	auto& stream = deviceOf(req).stream();
+	if (nonBlocking(fi)) {
+		size = nonBlockingSize(size, stream.bytesPerSample(), stream.readAvailable());
+		if (!size) {
+			fuse_reply_err(req, EAGAIN);
+			return;
+		}
+	}
+
+	thread_local std::vector<char> buffer;
+	if (buffer.size() < size) {
+		buffer.resize(size);
+	}
+
+	ssize_t result = -1;
+	replyIO(req, [&]() { return result = stream.read(buffer.data(), size, 0); }, false);
+	if (result >= 0) {
+		fuse_reply_buf(req, buffer.data(), result);
+	}
+}
+
+static void dsp56720_cuse_write(fuse_req_t req, const char* buf, size_t size, off_t offset,
+		struct fuse_file_info* fi) {
+	auto& stream = deviceOf(req).stream();
+	if (nonBlocking(fi)) {
+		size = nonBlockingSize(size, stream.bytesPerSample(), stream.writeAvailable());
+		if (!size) {
+			fuse_reply_err(req, EAGAIN);
+			return;
+		}
+	}
+
+	replyIO(req, [&]() { return ssize_t(stream.write(buf, size, 0)); }, true);
+}
+
+static void dsp56720_cuse_ioctl(fuse_req_t req, unsigned int cmd, void* arg,
+		struct fuse_file_info* fi, unsigned int flags, const void* in, size_t inSize,
+		size_t outSize) {
+	if (flags & FUSE_IOCTL_COMPAT) {
+		fuse_reply_err(req, ENOSYS);
+		return;
+	}
+
+	auto& stream = deviceOf(req).stream();
+
+	switch (cmd) {
+		case DSP56720_STREAM_GET_RING:
+			replyValue(req, uint32_t(stream.capacity()));
+			break;
+		case DSP56720_STREAM_SET_RING: {
+			uint32_t size;
+			if (inSize < sizeof(size)) {
+				fuse_reply_err(req, EINVAL);
+				break;
+			}
+
+			memcpy(&size, in, sizeof(size));
+			if (!size || size > (1u << 24)) {
+				fuse_reply_err(req, EINVAL);
+				break;
+			}
+
+			replyValue(req, uint32_t(stream.setCapacity(size)));
+			break;
+		}
+		case DSP56720_STREAM_GET_FILL:
+			replyValue(req, uint32_t(stream.fill()));
+			break;
+		case DSP56720_STREAM_GET_FORMAT: {
+			dsp56720_stream_format format = {};
+			format.bytes_per_sample = stream.bytesPerSample();
+			format.valid_bits = std::min(24u, 8 * format.bytes_per_sample);
+			format.channels = 1;
+			replyValue(req, format);
+			break;
+		}
+		case DSP56720_STREAM_GET_RATE:
+			replyValue(req, stream.sampleRate());
+			break;
+		default:
+			fuse_reply_err(req, ENOTTY);
+			break;
+	}
+}
+
+static void dsp56720_cuse_poll(fuse_req_t req, struct fuse_file_info* fi, struct fuse_pollhandle* ph) {
+	auto& device = deviceOf(req);
+	auto& stream = device.stream();
+
+	unsigned events = 0;
+	if (stream.readReady()) {
+		events |= POLLIN | POLLRDNORM;
+	}
+
+	if (stream.writeReady()) {
+		events |= POLLOUT | POLLWRNORM;
+	}
+
+	// Kernels that don't pass the requested events get notified for both
+	unsigned requested = fi->poll_events ? fi->poll_events : POLLIN | POLLOUT;
+
+	if (ph && (events & requested)) {
+		// Ready now, the poller won't wait on this handle
+		fuse_pollhandle_destroy(ph);
+	} else if (ph) {
+		device.watch(ph, (requested & (POLLIN | POLLRDNORM) ? vfs::Event_Readable : 0)
+				| (requested & (POLLOUT | POLLWRNORM) ? vfs::Event_Writable : 0));
+	}
+
+	fuse_reply_poll(req, events);
+}
+
+static const struct cuse_lowlevel_ops operations = {
+	.open  = dsp56720_cuse_open,
+	.read  = dsp56720_cuse_read,
+	.write = dsp56720_cuse_write,
+	.ioctl = dsp56720_cuse_ioctl,
+	.poll  = dsp56720_cuse_poll,
+};
+
+vfs::CharacterDevice::CharacterDevice(const std::string& name, std::shared_ptr<Stream> stream)
+	: m_name(name), m_stream(stream) {
+	auto devname = "DEVNAME=" + name;
+	const char* info[] = { devname.c_str() };
+
+	struct cuse_info ci = {};
+	ci.dev_info_argc = 1;
+	ci.dev_info_argv = info;
+
+	char arg[] = "dsp";
+	char *argv[] = { arg };
+	struct fuse_args args = {1, argv};
+
+	// Like cuse_lowlevel_setup(), minus daemonizing and signal handlers
+	m_session = cuse_lowlevel_new(&args, &ci, &operations, this);
+	if (!m_session) {
+		throw std::runtime_error("Failed to initialize CUSE for " + name);
+	}
+
+	// Nonblocking, so loop threads that lose the race for a request return
+	// to poll(), where shutdown() can reach them
+	int fd = open("/dev/cuse", O_RDWR | O_CLOEXEC | O_NONBLOCK);
+	auto mountpoint = "/dev/fd/" + std::to_string(fd);
+	m_wake = eventfd(0, EFD_CLOEXEC);
+	if (fd < 0 || m_wake < 0 || fuse_session_mount(m_session, mountpoint.c_str())) {
+		if (fd >= 0) {
+			close(fd);
+		}
+
+		if (m_wake >= 0) {
+			close(m_wake);
+		}
+
+		fuse_session_destroy(m_session);
+		m_session = nullptr;
+		throw std::runtime_error("Failed to open /dev/cuse for " + name);
+	}
+
+	for (size_t i = 0; i < loopThreads; i++) {
+		m_threads.emplace_back([this]() { loop(); });
+	}
+
+	// The stream keeps its watcher, so it only holds the state
+	m_stream->watch([poll = m_poll](unsigned events) {
+		std::lock_guard<std::mutex> lock(poll->mutex);
+		if (events & poll->wanted) {
+			poll->pending |= events;
+			poll->changed.notify_one();
+		}
+	});
+
+	m_poller = std::thread([this]() { pollLoop(); });
+}
+
+vfs::CharacterDevice::~CharacterDevice() {
+	shutdown();
+
+	for (auto& thread : m_threads) {
+		thread.join();
+	}
+
+	if (m_poller.joinable()) {
+		m_poller.join();
+	}
+
+	std::unique_lock<std::mutex> lock(m_poll->mutex);
+	for (auto& poll : m_poll->handles) {
+		fuse_pollhandle_destroy(poll.handle);
+	}
+
+	m_poll->handles.clear();
+	m_poll->wanted = 0;
+	lock.unlock();
+
+	fuse_session_unmount(m_session);
+	fuse_session_destroy(m_session);
+	close(m_wake);
+}
+
+// Requests blocked on the stream are woken by its queue shutting down
+void vfs::CharacterDevice::shutdown() {
+	m_running = false;
+	fuse_session_exit(m_session);
+
+	{
+		std::lock_guard<std::mutex> lock(m_poll->mutex);
+		m_poll->running = false;
+	}
+
+	m_poll->changed.notify_all();
+
+	uint64_t one = 1;
+	if (write(m_wake, &one, sizeof(one)) < 0) {
+		std::cerr << "Failed to wake the loop of " << m_name << std::endl;
+	}
+}
+
+// Serve requests until shutdown. The eventfd is never read, so once
+// signalled it wakes every thread.
+void vfs::CharacterDevice::loop() {
+	struct fuse_buf buf = {};
+	struct pollfd fds[] = {
+		{fuse_session_fd(m_session), POLLIN, 0},
+		{m_wake, POLLIN, 0},
+	};
+
+	while (m_running && !fuse_session_exited(m_session)) {
+		if (poll(fds, 2, -1) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			break;
+		}
+
+		if (fds[1].revents) {
+			break;
+		}
+
+		int res = fuse_session_receive_buf(m_session, &buf);
+		if (res == -EAGAIN || res == -EINTR) {
+			continue;
+		}
+
+		if (res <= 0) {
+			break;
+		}
+
+		fuse_session_process_buf(m_session, &buf);
+	}
+
+	free(buf.mem);
+}
+
+void vfs::CharacterDevice::watch(fuse_pollhandle* handle, unsigned events) {
+	auto& poll = *m_poll;
+	std::lock_guard<std::mutex> lock(poll.mutex);
+	if (poll.handles.size() >= maxPollHandles) {
+		fuse_lowlevel_notify_poll(poll.handles.front().handle);
+		fuse_pollhandle_destroy(poll.handles.front().handle);
+		poll.handles.erase(poll.handles.begin());
+	}
+
+	poll.handles.push_back({handle, events});
+	poll.wanted |= events;
+
+	// The stream may have gained the events between the poll reply and
+	// the handle being registered, which the watcher didn't report
+	unsigned ready = (m_stream->readReady() ? Event_Readable : 0)
+		| (m_stream->writeReady() ? Event_Writable : 0);
+	if (ready & events) {
+		poll.pending |= ready & events;
+		poll.changed.notify_one();
+	}
+}
+
+// Notifies the handles waiting for the events the stream's watcher
+// reported, outside the lock so the thread that caused them never waits
+// on the kernel
+void vfs::CharacterDevice::pollLoop() {
+	auto& poll = *m_poll;
+	std::vector<fuse_pollhandle*> ready;
+	std::unique_lock<std::mutex> lock(poll.mutex);
+
+	while (poll.running) {
+		poll.changed.wait(lock, [&]() { return poll.pending || !poll.running; });
+
+		auto events = poll.pending;
+		poll.pending = 0;
+		poll.wanted = 0;
+
+		auto waiting = poll.handles.begin();
+		for (auto& handle : poll.handles) {
+			if (handle.events & events) {
+				ready.push_back(handle.handle);
+			} else {
+				poll.wanted |= handle.events;
+				*waiting++ = handle;
+			}
+		}
+
+		poll.handles.erase(waiting, poll.handles.end());
+		lock.unlock();
+
+		for (auto handle : ready) {
+			fuse_lowlevel_notify_poll(handle);
+			fuse_pollhandle_destroy(handle);
+		}
+
+		ready.clear();
+		lock.lock();
+	}
+}
@@ -0,0 +1,144 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "filesystem.h"
+#include "traits.h"
+
+struct fuse_session;
+struct fuse_pollhandle;
+
+namespace vfs {
+// A File backed by a ring, as exposed by character devices
+class Stream : public File {
+public:
+	virtual std::size_t capacity() = 0;
+	virtual std::size_t setCapacity(std::size_t capacity) = 0;
+	virtual std::size_t fill() = 0;
+	// Units a transfer can move without blocking
+	virtual std::size_t readAvailable() = 0;
+	virtual std::size_t writeAvailable() = 0;
+	bool readReady() { return readAvailable() > 0; }
+	bool writeReady() { return writeAvailable() > 0; }
+	// Call handler with the Events the stream gains, from any thread
+	virtual void watch(std::function<void(unsigned events)> handler) = 0;
+	virtual uint32_t sampleRate() = 0;
+	virtual uint32_t bytesPerSample() = 0;
+};
+
+// Stream over a device with a SequentialAccess adapter. The device provides
+// capacity(), setCapacity() and fill(); the adapter may provide
+// readAvailable(), writeAvailable() and watch(), without them the device
+// never blocks.
+template <typename Unit, typename T>
+class StreamFile : public Stream {
+public:
+	StreamFile(T& device, std::function<uint32_t()> sampleRate = nullptr)
+		: m_device(device), m_file(device), m_sampleRate(sampleRate) {}
+
+	virtual std::size_t size() override { return m_file.size(); }
+
+	virtual std::size_t read(char *buf, std::size_t count, std::size_t pos) override {
+		return m_file.read(buf, count, pos);
+	}
+
+	virtual std::size_t write(const char *buf, std::size_t count, std::size_t pos) override {
+		return m_file.write(buf, count, pos);
+	}
+
+	virtual std::size_t capacity() override { return m_device.capacity(); }
+	virtual std::size_t setCapacity(std::size_t capacity) override { return m_device.setCapacity(capacity); }
+	virtual std::size_t fill() override { return m_device.fill(); }
+
+	virtual std::size_t readAvailable() override {
+		if constexpr(HasReadAvailable<SequentialAccess<T>>::value) {
+			return m_access.readAvailable(m_device);
+		} else {
+			return SequentialAccess<T>::readable ? SIZE_MAX : 0;
+		}
+	}
+
+	virtual std::size_t writeAvailable() override {
+		if constexpr(HasWriteAvailable<SequentialAccess<T>>::value) {
+			return m_access.writeAvailable(m_device);
+		} else {
+			return SequentialAccess<T>::writable ? SIZE_MAX : 0;
+		}
+	}
+
+	virtual void watch(std::function<void(unsigned events)> handler) override {
+		if constexpr(HasWatch<SequentialAccess<T>>::value) {
+			m_access.watch(m_device, std::move(handler));
+		}
+	}
+
+	virtual uint32_t sampleRate() override { return m_sampleRate ? m_sampleRate() : 0; }
+	virtual uint32_t bytesPerSample() override { return sizeof(Unit); }
+
+private:
+	T& m_device;
+	SequentialFile<Unit, T> m_file;
+	SequentialAccess<T> m_access;
+	std::function<uint32_t()> m_sampleRate;
+};
+
+// Exposes a Stream as /dev/<name> through CUSE, with ioctls from ioctl.h
+// and poll. CUSE has no mmap, so the ring can't be mapped.
+class CharacterDevice {
+public:
+	CharacterDevice(const std::string& name, std::shared_ptr<Stream> stream);
+	~CharacterDevice();
+
+	void shutdown();
+
+	Stream& stream() { return *m_stream; }
+
+	// Remember a poll handle to notify once the stream gains one of the
+	// given Events
+	void watch(fuse_pollhandle* handle, unsigned events);
+
+private:
+	// Requests may block on the stream, so several threads serve them
+	static constexpr size_t loopThreads = 4;
+
+	// Oldest handles are notified early beyond this, a poller spinning on
+	// poll() timeouts would otherwise grow the list without bound
+	static constexpr size_t maxPollHandles = 64;
+
+	struct PollHandle {
+		fuse_pollhandle* handle;
+		unsigned events;
+	};
+
+	// Shared with the stream's watcher, which may outlive the device
+	struct PollState {
+		std::mutex mutex;
+		std::condition_variable changed;
+		std::vector<PollHandle> handles;
+		unsigned wanted = 0;  // Events any handle waits for
+		unsigned pending = 0; // Of those, events gained since last notified
+		bool running = true;
+	};
+
+	void loop();
+	void pollLoop();
+
+	std::string m_name;
+	std::shared_ptr<Stream> m_stream;
+	struct fuse_session* m_session = nullptr;
+	int m_wake = -1;
+	std::vector<std::thread> m_threads;
+
+	std::atomic<bool> m_running{true};
+	std::shared_ptr<PollState> m_poll = std::make_shared<PollState>();
+	std::thread m_poller;
+};
+}
@@ -1,109 +1,259 @@
 #define FUSE_USE_VERSION 35
 
-#include <iostream>
-#include <fuse.h>
+#include <fuse_lowlevel.h>
 
 #include "filesystem.h"
 
-static int dsp56720_open(const char *path, struct fuse_file_info *fi) {
-	vfs::Tree* tree = reinterpret_cast<vfs::Tree*>(fuse_get_context()->private_data);
+// Low-level FUSE backend. Lookups resolve one path component against the
+// node table, and open stores the vfs::File in fuse_file_info::fh, so reads
+// and writes on an open file never touch a path.
 
-	std::cerr << "open: " << path << std::endl;
-	auto file = tree->get(path);
-	if (!file) {
-		return -ENOENT;
-	}
+namespace {
+// The tree is fixed once the filesystem runs, so entries can be cached
+constexpr double entryTimeout = 60.0;
+// Sizes of generated files change all the time
+constexpr double attrTimeout = 0.0;
 
-	return 0;
+vfs::Tree& treeOf(fuse_req_t req) {
+	return *reinterpret_cast<vfs::Tree*>(fuse_req_userdata(req));
 }
 
-static int dsp56720_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
-	vfs::Tree* tree = reinterpret_cast<vfs::Tree*>(fuse_get_context()->private_data);
+vfs::File& fileOf(struct fuse_file_info* fi) {
+	return *reinterpret_cast<vfs::File*>(fi->fh);
+}
 
-	std::cerr << "read: " << path << std::endl;
-	auto file = tree->get(path);
-	if (!file) {
-		return -ENOENT;
+// Per-thread scratch buffer, only allocates when a request outgrows it
+char* scratch(size_t size) {
+	thread_local std::vector<char> buffer;
+	if (buffer.size() < size) {
+		buffer.resize(size);
 	}
 
+	return buffer.data();
+}
 
+void fillStat(const vfs::Tree::Node& node, struct stat* stbuf) {
+	*stbuf = {};
+	stbuf->st_ino = node.inode;
+
+	if (node.file) {
+		stbuf->st_mode = 0755 | S_IFREG;
+		stbuf->st_nlink = 1;
+		stbuf->st_size = node.file->size();
+	} else {
+		stbuf->st_mode = 0755 | S_IFDIR;
+		stbuf->st_nlink = 2;
+	}
+}
+
+template <typename Fn>
+void replyIO(fuse_req_t req, Fn io) {
+	ssize_t result;
 	try {
-		return file->read(buf, size, offset);
+		result = io();
 	} catch (vfs::Abort&) {
-		return -EINTR;
+		fuse_reply_err(req, EINTR);
+		return;
+	} catch (vfs::IOError&) {
+		fuse_reply_err(req, EIO);
+		return;
 	}
-};
 
-static int dsp56720_write(const char *path, const char *buf, size_t size,
-		      off_t offset, struct fuse_file_info *fi)
-{
-	vfs::Tree* tree = reinterpret_cast<vfs::Tree*>(fuse_get_context()->private_data);
+	// Files report errors as negative errno values
+	if (result < 0) {
+		fuse_reply_err(req, -result);
+	} else {
+		fuse_reply_write(req, result);
+	}
+}
+}
 
-	std::cerr << "write: " << path << std::endl;
-	auto file = tree->get(path);
-	if (!file) {
-		return -ENOENT;
+static void dsp56720_init(void* userdata, struct fuse_conn_info* conn) {
+	// Let the kernel hand stream data over through pipes
+	for (unsigned capability : {FUSE_CAP_SPLICE_READ, FUSE_CAP_SPLICE_WRITE, FUSE_CAP_SPLICE_MOVE}) {
+		if (conn->capable & capability) {
+			conn->want |= capability;
+		}
 	}
+}
 
-	try {
-		return file->write(buf, size, offset);
-	} catch (vfs::Abort&) {
-		return -EINTR;
+static void dsp56720_lookup(fuse_req_t req, fuse_ino_t parent, const char* name) {
+	auto directory = treeOf(req).node(parent);
+	if (!directory) {
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+
+	auto it = directory->children.find(name);
+	if (it == directory->children.end()) {
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+
+	struct fuse_entry_param entry = {};
+	entry.ino = it->second->inode;
+	entry.attr_timeout = attrTimeout;
+	entry.entry_timeout = entryTimeout;
+	fillStat(*it->second, &entry.attr);
+	fuse_reply_entry(req, &entry);
+}
+
+static void dsp56720_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi) {
+	auto node = treeOf(req).node(ino);
+	if (!node) {
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+
+	struct stat stbuf;
+	fillStat(*node, &stbuf);
+	fuse_reply_attr(req, &stbuf, attrTimeout);
+}
+
+static void dsp56720_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi) {
+	auto node = treeOf(req).node(ino);
+	if (!node) {
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+
+	if (!node->file) {
+		fuse_reply_err(req, EISDIR);
+		return;
 	}
+
+	// Files are generated or streamed, the page cache must not keep them
+	fi->fh = reinterpret_cast<uint64_t>(node->file.get());
+	fi->direct_io = 1;
+	fuse_reply_open(req, fi);
 }
 
-static int dsp56720_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-			off_t offset, struct fuse_file_info *fi,
-			enum fuse_readdir_flags flags)
-{
-	vfs::Tree* tree = reinterpret_cast<vfs::Tree*>(fuse_get_context()->private_data);
+static void dsp56720_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+		struct fuse_file_info* fi) {
+	auto buf = scratch(size);
+	ssize_t result;
 
-	std::cerr << "readdir: " << path << std::endl;
-	if (!tree->exists(path)) {
-		return -ENOENT;
+	try {
+		result = fileOf(fi).read(buf, size, offset);
+	} catch (vfs::Abort&) {
+		fuse_reply_err(req, EINTR);
+		return;
+	} catch (vfs::IOError&) {
+		fuse_reply_err(req, EIO);
+		return;
 	}
 
-	filler(buf, ".", NULL, 0, fuse_fill_dir_flags(0));
-	filler(buf, "..", NULL, 0, fuse_fill_dir_flags(0));
+	if (result < 0) {
+		fuse_reply_err(req, -result);
+		return;
+	}
+
+	struct fuse_bufvec data = FUSE_BUFVEC_INIT(size_t(result));
+	data.buf[0].mem = buf;
+	fuse_reply_data(req, &data, fuse_buf_copy_flags(0));
+}
 
-	for (auto const& filename : tree->list(path)) {
-		filler(buf, filename.c_str(), NULL, 0, fuse_fill_dir_flags(0));
+static void dsp56720_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec* in,
+		off_t offset, struct fuse_file_info* fi) {
+	auto size = fuse_buf_size(in);
+	const char* data;
+
+	if (in->count == 1 && !(in->buf[0].flags & FUSE_BUF_IS_FD)) {
+		data = static_cast<const char*>(in->buf[0].mem);
+	} else {
+		// Spliced from the kernel, pull it out of the pipe
+		auto buf = scratch(size);
+		struct fuse_bufvec out = FUSE_BUFVEC_INIT(size);
+		out.buf[0].mem = buf;
+
+		auto copied = fuse_buf_copy(&out, in, fuse_buf_copy_flags(0));
+		if (copied < 0) {
+			fuse_reply_err(req, -copied);
+			return;
+		}
+
+		data = buf;
+		size = copied;
 	}
 
-	return 0;
+	replyIO(req, [&]() { return ssize_t(fileOf(fi).write(data, size, offset)); });
 }
 
-static int dsp56720_getattr(const char *path, struct stat *stbuf, struct fuse_file_info *fi) {
-	vfs::Tree* tree = reinterpret_cast<vfs::Tree*>(fuse_get_context()->private_data);
+static void dsp56720_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+		struct fuse_file_info* fi) {
+	auto directory = treeOf(req).node(ino);
+	if (!directory || directory->file) {
+		fuse_reply_err(req, directory ? ENOTDIR : ENOENT);
+		return;
+	}
+
+	auto buf = scratch(size);
+	size_t used = 0;
+	off_t index = 0;
 
-	std::cerr << "getattr: " << path << std::endl;
+	auto add = [&](const char* name, const vfs::Tree::Node& node) {
+		if (index++ < offset) {
+			return true;
+		}
 
-	if (tree->exists(path)) {
-		auto file = tree->get(path);
+		struct stat stbuf;
+		fillStat(node, &stbuf);
 
-		if (file) {
-			stbuf->st_mode = 0755 | S_IFREG;
-			stbuf->st_nlink = 1;
-			stbuf->st_size = file->size();
-		} else {
-			stbuf->st_mode = 0755 | S_IFDIR;
-			stbuf->st_nlink = 2;
+		auto entry = fuse_add_direntry(req, buf + used, size - used, name, &stbuf, index);
+		if (entry > size - used) {
+			return false;
 		}
 
-		return 0;
+		used += entry;
+		return true;
+	};
+
+	if (add(".", *directory) && add("..", *directory)) {
+		for (auto& [name, child] : directory->children) {
+			if (!add(name.c_str(), *child)) {
+				break;
+			}
+		}
 	}
 
-	return -ENOENT;
+	fuse_reply_buf(req, buf, used);
 }
 
-static const struct fuse_operations operations = {
-	.getattr = dsp56720_getattr,
-	.open    = dsp56720_open,
-	.read	 = dsp56720_read,
-	.write	 = dsp56720_write,
-	.readdir = dsp56720_readdir,
+static const struct fuse_lowlevel_ops operations = {
+	.init      = dsp56720_init,
+	.lookup    = dsp56720_lookup,
+	.getattr   = dsp56720_getattr,
+	.open      = dsp56720_open,
+	.read      = dsp56720_read,
+	.readdir   = dsp56720_readdir,
+	.write_buf = dsp56720_write_buf,
 };
 
+vfs::Tree::Tree() {
+	m_nodes.push_back(std::make_unique<Node>(Node{1, nullptr, {}}));
+}
+
+void vfs::Tree::add(const std::string& filename, std::shared_ptr<File> file) {
+	m_files[filename] = file;
+
+	auto node = m_nodes.front().get();
+	size_t start = filename.find_first_not_of('/');
+
+	while (start != std::string::npos) {
+		auto end = filename.find('/', start);
+		auto& child = node->children[filename.substr(start, end - start)];
+		if (!child) {
+			m_nodes.push_back(std::make_unique<Node>(Node{m_nodes.size() + 1, nullptr, {}}));
+			child = m_nodes.back().get();
+		}
+
+		node = child;
+		start = end == std::string::npos ? end : end + 1;
+	}
+
+	node->file = file;
+}
+
 std::unordered_set<std::string> vfs::Tree::list(std::string prefix) {
 	// Prefix must have a trailing slash
 	if (prefix.back() != '/') {
@@ -148,39 +298,39 @@ bool vfs::Tree::exists(std::string prefix) {
 	return false;
 }
 
-vfs::Filesystem::Filesystem(std::string mountPoint) : m_fuse(nullptr) {
+vfs::Filesystem::Filesystem(std::string mountPoint) {
 	char arg[] = "dsp";
 	char *argv[] = { reinterpret_cast<char*>(&arg) };
 
 	struct fuse_args args = {1, argv};
-	m_fuse = fuse_new(&args, &operations, sizeof(operations), &m_tree);
-	if (!m_fuse) {
+	m_session = fuse_session_new(&args, &operations, sizeof(operations), &m_tree);
+	if (!m_session) {
 		throw std::runtime_error("Failed to initialize FUSE");
 	}
 
-	if (fuse_mount(m_fuse, mountPoint.c_str())) {
-		fuse_destroy(m_fuse);
-		m_fuse = nullptr;
+	if (fuse_session_mount(m_session, mountPoint.c_str())) {
+		fuse_session_destroy(m_session);
+		m_session = nullptr;
 	}
 }
 
 vfs::Filesystem::~Filesystem() {
-	if (m_fuse) {
-		fuse_unmount(m_fuse);
-		fuse_destroy(m_fuse);
+	if (m_session) {
+		fuse_session_unmount(m_session);
+		fuse_session_destroy(m_session);
 	}
 }
 
 void vfs::Filesystem::shutdown() {
-	if (m_fuse) {
-		fuse_exit(m_fuse);
+	if (m_session) {
+		fuse_session_exit(m_session);
 	}
 }
 
 int vfs::Filesystem::run() {
-	if (m_fuse) {
+	if (m_session) {
 		struct fuse_loop_config cfg = { .max_idle_threads = 10 };
-		return fuse_loop_mt(m_fuse, &cfg);
+		return fuse_session_loop_mt(m_session, &cfg);
 	}
 
 	return 1;
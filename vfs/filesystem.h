@@ -1,14 +1,18 @@
 #pragma once
 
 #include <filesystem>
+#include <map>
+#include <memory>
 #include <unordered_set>
 #include <unordered_map>
 #include <string>
+#include <vector>
 
-struct fuse;
+struct fuse_session;
 
 namespace vfs {
 struct Abort : public std::exception {};
+struct IOError : public std::exception {};
 
 class File {
 public:
@@ -19,17 +23,35 @@ public:
 
 class Tree {
 public:
+	// Directory entry. Inode numbers are indices into the node table plus
+	// one, so the root is inode 1 like FUSE_ROOT_ID.
+	struct Node {
+		uint64_t inode;
+		std::shared_ptr<File> file; // Null for directories
+		std::map<std::string, Node*> children;
+	};
+
+	Tree();
+
 	std::unordered_set<std::string> list(std::string prefix);
 	std::shared_ptr<File> get(std::string filename);
 	bool exists(std::string prefix);
 
 	template <typename T>
 	void put(std::string filename, T file) {
-		m_files[filename] = std::make_shared<T>(file);
+		add(filename, std::make_shared<T>(file));
+	}
+
+	// Files must all be added before the filesystem runs
+	void add(const std::string& filename, std::shared_ptr<File> file);
+
+	Node* node(uint64_t inode) {
+		return inode - 1 < m_nodes.size() ? m_nodes[inode - 1].get() : nullptr;
 	}
 
 private:
 	std::unordered_map<std::string, std::shared_ptr<File>> m_files;
+	std::vector<std::unique_ptr<Node>> m_nodes;
 };
 
 class Filesystem {
@@ -43,7 +65,7 @@ public:
 	Tree& tree() { return m_tree; }
 
 private:
-	struct fuse* m_fuse = NULL;
+	struct fuse_session* m_session = nullptr;
 	Tree m_tree;
 };
 }
@@ -0,0 +1,27 @@
+#pragma once
+
+// ioctl interface of the character devices, usable from C host programs
+
+#include <stdint.h>
+#include <sys/ioctl.h>
+
+struct dsp56720_stream_format {
+	uint32_t bytes_per_sample; // Size of one sample in the stream
+	uint32_t valid_bits;       // Significant low bits of each sample
+	uint32_t channels;         // Interleaved channels per frame
+};
+
+#define DSP56720_STREAM_MAGIC 'D'
+
+// Ring size in samples. Setting rounds up to a power of two and returns the
+// size actually used.
+#define DSP56720_STREAM_GET_RING _IOR(DSP56720_STREAM_MAGIC, 1, uint32_t)
+#define DSP56720_STREAM_SET_RING _IOWR(DSP56720_STREAM_MAGIC, 2, uint32_t)
+
+// Samples currently queued
+#define DSP56720_STREAM_GET_FILL _IOR(DSP56720_STREAM_MAGIC, 3, uint32_t)
+
+#define DSP56720_STREAM_GET_FORMAT _IOR(DSP56720_STREAM_MAGIC, 4, struct dsp56720_stream_format)
+
+// Frames per second, 0 for streams without a sample clock
+#define DSP56720_STREAM_GET_RATE _IOR(DSP56720_STREAM_MAGIC, 5, uint32_t)
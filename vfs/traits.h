@@ -7,6 +7,53 @@ namespace vfs {
 template <typename T>
 struct SequentialAccess;
 
+// SequentialAccess specializations may additionally provide readBlock and
+// writeBlock to move a whole buffer at once
+template <typename Access, typename = void>
+struct HasReadBlock : std::false_type {};
+
+template <typename Access>
+struct HasReadBlock<Access, std::void_t<decltype(&Access::readBlock)>>
+	: std::true_type {};
+
+template <typename Access, typename = void>
+struct HasWriteBlock : std::false_type {};
+
+template <typename Access>
+struct HasWriteBlock<Access, std::void_t<decltype(&Access::writeBlock)>>
+	: std::true_type {};
+
+// They may also provide readAvailable and writeAvailable, the number of
+// units the next transfer can move without blocking
+template <typename Access, typename = void>
+struct HasReadAvailable : std::false_type {};
+
+template <typename Access>
+struct HasReadAvailable<Access, std::void_t<decltype(&Access::readAvailable)>>
+	: std::true_type {};
+
+template <typename Access, typename = void>
+struct HasWriteAvailable : std::false_type {};
+
+template <typename Access>
+struct HasWriteAvailable<Access, std::void_t<decltype(&Access::writeAvailable)>>
+	: std::true_type {};
+
+// Readiness edges, a device stopped being unreadable or unwritable
+enum Event : unsigned {
+	Event_Readable = 1,
+	Event_Writable = 2,
+};
+
+// Those that do should provide watch, which registers a callback for the
+// events of the device. It may be called on any thread.
+template <typename Access, typename = void>
+struct HasWatch : std::false_type {};
+
+template <typename Access>
+struct HasWatch<Access, std::void_t<decltype(&Access::watch)>>
+	: std::true_type {};
+
 // This will discard data from anything that provides a too small buffer
 template <typename Unit, typename T>
 class SequentialFile : public File {
@@ -18,7 +65,11 @@ public:
 	}
 
 	virtual std::size_t read(char *buf, std::size_t count, std::size_t pos) override {
-		if constexpr(SequentialAccess<T>::readable) {
+		if constexpr(HasReadBlock<SequentialAccess<T>>::value) {
+			auto units = count / sizeof(Unit);
+			m_access.readBlock(m_device, reinterpret_cast<Unit*>(buf), units);
+			return count;
+		} else if constexpr(SequentialAccess<T>::readable) {
 			auto words = reinterpret_cast<Unit*>(buf);
 			for (size_t i = 0; i < count / sizeof(Unit); i++) {
 				*words++ = m_access.read(m_device);
@@ -31,7 +82,11 @@ public:
 	}
 
 	virtual std::size_t write(const char *buf, std::size_t count, std::size_t pos) override {
-		if constexpr(SequentialAccess<T>::writable) {
+		if constexpr(HasWriteBlock<SequentialAccess<T>>::value) {
+			auto units = count / sizeof(Unit);
+			m_access.writeBlock(m_device, reinterpret_cast<const Unit*>(buf), units);
+			return count;
+		} else if constexpr(SequentialAccess<T>::writable) {
 			auto words = reinterpret_cast<const Unit*>(buf);
 			for (size_t i = 0; i < count / sizeof(Unit); i++) {
 				m_access.write(m_device, *words++);